@@ -0,0 +1,167 @@
+//
+//  ADAuthenticationContextTests.m
+//  7ElevenTests
+//
+
+#import <XCTest/XCTest.h>
+#import <ADALiOS/ADALiOS.h>
+#import <ADALiOS/ADAuthenticationContext.h>
+#import <ADALiOS/ADAuthenticationSettings.h>
+#import <ADALiOS/ADKeychainTokenCacheStore.h>
+#import <ADALiOS/ADLoopbackTransport.h>
+#import <ADALiOS/ADTokenCacheStoreItem.h>
+#import <ADALiOS/ADTokenCacheStoreKey.h>
+#import <ADALiOS/ADUserInformation.h>
+
+static NSString* const sAuthority = @"https://login.windows.net/contoso.com";
+static NSString* const sClientId = @"c3c7f5e5-7153-44d4-90e6-329686d48d76";
+static NSString* const sResource = @"https://resource.contoso.com";
+//The time, in seconds, given to the asynchronous operations of the tests:
+static const NSTimeInterval sTimeout = 10;
+//The number of the callers, which ask for the same token at once:
+static const NSUInteger sConcurrentCallers = 8;
+//The expirations of the background refresh test: inside the refresh window (the 5 minute lead plus the default
+//expirationBuffer, i.e. 10 minutes), but still usable from the cache, and well outside of the window:
+static const NSTimeInterval sInsideRefreshWindow = 7 * 60;
+static const NSTimeInterval sOutsideRefreshWindow = 60 * 60;
+//The time, in seconds, given to a wrong background refresh to show up:
+static const NSTimeInterval sQuietPeriod = 1;
+
+@interface ADAuthenticationContextTests : XCTestCase
+{
+    id<ADHTTPTransport> mTransport;
+    ADLoopbackTransport* mLoopback;
+    ADKeychainTokenCacheStore* mStore;
+    ADAuthenticationContext* mContext;
+}
+
+@end
+
+@implementation ADAuthenticationContextTests
+
+-(void) setUp
+{
+    [super setUp];
+    mTransport = [ADAuthenticationSettings sharedInstance].httpTransport;
+    mLoopback = [ADLoopbackTransport new];
+    [ADAuthenticationSettings sharedInstance].httpTransport = mLoopback;
+    
+    //The application group, not shared with the other applications:
+    mStore = [[ADKeychainTokenCacheStore alloc] initWithGroup:nil];
+    [mStore removeAllWithError:nil];
+    mContext = [ADAuthenticationContext authenticationContextWithAuthority:sAuthority
+                                                         validateAuthority:NO
+                                                           tokenCacheStore:mStore
+                                                                     error:nil];
+}
+
+-(void) tearDown
+{
+    mContext.backgroundRefreshEnabled = NO;
+    mContext = nil;
+    [mStore removeAllWithError:nil];
+    mStore = nil;
+    [ADAuthenticationSettings sharedInstance].httpTransport = mTransport;
+    [super tearDown];
+}
+
+//A cached item with an access token, which expires after the passed number of seconds, and a refresh token:
+-(ADTokenCacheStoreItem*) itemWithResource: (NSString*) resource
+                                 expiresIn: (NSTimeInterval) expiresIn
+{
+    ADTokenCacheStoreItem* item = [ADTokenCacheStoreItem new];
+    item.authority = sAuthority;
+    item.resource = resource;
+    item.clientId = sClientId;
+    item.accessToken = [[NSUUID UUID] UUIDString];
+    item.accessTokenType = @"Bearer";
+    item.refreshToken = [[NSUUID UUID] UUIDString];
+    item.expiresOn = [NSDate dateWithTimeIntervalSinceNow:expiresIn];
+    item.userInformation = [ADUserInformation userInformationWithUserId:@"User@Contoso.com" error:nil];
+    return item;
+}
+
+//Requests the token silently and waits for the result:
+-(ADAuthenticationResult*) acquireTokenSilentWithResource: (NSString*) resource
+{
+    __block ADAuthenticationResult* toReturn = nil;
+    XCTestExpectation* expectation = [self expectationWithDescription:resource];
+    [mContext acquireTokenSilentWithResource:resource
+                                    clientId:sClientId
+                                 redirectUri:nil
+                             completionBlock:^(ADAuthenticationResult *result)
+     {
+         toReturn = result;
+         [expectation fulfill];
+     }];
+    [self waitForExpectationsWithTimeout:sTimeout handler:nil];
+    return toReturn;
+}
+
+-(NSString*) cachedAccessTokenOfItem: (ADTokenCacheStoreItem*) item
+{
+    return [mStore getItemWithKey:[item extractKeyWithError:nil] userId:item.userInformation.userId error:nil].accessToken;
+}
+
+-(void) testBackgroundRefreshOnlyInsideWindow
+{
+    ADTokenCacheStoreItem* inside = [self itemWithResource:@"https://inside.contoso.com" expiresIn:sInsideRefreshWindow];
+    ADTokenCacheStoreItem* outside = [self itemWithResource:@"https://outside.contoso.com" expiresIn:sOutsideRefreshWindow];
+    [mStore addOrUpdateItems:@[inside, outside] failures:nil error:nil];
+    [mLoopback addTokenResponseForAuthority:sAuthority resource:inside.resource];
+    
+    //Only the tokens, which the application requested after enabling, are refreshed:
+    mContext.backgroundRefreshEnabled = YES;
+    XCTAssertEqualObjects([self acquireTokenSilentWithResource:inside.resource].accessToken, inside.accessToken);
+    XCTAssertEqualObjects([self acquireTokenSilentWithResource:outside.resource].accessToken, outside.accessToken);
+    XCTAssertEqual(mLoopback.requestCount, 0);
+    
+    //Restarting the refresh scans the cache at once, instead of after the scan interval:
+    mContext.backgroundRefreshEnabled = NO;
+    mContext.backgroundRefreshEnabled = YES;
+    NSDate* deadline = [NSDate dateWithTimeIntervalSinceNow:sTimeout];
+    while ([[self cachedAccessTokenOfItem:inside] isEqualToString:inside.accessToken] && [deadline timeIntervalSinceNow] > 0)
+    {
+        [NSThread sleepForTimeInterval:0.05];
+    }
+    [NSThread sleepForTimeInterval:sQuietPeriod];
+    
+    XCTAssertNotEqualObjects([self cachedAccessTokenOfItem:inside], inside.accessToken);
+    XCTAssertEqualObjects([self cachedAccessTokenOfItem:outside], outside.accessToken);
+    XCTAssertEqual(mLoopback.requestCount, 1);
+}
+
+-(void) testConcurrentRefreshesOfSameItemSendOneRequest
+{
+    ADTokenCacheStoreItem* item = [self itemWithResource:sResource expiresIn:-3600];
+    [mStore addOrUpdateItem:item error:nil];
+    [mLoopback addTokenResponseForAuthority:sAuthority resource:sResource];
+    //Keeps the first redemption in flight while the others arrive:
+    mLoopback.latency = 0.5;
+    
+    NSMutableArray* accessTokens = [NSMutableArray new];
+    for(NSUInteger i = 0; i < sConcurrentCallers; ++i)
+    {
+        XCTestExpectation* expectation = [self expectationWithDescription:[NSString stringWithFormat:@"Caller %lu", (unsigned long)i]];
+        [mContext acquireTokenSilentWithResource:sResource
+                                        clientId:sClientId
+                                     redirectUri:nil
+                                 completionBlock:^(ADAuthenticationResult *result)
+         {
+             XCTAssertEqual(result.status, AD_SUCCEEDED);
+             @synchronized(accessTokens)
+             {
+                 [accessTokens addObject:(result.accessToken) ? result.accessToken : [NSNull null]];
+             }
+             [expectation fulfill];
+         }];
+    }
+    [self waitForExpectationsWithTimeout:sTimeout handler:nil];
+    
+    XCTAssertEqual(mLoopback.requestCount, 1);
+    XCTAssertEqual(accessTokens.count, sConcurrentCallers);
+    XCTAssertEqual([NSSet setWithArray:accessTokens].count, 1);
+    XCTAssertNotEqualObjects(accessTokens.firstObject, item.accessToken);
+}
+
+@end
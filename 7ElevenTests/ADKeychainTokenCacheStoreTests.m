@@ -0,0 +1,367 @@
+//
+//  ADKeychainTokenCacheStoreTests.m
+//  7ElevenTests
+//
+
+#import <XCTest/XCTest.h>
+#import <Security/Security.h>
+#import <ADALiOS/ADALiOS.h>
+#import <ADALiOS/ADKeychainTokenCacheStore.h>
+#import <ADALiOS/ADMemoryTokenCacheStore.h>
+#import <ADALiOS/ADTokenCacheStoreItem.h>
+#import <ADALiOS/ADTokenCacheStoreKey.h>
+#import <ADALiOS/ADUserInformation.h>
+
+//The number of distinct cache keys and of the operations per iteration of the contention benchmarks:
+static const NSUInteger sBenchmarkKeys = 16;
+static const NSUInteger sBenchmarkOperations = 400;
+//Every n-th operation of the mixed benchmarks is a write:
+static const NSUInteger sWriteInterval = 8;
+//The number of the reader/remover interleavings of the removal test:
+static const NSUInteger sRemovalIterations = 50;
+//The time, in seconds, given to the notification of a change made by another application:
+static const NSTimeInterval sExternalChangeTimeout = 5;
+//The time, in seconds, and the budget of the garbage collection passes of the shared group test:
+static const NSTimeInterval sGarbageCollectionTimeout = 5;
+static const NSUInteger sGarbageCollectionBudget = 1000;
+//The time, in seconds, given to the background compaction of the duplicated items:
+static const NSTimeInterval sCompactionTimeout = 5;
+//The shared group, where the test puts the duplicate; the application group is the other one:
+static NSString* const sDuplicateGroup = @"com.microsoft.adalcache";
+
+@interface ADKeychainTokenCacheStoreTests : XCTestCase
+{
+    ADKeychainTokenCacheStore* mStore;
+}
+
+@end
+
+@implementation ADKeychainTokenCacheStoreTests
+
+-(void) setUp
+{
+    [super setUp];
+    //The application group, not shared with the other applications:
+    mStore = [[ADKeychainTokenCacheStore alloc] initWithGroup:nil];
+    mStore.maxItemCount = 0;
+    [mStore removeAllWithError:nil];
+}
+
+-(void) tearDown
+{
+    [mStore removeAllWithError:nil];
+    mStore = nil;
+    [super tearDown];
+}
+
+-(ADTokenCacheStoreItem*) itemWithResource: (NSString*) resource
+{
+    ADTokenCacheStoreItem* item = [ADTokenCacheStoreItem new];
+    item.authority = @"https://login.windows.net/contoso.com";
+    item.resource = resource;
+    item.clientId = @"c3c7f5e5-7153-44d4-90e6-329686d48d76";
+    item.accessToken = [@"" stringByPaddingToLength:1200 withString:@"eyJ0eXAiOiJKV1Qi" startingAtIndex:0];
+    item.accessTokenType = @"Bearer";
+    item.refreshToken = [@"" stringByPaddingToLength:800 withString:@"AAABAAAAiL9Kn2Z27Uu" startingAtIndex:0];
+    item.expiresOn = [NSDate dateWithTimeIntervalSinceNow:3600];
+    item.userInformation = [ADUserInformation userInformationWithUserId:@"User@Contoso.com" error:nil];
+    return item;
+}
+
+-(NSArray*) benchmarkItems
+{
+    NSMutableArray* items = [NSMutableArray new];
+    for(NSUInteger i = 0; i < sBenchmarkKeys; ++i)
+    {
+        [items addObject:[self itemWithResource:[NSString stringWithFormat:@"https://resource%lu.contoso.com", (unsigned long)i]]];
+    }
+    return items;
+}
+
+//Runs the reads and writes of the items from many threads at once:
+-(void) runMixedOperationsOnStore: (id<ADTokenCacheStoring>) store
+                            items: (NSArray*) items
+{
+    dispatch_apply(sBenchmarkOperations, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t i)
+    {
+        ADTokenCacheStoreItem* item = [items objectAtIndex:(i % items.count)];
+        if (0 == (i % sWriteInterval))
+        {
+            [store addOrUpdateItem:item error:nil];
+        }
+        else
+        {
+            [store getItemWithKey:[item extractKeyWithError:nil] userId:item.userInformation.userId error:nil];
+        }
+    });
+}
+
+-(void) testConcurrentWritesOfDifferentKeys
+{
+    NSArray* items = [self benchmarkItems];
+    dispatch_apply(items.count, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t i)
+    {
+        ADAuthenticationError* error = nil;
+        [mStore addOrUpdateItem:[items objectAtIndex:i] error:&error];
+        XCTAssertNil(error);
+    });
+    
+    for(ADTokenCacheStoreItem* item in items)
+    {
+        ADAuthenticationError* error = nil;
+        ADTokenCacheStoreItem* stored = [mStore getItemWithKey:[item extractKeyWithError:nil] userId:item.userInformation.userId error:&error];
+        XCTAssertNil(error);
+        XCTAssertEqualObjects(stored.resource, item.resource);
+        XCTAssertEqualObjects(stored.accessToken, item.accessToken);
+    }
+    XCTAssertEqual([mStore allItemsWithError:nil].count, items.count);
+}
+
+-(NSSet*) resourcesOfItems: (NSArray*) items
+{
+    return [NSSet setWithArray:[items valueForKey:@"resource"]];
+}
+
+-(void) testIndexedQueriesAfterRemoveAndAdd
+{
+    ADTokenCacheStoreItem* first = [self itemWithResource:@"https://first.contoso.com"];
+    ADTokenCacheStoreItem* second = [self itemWithResource:@"https://second.contoso.com"];
+    ADTokenCacheStoreItem* other = [self itemWithResource:@"https://first.contoso.com"];
+    other.userInformation = [ADUserInformation userInformationWithUserId:@"Other@Contoso.com" error:nil];
+    [mStore addOrUpdateItems:@[first, second, other] failures:nil error:nil];
+    NSString* userId = first.userInformation.userId;
+    
+    //The first queries build the index:
+    XCTAssertEqual([mStore itemsWithUserId:userId error:nil].count, 2);
+    XCTAssertEqual([mStore itemsWithAuthority:first.authority clientId:first.clientId error:nil].count, 3);
+    
+    [mStore removeItemWithKey:[second extractKeyWithError:nil] userId:userId error:nil];
+    ADTokenCacheStoreItem* third = [self itemWithResource:@"https://third.contoso.com"];
+    [mStore addOrUpdateItem:third error:nil];
+    [mStore removeItemsWithUserId:other.userInformation.userId error:nil];
+    
+    NSSet* expected = [NSSet setWithObjects:first.resource, third.resource, nil];
+    XCTAssertEqualObjects([self resourcesOfItems:[mStore itemsWithUserId:userId error:nil]], expected);
+    XCTAssertEqual([mStore itemsWithUserId:other.userInformation.userId error:nil].count, 0);
+    NSArray* byAuthority = [mStore itemsWithAuthority:first.authority clientId:first.clientId error:nil];
+    XCTAssertEqual(byAuthority.count, 2);
+    XCTAssertEqualObjects([self resourcesOfItems:byAuthority], expected);
+    //The index agrees with the full scan:
+    XCTAssertEqualObjects([self resourcesOfItems:[mStore allItemsWithError:nil]], expected);
+}
+
+-(void) testMemoryStoreSeesConcurrentWrites
+{
+    ADMemoryTokenCacheStore* memoryStore = [[ADMemoryTokenCacheStore alloc] initWithStore:mStore];
+    NSArray* items = [self benchmarkItems];
+    [self runMixedOperationsOnStore:memoryStore items:items];
+    
+    //Written directly to the keychain store, behind the back of the memory store:
+    ADTokenCacheStoreItem* updated = [[items firstObject] copy];
+    updated.accessToken = @"updated";
+    [mStore addOrUpdateItem:updated error:nil];
+    ADTokenCacheStoreItem* read = [memoryStore getItemWithKey:[updated extractKeyWithError:nil] userId:updated.userInformation.userId error:nil];
+    XCTAssertEqualObjects(read.accessToken, @"updated");
+}
+
+-(void) testMemoryStoreDoesNotServeItemsRemovedDuringRead
+{
+    ADMemoryTokenCacheStore* memoryStore = [[ADMemoryTokenCacheStore alloc] initWithStore:mStore];
+    ADTokenCacheStoreItem* item = [self itemWithResource:@"https://removed.contoso.com"];
+    ADTokenCacheStoreKey* key = [item extractKeyWithError:nil];
+    NSString* userId = item.userInformation.userId;
+    for(NSUInteger i = 0; i < sRemovalIterations; ++i)
+    {
+        [memoryStore addOrUpdateItem:item error:nil];
+        //The reader has to go to the keychain, so that its read races with the removal:
+        [memoryStore flush];
+        
+        dispatch_group_t group = dispatch_group_create();
+        dispatch_group_async(group, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^
+        {
+            [memoryStore getItemWithKey:key userId:userId error:nil];
+        });
+        [memoryStore removeItemsWithUserId:userId error:nil];
+        dispatch_group_wait(group, DISPATCH_TIME_FOREVER);
+        
+        XCTAssertNil([memoryStore getItemWithKey:key userId:userId error:nil], @"Iteration %lu", (unsigned long)i);
+        XCTAssertNil([memoryStore getItemWithKey:key userId:nil error:nil], @"Iteration %lu", (unsigned long)i);
+    }
+}
+
+-(void) testMemoryStoreDropsItemsAfterExternalChange
+{
+    //Two stores of the default shared group; the second one stands for another application of the group:
+    ADKeychainTokenCacheStore* sharedStore = [ADKeychainTokenCacheStore new];
+    ADKeychainTokenCacheStore* otherStore = [ADKeychainTokenCacheStore new];
+    ADMemoryTokenCacheStore* memoryStore = [[ADMemoryTokenCacheStore alloc] initWithStore:sharedStore];
+    ADTokenCacheStoreItem* item = [self itemWithResource:@"https://external.contoso.com"];
+    ADTokenCacheStoreKey* key = [item extractKeyWithError:nil];
+    NSString* userId = item.userInformation.userId;
+    [memoryStore addOrUpdateItem:item error:nil];
+    XCTAssertEqualObjects([memoryStore getItemWithKey:key userId:userId error:nil].accessToken, item.accessToken);
+    
+    uint64_t generation = sharedStore.generation;
+    ADTokenCacheStoreItem* external = [item copy];
+    external.accessToken = @"external";
+    [otherStore addOrUpdateItem:external error:nil];
+    
+    //The change is picked up by the notification handler, on a background queue:
+    NSDate* deadline = [NSDate dateWithTimeIntervalSinceNow:sExternalChangeTimeout];
+    while (sharedStore.generation == generation && [deadline timeIntervalSinceNow] > 0)
+    {
+        [[NSRunLoop currentRunLoop] runUntilDate:[NSDate dateWithTimeIntervalSinceNow:0.01]];
+    }
+    XCTAssertNotEqual(sharedStore.generation, generation);
+    XCTAssertEqualObjects([memoryStore getItemWithKey:key userId:userId error:nil].accessToken, @"external");
+    
+    [otherStore removeItemWithKey:key userId:userId error:nil];
+}
+
+//An item, which cannot provide an access token anymore, so that the garbage collection evicts it if allowed to:
+-(ADTokenCacheStoreItem*) unusableItemWithClientId: (NSString*) clientId
+{
+    ADTokenCacheStoreItem* item = [self itemWithResource:@"https://collected.contoso.com"];
+    item.clientId = clientId;
+    item.refreshToken = nil;
+    item.expiresOn = [NSDate dateWithTimeIntervalSinceNow:-3600];
+    return item;
+}
+
+-(void) testGarbageCollectionKeepsOtherApplicationsItemsInSharedGroup
+{
+    ADKeychainTokenCacheStore* sharedStore = [ADKeychainTokenCacheStore new];
+    //Stands for another application of the group:
+    ADKeychainTokenCacheStore* otherStore = [ADKeychainTokenCacheStore new];
+    XCTAssertEqual(sharedStore.maxItemCount, 0);
+    
+    ADTokenCacheStoreItem* own = [self unusableItemWithClientId:@"c3c7f5e5-7153-44d4-90e6-329686d48d76"];
+    ADTokenCacheStoreItem* foreign = [self unusableItemWithClientId:@"5a434691-ccb2-4fd1-b97b-b64bcfbc03fc"];
+    [sharedStore addOrUpdateItem:own error:nil];
+    [otherStore addOrUpdateItem:foreign error:nil];
+    ADTokenCacheStoreKey* ownKey = [own extractKeyWithError:nil];
+    ADTokenCacheStoreKey* foreignKey = [foreign extractKeyWithError:nil];
+    NSString* userId = own.userInformation.userId;
+    
+    //A scheduled pass may be in progress, in which case the explicit one returns at once:
+    NSDate* deadline = [NSDate dateWithTimeIntervalSinceNow:sGarbageCollectionTimeout];
+    while ([sharedStore getItemWithKey:ownKey userId:userId error:nil] && [deadline timeIntervalSinceNow] > 0)
+    {
+        [sharedStore collectGarbageWithBudget:sGarbageCollectionBudget];
+        [NSThread sleepForTimeInterval:0.01];
+    }
+    
+    XCTAssertNil([sharedStore getItemWithKey:ownKey userId:userId error:nil]);
+    XCTAssertNotNil([sharedStore getItemWithKey:foreignKey userId:userId error:nil]);
+    
+    [otherStore removeItemWithKey:foreignKey userId:userId error:nil];
+}
+
+//Returns the attributes of all of the keychain copies of the items of the resource, in any access group:
+-(NSArray*) keychainCopiesOfResource: (NSString*) resource
+{
+    NSDictionary* query = @{ (__bridge id)kSecClass:(__bridge id)kSecClassGenericPassword,
+                             (__bridge id)kSecReturnAttributes:@YES,
+                             (__bridge id)kSecMatchLimit:(__bridge id)kSecMatchLimitAll };
+    CFTypeRef result = NULL;
+    if (errSecSuccess != SecItemCopyMatching((__bridge CFDictionaryRef)query, &result))
+    {
+        return @[];
+    }
+    NSString* encodedResource = [resource adBase64UrlEncode];
+    NSMutableArray* copies = [NSMutableArray new];
+    for(NSDictionary* attributes in (__bridge_transfer NSArray*)result)
+    {
+        if ([[attributes objectForKey:(__bridge id)kSecAttrService] rangeOfString:encodedResource].location != NSNotFound)
+        {
+            [copies addObject:attributes];
+        }
+    }
+    return copies;
+}
+
+//The store queries the keychain without the access group on the simulator only (see ADKeyChainHelper's
+//addStandardAttributes), so that is where the copies of the other groups show up as duplicates:
+#if TARGET_IPHONE_SIMULATOR
+-(void) testCompactionKeepsNewestCopyInItsOwnGroup
+{
+    ADTokenCacheStoreItem* item = [self itemWithResource:@"https://duplicated.contoso.com"];
+    [mStore addOrUpdateItem:item error:nil];
+    NSArray* copies = [self keychainCopiesOfResource:item.resource];
+    XCTAssertEqual(copies.count, 1);
+    NSDictionary* original = copies.firstObject;
+    NSString* group = [original objectForKey:(__bridge id)kSecAttrAccessGroup];
+    NSRange prefix = [group rangeOfString:@"."];
+    if (NSNotFound == prefix.location)
+    {
+        NSLog(@"The application access group has no team prefix; the duplicate cannot be created.");
+        return;
+    }
+    NSString* otherGroup = [[group substringToIndex:NSMaxRange(prefix)] stringByAppendingString:sDuplicateGroup];
+    
+    NSMutableDictionary* query = [NSMutableDictionary dictionaryWithDictionary:@{
+        (__bridge id)kSecClass:(__bridge id)kSecClassGenericPassword,
+        (__bridge id)kSecAttrService:[original objectForKey:(__bridge id)kSecAttrService],
+        (__bridge id)kSecAttrAccount:[original objectForKey:(__bridge id)kSecAttrAccount],
+        (__bridge id)kSecAttrAccessGroup:group,
+        }];
+    [query setObject:@YES forKey:(__bridge id)kSecReturnData];
+    CFTypeRef data = NULL;
+    XCTAssertEqual(SecItemCopyMatching((__bridge CFDictionaryRef)query, &data), errSecSuccess);
+    [query removeObjectForKey:(__bridge id)kSecReturnData];
+    
+    //The copy in the other group is the newer one; the modification dates have a resolution of a second:
+    [NSThread sleepForTimeInterval:1.1];
+    NSMutableDictionary* duplicate = [query mutableCopy];
+    [duplicate setObject:otherGroup forKey:(__bridge id)kSecAttrAccessGroup];
+    [duplicate setObject:[original objectForKey:(__bridge id)kSecAttrGeneric] forKey:(__bridge id)kSecAttrGeneric];
+    [duplicate setObject:(__bridge_transfer NSData*)data forKey:(__bridge id)kSecValueData];
+    OSStatus status = SecItemAdd((__bridge CFDictionaryRef)duplicate, NULL);
+    if (errSecSuccess != status)
+    {
+        NSLog(@"The access group %@ is not available (%d); the duplicate cannot be created.", otherGroup, (int)status);
+        return;
+    }
+    
+    //The full scan finds the duplicate and deletes the older copy in the background:
+    XCTAssertEqual([mStore allItemsWithError:nil].count, 1);
+    NSDate* deadline = [NSDate dateWithTimeIntervalSinceNow:sCompactionTimeout];
+    while ((copies = [self keychainCopiesOfResource:item.resource]).count > 1 && [deadline timeIntervalSinceNow] > 0)
+    {
+        [NSThread sleepForTimeInterval:0.05];
+    }
+    
+    XCTAssertEqual(copies.count, 1);
+    XCTAssertEqualObjects([copies.firstObject objectForKey:(__bridge id)kSecAttrAccessGroup], otherGroup);
+    XCTAssertNotNil([mStore getItemWithKey:[item extractKeyWithError:nil] userId:item.userInformation.userId error:nil]);
+    
+    [duplicate removeObjectForKey:(__bridge id)kSecValueData];
+    [duplicate removeObjectForKey:(__bridge id)kSecAttrGeneric];
+    SecItemDelete((__bridge CFDictionaryRef)duplicate);
+}
+#endif
+
+#pragma mark - Benchmarks
+
+-(void) testKeychainStoreContentionPerformance
+{
+    NSArray* items = [self benchmarkItems];
+    [mStore addOrUpdateItems:items failures:nil error:nil];
+    [self measureBlock:^
+     {
+         [self runMixedOperationsOnStore:mStore items:items];
+     }];
+}
+
+-(void) testMemoryStoreContentionPerformance
+{
+    NSArray* items = [self benchmarkItems];
+    ADMemoryTokenCacheStore* memoryStore = [[ADMemoryTokenCacheStore alloc] initWithStore:mStore];
+    [memoryStore addOrUpdateItems:items failures:nil error:nil];
+    [self measureBlock:^
+     {
+         [self runMixedOperationsOnStore:memoryStore items:items];
+     }];
+}
+
+@end
@@ -0,0 +1,105 @@
+//
+//  ADLoggerTests.m
+//  7ElevenTests
+//
+
+#import <XCTest/XCTest.h>
+#import <ADALiOS/ADALiOS.h>
+#import <ADALiOS/ADLogger.h>
+#import <ADALiOS/ADLogger+Internal.h>
+
+//The number of log statements in each iteration of the benchmarks:
+static const NSUInteger sDisabledStatements = 100000;
+static const NSUInteger sEnabledStatements = 1000;
+
+@interface ADLoggerTests : XCTestCase
+{
+    ADAL_LOG_LEVEL mLevel;
+    BOOL mNSLogging;
+}
+
+@end
+
+@implementation ADLoggerTests
+
+-(void) setUp
+{
+    [super setUp];
+    mLevel = [ADLogger getLevel];
+    mNSLogging = [ADLogger getNSLogging];
+    [ADLogger setNSLogging:NO];
+}
+
+-(void) tearDown
+{
+    [ADLogger flush];
+    [ADLogger setLevel:mLevel];
+    [ADLogger setNSLogging:mNSLogging];
+    [super tearDown];
+}
+
+//Counts its calls, to check whether the arguments of a statement are evaluated:
+static NSUInteger sEvaluations = 0;
+static NSString* Evaluated(void)
+{
+    ++sEvaluations;
+    return @"value";
+}
+
+-(void) testDisabledStatementsSkipArguments
+{
+    [ADLogger setLevel:ADAL_LOG_LEVEL_ERROR];
+    sEvaluations = 0;
+    AD_LOG_VERBOSE_F(@"Disabled", @"Value: %@", Evaluated());
+    AD_LOG_INFO(@"Disabled", Evaluated());
+    XCTAssertEqual(sEvaluations, 0);
+    
+    //Raising the level enables the statements, unless the compile-time floor (WARN in the release builds) removed them:
+    [ADLogger setLevel:ADAL_LOG_LEVEL_VERBOSE];
+    AD_LOG_VERBOSE_F(@"Enabled", @"Value: %@", Evaluated());
+    XCTAssertEqual(sEvaluations, AD_LOG_ENABLED(ADAL_LOG_LEVEL_VERBOSE) ? 1 : 0);
+}
+
+-(void) testRecordCallbackReceivesEnabledStatements
+{
+    __block NSUInteger received = 0;
+    [ADLogger setLevel:ADAL_LOG_LEVEL_INFO];
+    [ADLogger setLogRecordCallback:^(ADLogRecord* record)
+     {
+         ++received;
+     }];
+    AD_LOG_INFO(@"Enabled", nil);
+    AD_LOG_VERBOSE(@"Disabled", nil);
+    [ADLogger flush];
+    [ADLogger setLogRecordCallback:nil];
+    XCTAssertEqual(received, 1);
+}
+
+#pragma mark - Benchmarks
+
+-(void) testDisabledStatementPerformance
+{
+    [ADLogger setLevel:ADAL_LOG_LEVEL_ERROR];
+    [self measureBlock:^
+     {
+         for(NSUInteger i = 0; i < sDisabledStatements; ++i)
+         {
+             AD_LOG_VERBOSE_F(@"Benchmark", @"Iteration %lu of %@", (unsigned long)i, @"the benchmark");
+         }
+     }];
+}
+
+-(void) testEnabledStatementPerformance
+{
+    [ADLogger setLevel:ADAL_LOG_LEVEL_INFO];
+    [self measureBlock:^
+     {
+         for(NSUInteger i = 0; i < sEnabledStatements; ++i)
+         {
+             AD_LOG_INFO_F(@"Benchmark", @"Iteration %lu of %@", (unsigned long)i, @"the benchmark");
+         }
+         [ADLogger flush];
+     }];
+}
+
+@end
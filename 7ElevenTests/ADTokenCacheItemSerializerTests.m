@@ -0,0 +1,125 @@
+//
+//  ADTokenCacheItemSerializerTests.m
+//  7ElevenTests
+//
+
+#import <XCTest/XCTest.h>
+#import <ADALiOS/ADALiOS.h>
+#import <ADALiOS/ADTokenCacheStoreItem.h>
+#import <ADALiOS/ADUserInformation.h>
+#import <ADALiOS/ADTokenCacheItemSerializer.h>
+
+//The number of items encoded or decoded in each iteration of the benchmarks:
+static const NSUInteger sBenchmarkItems = 1000;
+
+@interface ADTokenCacheItemSerializerTests : XCTestCase
+
+@end
+
+@implementation ADTokenCacheItemSerializerTests
+
+-(ADTokenCacheStoreItem*) sampleItem
+{
+    ADTokenCacheStoreItem* item = [ADTokenCacheStoreItem new];
+    item.authority = @"https://login.windows.net/contoso.com";
+    item.resource = @"https://graph.windows.net";
+    item.clientId = @"c3c7f5e5-7153-44d4-90e6-329686d48d76";
+    item.accessToken = [@"" stringByPaddingToLength:1200 withString:@"eyJ0eXAiOiJKV1Qi" startingAtIndex:0];
+    item.accessTokenType = @"Bearer";
+    item.refreshToken = [@"" stringByPaddingToLength:800 withString:@"AAABAAAAiL9Kn2Z27Uu" startingAtIndex:0];
+    item.expiresOn = [NSDate dateWithTimeIntervalSinceReferenceDate:500000000];
+    item.userInformation = [ADUserInformation userInformationWithUserId:@"User@Contoso.com" error:nil];
+    return item;
+}
+
+-(void) testRoundTrip
+{
+    ADTokenCacheStoreItem* item = [self sampleItem];
+    NSData* data = [ADTokenCacheItemSerializer dataFromItem:item];
+    XCTAssertTrue([ADTokenCacheItemSerializer isSerializedItem:data]);
+
+    ADAuthenticationError* error = nil;
+    ADTokenCacheStoreItem* decoded = [ADTokenCacheItemSerializer itemFromData:data error:&error];
+    XCTAssertNotNil(decoded);
+    XCTAssertNil(error);
+    XCTAssertEqualObjects(decoded.authority, item.authority);
+    XCTAssertEqualObjects(decoded.resource, item.resource);
+    XCTAssertEqualObjects(decoded.clientId, item.clientId);
+    XCTAssertEqualObjects(decoded.accessToken, item.accessToken);
+    XCTAssertEqualObjects(decoded.accessTokenType, item.accessTokenType);
+    XCTAssertEqualObjects(decoded.refreshToken, item.refreshToken);
+    XCTAssertEqualObjects(decoded.expiresOn, item.expiresOn);
+    XCTAssertEqualObjects(decoded.userInformation.userId, item.userInformation.userId);
+}
+
+-(void) testLegacyDataIsNotSerializedItem
+{
+    NSData* legacy = [NSKeyedArchiver archivedDataWithRootObject:[self sampleItem]];
+    XCTAssertFalse([ADTokenCacheItemSerializer isSerializedItem:legacy]);
+
+    ADAuthenticationError* error = nil;
+    XCTAssertNil([ADTokenCacheItemSerializer itemFromData:legacy error:&error]);
+    XCTAssertNotNil(error);
+}
+
+-(void) testTruncatedData
+{
+    NSData* data = [ADTokenCacheItemSerializer dataFromItem:[self sampleItem]];
+    for(NSUInteger length = 0; length < data.length; length += 7)
+    {
+        ADAuthenticationError* error = nil;
+        XCTAssertNil([ADTokenCacheItemSerializer itemFromData:[data subdataWithRange:NSMakeRange(0, length)] error:&error]);
+    }
+}
+
+#pragma mark - Benchmarks
+
+-(void) testEncodePerformance
+{
+    ADTokenCacheStoreItem* item = [self sampleItem];
+    [self measureBlock:^
+     {
+         for(NSUInteger i = 0; i < sBenchmarkItems; ++i)
+         {
+             [ADTokenCacheItemSerializer dataFromItem:item];
+         }
+     }];
+}
+
+-(void) testKeyedArchiverEncodePerformance
+{
+    ADTokenCacheStoreItem* item = [self sampleItem];
+    [self measureBlock:^
+     {
+         for(NSUInteger i = 0; i < sBenchmarkItems; ++i)
+         {
+             [NSKeyedArchiver archivedDataWithRootObject:item];
+         }
+     }];
+}
+
+-(void) testDecodePerformance
+{
+    NSData* data = [ADTokenCacheItemSerializer dataFromItem:[self sampleItem]];
+    [self measureBlock:^
+     {
+         for(NSUInteger i = 0; i < sBenchmarkItems; ++i)
+         {
+             [ADTokenCacheItemSerializer itemFromData:data error:nil];
+         }
+     }];
+}
+
+-(void) testKeyedArchiverDecodePerformance
+{
+    NSData* data = [NSKeyedArchiver archivedDataWithRootObject:[self sampleItem]];
+    [self measureBlock:^
+     {
+         for(NSUInteger i = 0; i < sBenchmarkItems; ++i)
+         {
+             [NSKeyedUnarchiver unarchiveObjectWithData:data];
+         }
+     }];
+}
+
+@end
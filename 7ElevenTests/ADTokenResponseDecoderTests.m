@@ -0,0 +1,192 @@
+//
+//  ADTokenResponseDecoderTests.m
+//  7ElevenTests
+//
+
+#import <XCTest/XCTest.h>
+#import <ADALiOS/ADALiOS.h>
+#import <ADALiOS/ADTokenResponseDecoder.h>
+
+//The number of responses decoded in each iteration of the benchmarks:
+static const NSUInteger sBenchmarkResponses = 1000;
+
+@interface ADTokenResponseDecoderTests : XCTestCase
+
+@end
+
+@implementation ADTokenResponseDecoderTests
+
+//Decodes the UTF-8 JSON. Returns nil if the decoder rejected it:
+-(NSDictionary*) decode: (const char*) json
+{
+    NSMutableDictionary* response = [NSMutableDictionary new];
+    NSError* error = nil;
+    BOOL decoded = [ADTokenResponseDecoder decodeData:[NSData dataWithBytes:json length:strlen(json)]
+                                       intoDictionary:response
+                                                error:&error];
+    XCTAssertEqual(decoded, (BOOL)(nil == error));
+    return (decoded) ? response : nil;
+}
+
+//A response, as sent by the token endpoint:
+-(NSData*) sampleResponse
+{
+    NSString* accessToken = [@"" stringByPaddingToLength:1200 withString:@"eyJ0eXAiOiJKV1Qi" startingAtIndex:0];
+    NSString* refreshToken = [@"" stringByPaddingToLength:800 withString:@"AAABAAAAiL9Kn2Z27Uu" startingAtIndex:0];
+    NSDictionary* contents = @{
+                               @"token_type":@"Bearer",
+                               @"expires_in":@"3599",
+                               @"expires_on":@"1427242112",
+                               @"not_before":@"1427238212",
+                               @"scope":@"user_impersonation",
+                               @"resource":@"https://graph.windows.net",
+                               @"access_token":accessToken,
+                               @"refresh_token":refreshToken,
+                               @"id_token":@"eyJ0eXAiOiJKV1QiLCJhbGciOiJub25lIn0.eyJhdWQiOiJjM2M3ZjVlNSJ9.",
+                               @"pwd_exp":@"1209599",
+                               @"pwd_url":@"https://portal.microsoftonline.com/ChangePassword.aspx",
+                               };
+    return [NSJSONSerialization dataWithJSONObject:contents options:0 error:nil];
+}
+
+-(void) testKnownAndUnknownFields
+{
+    NSDictionary* response = [self decode:"{\"access_token\":\"at\",\"token_type\":\"Bearer\",\"scope\":\"openid\"}"];
+    XCTAssertEqualObjects([response objectForKey:@"access_token"], @"at");
+    XCTAssertEqualObjects([response objectForKey:@"token_type"], @"Bearer");
+    XCTAssertEqualObjects([response objectForKey:@"scope"], [NSNull null]);
+}
+
+-(void) testMatchesJSONSerialization
+{
+    NSData* data = [self sampleResponse];
+    NSDictionary* expected = [NSJSONSerialization JSONObjectWithData:data options:0 error:nil];
+    NSMutableDictionary* response = [NSMutableDictionary new];
+    XCTAssertTrue([ADTokenResponseDecoder decodeData:data intoDictionary:response error:nil]);
+    XCTAssertEqual(response.count, expected.count);
+    for(NSString* key in @[@"access_token", @"refresh_token", @"token_type", @"resource", @"id_token"])
+    {
+        XCTAssertEqualObjects([response objectForKey:key], [expected objectForKey:key]);
+    }
+    XCTAssertEqualObjects([response objectForKey:@"expires_in"], @3599);
+}
+
+-(void) testEscapes
+{
+    NSDictionary* response = [self decode:"{\"access_token\":\"a\\\"b\\\\c\\/d\\b\\f\\n\\r\\t\\u0041\\u00e9\\u20ac\"}"];
+    XCTAssertEqualObjects([response objectForKey:@"access_token"], @"a\"b\\c/d\b\f\n\r\tA\u00e9\u20ac");
+
+    //Escaped field names are valid too:
+    response = [self decode:"{\"access\\u005ftoken\":\"at\"}"];
+    XCTAssertEqualObjects([response objectForKey:@"access_token"], @"at");
+
+    XCTAssertNil([self decode:"{\"access_token\":\"\\q\"}"]);
+    XCTAssertNil([self decode:"{\"access_token\":\"\\u00g1\"}"]);
+    XCTAssertNil([self decode:"{\"access_token\":\"a\tb\"}"]);//Unescaped control character
+}
+
+-(void) testSurrogatePairs
+{
+    NSDictionary* response = [self decode:"{\"access_token\":\"\\ud83d\\ude00\"}"];
+    XCTAssertEqualObjects([response objectForKey:@"access_token"], @"\U0001F600");
+
+    XCTAssertNil([self decode:"{\"access_token\":\"\\ud83d\"}"]);//High surrogate without the low one
+    XCTAssertNil([self decode:"{\"access_token\":\"\\ud83dx\"}"]);
+    XCTAssertNil([self decode:"{\"access_token\":\"\\ude00\"}"]);//Low surrogate alone
+}
+
+-(void) testByteOrderMark
+{
+    NSDictionary* response = [self decode:"\xEF\xBB\xBF{\"access_token\":\"at\"}"];
+    XCTAssertEqualObjects([response objectForKey:@"access_token"], @"at");
+}
+
+-(void) testNestedUnknownValues
+{
+    NSDictionary* response = [self decode:"{\"claims\":{\"a\":[1,-2.5e3,true,false,null,{\"b\":\"}]\"}],\"c\":{}},"
+                              "\"list\":[[],[[\"x\"]]],\"access_token\":\"at\"}"];
+    XCTAssertEqualObjects([response objectForKey:@"access_token"], @"at");
+    XCTAssertEqualObjects([response objectForKey:@"claims"], [NSNull null]);
+    XCTAssertEqualObjects([response objectForKey:@"list"], [NSNull null]);
+}
+
+-(void) testExpiresIn
+{
+    XCTAssertEqualObjects([[self decode:"{\"expires_in\":\"3600\"}"] objectForKey:@"expires_in"], @3600);
+    XCTAssertEqualObjects([[self decode:"{\"expires_in\":3600}"] objectForKey:@"expires_in"], @3600);
+    XCTAssertEqualObjects([[self decode:"{\"expires_in\":3600.5}"] objectForKey:@"expires_in"], @3600.5);
+    //Not a number, left to the caller:
+    XCTAssertEqualObjects([[self decode:"{\"expires_in\":\"soon\"}"] objectForKey:@"expires_in"], @"soon");
+    //Longer than a fixed size buffer:
+    NSNumber* longNumber = [[self decode:"{\"expires_in\":1234567890123456789012345678901234567890}"] objectForKey:@"expires_in"];
+    XCTAssertEqualWithAccuracy(longNumber.doubleValue, 1.2345678901234568e39, 1e24);
+}
+
+-(void) testMalformedBodies
+{
+    const char* malformed[] =
+    {
+        "",
+        "[]",
+        "{",
+        "{\"access_token\"}",
+        "{\"access_token\":}",
+        "{\"access_token\":\"at\",}",
+        "{\"access_token\":\"at\"} x",
+        "{\"access_token\":\"at",
+        "{\"scope\":xyz}",
+        "{\"scope\":tru}",
+        "{\"scope\":{]}",
+        "{\"scope\":[}",
+        "{\"scope\":[1,]}",
+        "{\"scope\":{\"a\"}}",
+        "{\"scope\":{\"a\":1,}}",
+        "{\"scope\":01}",
+        "{\"scope\":1.}",
+        "{\"scope\":-}",
+        "{\"scope\":1e}",
+        "{\"expires_in\":12a}",
+    };
+    for(size_t i = 0; i < sizeof(malformed) / sizeof(malformed[0]); ++i)
+    {
+        XCTAssertNil([self decode:malformed[i]], @"Accepted: %s", malformed[i]);
+    }
+}
+
+-(void) testDeepNesting
+{
+    NSMutableString* json = [NSMutableString stringWithString:@"{\"scope\":"];
+    for(int i = 0; i < 10000; ++i)
+    {
+        [json appendString:@"["];
+    }
+    XCTAssertNil([self decode:json.UTF8String]);
+}
+
+#pragma mark - Benchmarks
+
+-(void) testDecodePerformance
+{
+    NSData* data = [self sampleResponse];
+    [self measureBlock:^
+     {
+         for(NSUInteger i = 0; i < sBenchmarkResponses; ++i)
+         {
+             [ADTokenResponseDecoder decodeData:data intoDictionary:[NSMutableDictionary new] error:nil];
+         }
+     }];
+}
+
+-(void) testJSONSerializationPerformance
+{
+    NSData* data = [self sampleResponse];
+    [self measureBlock:^
+     {
+         for(NSUInteger i = 0; i < sBenchmarkResponses; ++i)
+         {
+             [NSJSONSerialization JSONObjectWithData:data options:0 error:nil];
+         }
+     }];
+}
+
+@end
@@ -0,0 +1,151 @@
+//
+//  NSStringADHelperMethodsTests.m
+//  7ElevenTests
+//
+
+#import <XCTest/XCTest.h>
+#import <ADALiOS/ADALiOS.h>
+#import <ADALiOS/NSString+ADHelperMethods.h>
+
+//The lengths cover several iterations of the SIMD kernels, plus every possible remainder:
+static const NSUInteger sMaxTestLength = 300;
+//The number of conversions in each iteration of the benchmarks:
+static const NSUInteger sBenchmarkConversions = 1000;
+
+@interface NSStringADHelperMethodsTests : XCTestCase
+
+@end
+
+@implementation NSStringADHelperMethodsTests
+
+-(NSData*) randomDataWithLength: (NSUInteger) length
+{
+    NSMutableData* data = [NSMutableData dataWithLength:length];
+    arc4random_buf(data.mutableBytes, length);
+    return data;
+}
+
+//The base64url encoding through Foundation, as an independent reference:
+-(NSString*) referenceEncode: (NSData*) data
+{
+    NSString* encoded = [data base64EncodedStringWithOptions:0];
+    encoded = [encoded stringByReplacingOccurrencesOfString:@"+" withString:@"-"];
+    encoded = [encoded stringByReplacingOccurrencesOfString:@"/" withString:@"_"];
+    return [encoded stringByReplacingOccurrencesOfString:@"=" withString:@""];
+}
+
+-(void) testEncodeMatchesScalar
+{
+    for(NSUInteger length = 0; length <= sMaxTestLength; ++length)
+    {
+        NSData* data = [self randomDataWithLength:length];
+        NSString* expected = [self referenceEncode:data];
+        XCTAssertEqualObjects([NSString Base64EncodeDataScalar:data], expected, @"Length: %lu", (unsigned long)length);
+        XCTAssertEqualObjects([NSString Base64EncodeData:data], expected, @"Length: %lu", (unsigned long)length);
+    }
+}
+
+-(void) testDecodeMatchesScalar
+{
+    for(NSUInteger length = 1; length <= sMaxTestLength; ++length)
+    {
+        NSData* data = [self randomDataWithLength:length];
+        NSString* encoded = [self referenceEncode:data];
+        XCTAssertEqualObjects([NSString Base64DecodeDataScalar:encoded], data, @"Length: %lu", (unsigned long)length);
+        XCTAssertEqualObjects([NSString Base64DecodeData:encoded], data, @"Length: %lu", (unsigned long)length);
+    }
+}
+
+-(void) testInvalidCharactersMatchScalar
+{
+    NSString* encoded = [self referenceEncode:[self randomDataWithLength:sMaxTestLength]];
+    //An invalid character in each position, so that it falls in every block of the kernels and in the scalar tail:
+    for(NSUInteger i = 0; i < encoded.length; ++i)
+    {
+        for(NSString* invalid in @[@"!", @"+", @"/", @"é"])
+        {
+            NSString* corrupted = [encoded stringByReplacingCharactersInRange:NSMakeRange(i, 1) withString:invalid];
+            XCTAssertNil([NSString Base64DecodeDataScalar:corrupted], @"Position: %lu", (unsigned long)i);
+            XCTAssertNil([NSString Base64DecodeData:corrupted], @"Position: %lu", (unsigned long)i);
+        }
+        //The padding character is decoded as zero by both:
+        NSString* padded = [encoded stringByReplacingCharactersInRange:NSMakeRange(i, 1) withString:@"="];
+        XCTAssertEqualObjects([NSString Base64DecodeData:padded], [NSString Base64DecodeDataScalar:padded]);
+    }
+}
+
+-(void) testInvalidLengths
+{
+    XCTAssertNil([NSString Base64DecodeData:@""]);
+    XCTAssertNil([NSString Base64DecodeData:@"A"]);
+    XCTAssertNil([NSString Base64DecodeData:@"AAAAA"]);
+}
+
+-(void) testEmbeddedNul
+{
+    unichar characters[] = { 'a', 0, 'b' };
+    NSString* string = [NSString stringWithCharacters:characters length:3];
+    NSString* encoded = [string adBase64UrlEncode];
+    XCTAssertEqualObjects(encoded, @"YQBi");
+    XCTAssertEqualObjects([encoded adBase64UrlDecode], string);
+}
+
+-(void) testNonASCIIString
+{
+    NSString* string = @"é€\U0001F600";
+    NSString* encoded = [string adBase64UrlEncode];
+    XCTAssertEqualObjects(encoded, [self referenceEncode:[string dataUsingEncoding:NSUTF8StringEncoding]]);
+    XCTAssertEqualObjects([encoded adBase64UrlDecode], string);
+}
+
+#pragma mark - Benchmarks
+
+-(void) testEncodePerformance
+{
+    NSData* data = [self randomDataWithLength:2048];
+    [self measureBlock:^
+     {
+         for(NSUInteger i = 0; i < sBenchmarkConversions; ++i)
+         {
+             [NSString Base64EncodeData:data];
+         }
+     }];
+}
+
+-(void) testScalarEncodePerformance
+{
+    NSData* data = [self randomDataWithLength:2048];
+    [self measureBlock:^
+     {
+         for(NSUInteger i = 0; i < sBenchmarkConversions; ++i)
+         {
+             [NSString Base64EncodeDataScalar:data];
+         }
+     }];
+}
+
+-(void) testDecodePerformance
+{
+    NSString* encoded = [self referenceEncode:[self randomDataWithLength:2048]];
+    [self measureBlock:^
+     {
+         for(NSUInteger i = 0; i < sBenchmarkConversions; ++i)
+         {
+             [NSString Base64DecodeData:encoded];
+         }
+     }];
+}
+
+-(void) testScalarDecodePerformance
+{
+    NSString* encoded = [self referenceEncode:[self randomDataWithLength:2048]];
+    [self measureBlock:^
+     {
+         for(NSUInteger i = 0; i < sBenchmarkConversions; ++i)
+         {
+             [NSString Base64DecodeDataScalar:encoded];
+         }
+     }];
+}
+
+@end
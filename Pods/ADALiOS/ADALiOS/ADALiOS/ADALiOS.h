@@ -40,6 +40,7 @@
 #define ADAL_VERSION_VAR ADAL_VERSION_(ADAL_VER_HIGH, ADAL_VER_LOW, ADAL_VER_PATCH)
 
 #import "ADLogger.h"
+#import "ADLogger+Internal.h"
 #import "ADErrorCodes.h"
 #import "ADAuthenticationError.h"
 #import "NSString+ADHelperMethods.h"
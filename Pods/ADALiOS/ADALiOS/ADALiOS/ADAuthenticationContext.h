@@ -76,6 +76,10 @@ typedef enum
 /*! The completion block declaration. */
 typedef void(^ADAuthenticationCallback)(ADAuthenticationResult* result);
 
+/*! The completion block of the bulk acquisitions. The dictionary maps each of the requested
+ resources (NSString) to its ADAuthenticationResult. */
+typedef void(^ADAuthenticationBulkCallback)(NSDictionary* results);
+
 /*! The central class for managing multiple tokens. Usage: create one per AAD or ADFS authority.
  As authority is required, the class cannot be used with "new" or the parameterless "init" selectors.
  Attempt to call [ADAuthenticationContext new] or [[ADAuthenticationContext alloc] init] will throw an exception.
@@ -153,7 +157,8 @@ typedef void(^ADAuthenticationCallback)(ADAuthenticationResult* result);
 @property id<ADTokenCacheStoring> tokenCacheStore;
 
 /*! Unique identifier passed to the server and returned back with errors. Useful during investigations to correlate the
- requests and the responses from the server. If nil, a new UUID is generated on every request. */
+ requests and the responses from the server. If nil, the value set through [ADLogger setCorrelationId:] is used and returned
+ instead; if that is nil too, a new UUID is generated on every request. */
 @property (strong, getter=getCorrelationId, setter=setCorrelationId:) NSUUID* correlationId;
 
 /*! The parent view controller for the authentication view controller UI. This property will be used only if
@@ -165,6 +170,13 @@ typedef void(^ADAuthenticationCallback)(ADAuthenticationResult* result);
  when needed, leveraging the parentController property. */
 @property (weak) WebViewType* webView;
 
+/*! Opt-in. When enabled, the context periodically checks its token cache for access tokens of this authority,
+ which are about to expire, and redeems the corresponding refresh tokens in the background (with a small random
+ delay) before the expiration. This way the acquireToken calls are typically served from the cache without
+ network round trips. Applies only to the cached tokens, which the application requested through this context
+ within the last 24 hours after enabling. The failed refreshes are retried with exponential backoff. Default is NO. */
+@property (getter = getBackgroundRefreshEnabled, setter = setBackgroundRefreshEnabled:) BOOL backgroundRefreshEnabled;
+
 /*! Follows the OAuth2 protocol (RFC 6749). The function will first look at the cache and automatically check for token
  expiration. Additionally, if no suitable access token is found in the cache, but refresh token is available,
  the function will use the refresh token automatically. If neither of these attempts succeeds, the method will use the provided assertion to get an 
@@ -291,6 +303,22 @@ typedef void(^ADAuthenticationCallback)(ADAuthenticationResult* result);
                                 userId: (NSString*) userId
                        completionBlock: (ADAuthenticationCallback) completionBlock;
 
+/*! The bulk version of acquireTokenSilentWithResource, for the applications, which need tokens for several resources,
+ e.g. on startup. The authority is validated and the cache is read once for all of the resources. The usable access
+ tokens are returned directly from the cache; the rest are obtained from the refresh tokens (including the shared
+ multi-resource refresh token), redeeming a few of them concurrently. This method will not show UI for the user.
+ The resources, which need reauthorization, get results with error code AD_ERROR_USER_INPUT_NEEDED.
+ @param resources: the resources (NSString) whose tokens are needed.
+ @param clientId: the client identifier
+ @param userId: The user, whose tokens are needed. This parameter can be nil.
+ @param completionBlock: called once, when the results for all of the resources are available. If resources is nil
+ or empty, the block is called with an empty dictionary.
+ */
+-(void) acquireTokensSilentWithResources: (NSArray*) resources
+                                clientId: (NSString*) clientId
+                                  userId: (NSString*) userId
+                         completionBlock: (ADAuthenticationBulkCallback) completionBlock;
+
 /*! Follows the OAuth2 protocol (RFC 6749). Uses the refresh token to obtain an access token (and another refresh token). The method
  is superceded by acquireToken, which will implicitly use the refresh token if needed. Please use acquireTokenByRefreshToken
  only if you would like to store the access and refresh tokens, managing the expiration times in your application logic.
@@ -27,6 +27,7 @@
 #import "NSDictionary+ADExtensions.h"
 #import "ADWebRequest.h"
 #import "ADWebResponse.h"
+#import "ADTokenResponseDecoder.h"
 #import "ADInstanceDiscovery.h"
 #import "ADTokenCacheStoreItem.h"
 #import "ADTokenCacheStoreKey.h"
@@ -37,6 +38,8 @@
 #import "ADKeyChainHelper.h"
 #import "ADBrokerKeyHelper.h"
 #import "ADClientMetrics.h"
+#import "ADTraceSpan.h"
+#import "ADRequestContext.h"
 
 NSString* const unknownError = @"Uknown error.";
 NSString* const credentialsNeeded = @"The user credentials are need to obtain access token. Please call the non-silent acquireTokenWithResource methods.";
@@ -52,9 +55,45 @@ NSString* ADAL_VERSION_VAR = @ADAL_VERSION_STRING;
 typedef void(^ADAuthorizationCodeCallback)(NSString*, ADAuthenticationError*);
 static volatile int sDialogInProgress = 0;
 
-BOOL isCorrelationIdUserProvided = NO;
+//Background refresh: the refresh tokens are redeemed this many seconds (plus the settings'
+//expirationBuffer) before the access tokens expire:
+static const NSTimeInterval sBackgroundRefreshLead = 300;
+//Random delay, added to each background refresh, so that the clients do not refresh in sync:
+static const uint32_t sBackgroundRefreshJitter = 60;
+//Bounds of the time between two scans of the cache:
+static const NSTimeInterval sBackgroundRefreshMinInterval = 30;
+static const NSTimeInterval sBackgroundRefreshMaxInterval = 300;
+//Only the tokens, requested by the application within this time, are refreshed in the background:
+static const NSTimeInterval sBackgroundRefreshRecentUse = 24 * 60 * 60;
+//The failed background refreshes of a token are retried after exponentially growing delays, up to:
+static const NSTimeInterval sBackgroundRefreshMaxBackoff = 60 * 60;
+
+//The refresh token redemptions, which are currently in flight. Maps the redemption key (see
+//pendingRefreshKeyWithResource) to the array of completion blocks waiting for the response.
+//Shared among all context instances, as they share the token cache too:
+static NSMutableDictionary* sPendingRefreshes = nil;
+
+//The maximum number of the refresh token redemptions, which a bulk silent acquisition runs in parallel:
+static const NSUInteger sBulkRedemptionFanOut = 4;
+
+extern NSString* const sMultiUserError;
 
 @implementation ADAuthenticationContext
+{
+    //Incremented whenever the background refresh is turned on or off, so that
+    //the already scheduled scans can detect that they are obsolete:
+    NSUInteger mBackgroundRefreshSchedule;
+    BOOL mBackgroundRefreshEnabled;
+    //The tokens, which the background refresh keeps fresh. Map the keys of pendingRefreshKeyWithResource
+    //(without user) to the time of the last request of the token by the application, to the number of
+    //the consecutive failed refreshes and to the time of the next retry respectively:
+    NSMutableDictionary* mRefreshLastUse;
+    NSMutableDictionary* mRefreshFailures;
+    NSMutableDictionary* mRefreshRetryAt;
+    
+    //The correlation id set by the developer. Nil if a new one should be generated for each operation:
+    NSUUID* mCorrelationId;
+}
 
 + (void)load
 {
@@ -80,6 +119,21 @@ completionBlock:completionBlock]) \
 return; \
 }
 
+//Returns a completion block, which ends the span with the result of the operation before calling
+//the passed block. Returns the passed block if there is no span:
+static ADAuthenticationCallback completionEndingSpan(ADTraceSpan* span, ADAuthenticationCallback completionBlock)
+{
+    if (!span)
+    {
+        return completionBlock;
+    }
+    return ^(ADAuthenticationResult* result)
+    {
+        [span endWithError:result.error];
+        completionBlock(result);
+    };
+}
+
 
 - (BOOL) handleNilOrEmptyAsResult:(NSObject*) argumentValue
                      argumentName: (NSString*) argumentName
@@ -206,13 +260,30 @@ return; \
 
 - (NSUUID*) getCorrelationId
 {
-    return ADLogger.getCorrelationId;
+    @synchronized(self)
+    {
+        if (mCorrelationId)
+        {
+            return mCorrelationId;
+        }
+    }
+    //As before the per-context ids, the contexts without their own id use the one set on ADLogger:
+    return [ADLogger getCorrelationId];
 }
 
 - (void) setCorrelationId:(NSUUID*) correlationId
 {
-    [ADLogger setCorrelationId: correlationId];
-    isCorrelationIdUserProvided = YES;
+    @synchronized(self)
+    {
+        mCorrelationId = correlationId;
+    }
+}
+
+//Creates the context of a new operation. Each operation carries its own context, so that the
+//concurrent operations do not overwrite each other's correlation ids:
+-(ADRequestContext*) requestContext
+{
+    return [ADRequestContext contextWithCorrelationId:[self getCorrelationId]];
 }
 
 -(void)  acquireTokenForAssertion: (NSString*) assertion
@@ -230,7 +301,7 @@ return; \
                                             scope:nil
                                          tryCache:YES
                                 validateAuthority:self.validateAuthority
-                                    correlationId:[self getCorrelationId]
+                                          context:[self requestContext]
                                   completionBlock:completionBlock];
     
 }
@@ -252,7 +323,7 @@ return; \
                              extraQueryParameters:nil
                                          tryCache:YES
                                 validateAuthority:self.validateAuthority
-                                    correlationId:[self getCorrelationId]
+                                          context:[self requestContext]
                                   completionBlock:completionBlock];
 }
 
@@ -273,7 +344,7 @@ return; \
                       extraQueryParameters:nil
                                   tryCache:YES
                          validateAuthority:self.validateAuthority
-                             correlationId:[self getCorrelationId]
+                                   context:[self requestContext]
                            completionBlock:completionBlock];
 }
 
@@ -296,7 +367,7 @@ return; \
                       extraQueryParameters:queryParams
                                   tryCache:YES
                          validateAuthority:self.validateAuthority
-                             correlationId:[self getCorrelationId]
+                                   context:[self requestContext]
                            completionBlock:completionBlock];
 }
 
@@ -316,7 +387,7 @@ return; \
                              extraQueryParameters:nil
                                          tryCache:YES
                                 validateAuthority:self.validateAuthority
-                                    correlationId:[self getCorrelationId]
+                                          context:[self requestContext]
                                   completionBlock:completionBlock];
 }
 
@@ -337,10 +408,25 @@ return; \
                              extraQueryParameters:nil
                                          tryCache:YES
                                 validateAuthority:self.validateAuthority
-                                    correlationId:[self getCorrelationId]
+                                          context:[self requestContext]
                                   completionBlock:completionBlock];
 }
 
+-(void) acquireTokensSilentWithResources: (NSArray*) resources
+                                clientId: (NSString*) clientId
+                                  userId: (NSString*) userId
+                         completionBlock: (ADAuthenticationBulkCallback) completionBlock
+{
+    API_ENTRY;
+    THROW_ON_NIL_ARGUMENT(completionBlock);//The only argument that throws
+    [self internalAcquireTokensSilentWithResources:resources
+                                          clientId:clientId
+                                            userId:userId
+                                 validateAuthority:self.validateAuthority
+                                           context:[self requestContext]
+                                   completionBlock:completionBlock];
+}
+
 //Returns YES if we shouldn't attempt other means to get access token.
 //
 -(BOOL) isFinalResult: (ADAuthenticationResult*) result
@@ -359,7 +445,7 @@ return; \
                      resource: (NSString*) resource
                      clientId: (NSString*) clientId
                        userId: (NSString*) userId
-                correlationId: (NSUUID*) correlationId
+                      context: (ADRequestContext*) context
               completionBlock: (ADAuthenticationCallback)completionBlock
 {
     //All of these should be set before calling this method:
@@ -367,7 +453,8 @@ return; \
     HANDLE_ARGUMENT(item);
     HANDLE_ARGUMENT(resource);
     HANDLE_ARGUMENT(clientId);
-    HANDLE_ARGUMENT(correlationId);//Should have been set before this call
+    HANDLE_ARGUMENT(context);//Should have been set before this call
+    AD_REQUEST_CONTEXT_SCOPE(context);
     
     if (useAccessToken)
     {
@@ -392,7 +479,7 @@ return; \
                                       userId:item.userInformation.userId
                                    cacheItem:item
                            validateAuthority:NO /* Done by the caller. */
-                               correlationId:correlationId
+                                     context:context
                              completionBlock:^(ADAuthenticationResult *result)
      {
          //Asynchronous block:
@@ -410,7 +497,10 @@ return; \
              {
                  BOOL useAccessToken;
                  ADAuthenticationError* error = nil;
+                 ADTraceSpan* lookupSpan = [context.span childWithName:@"mrrtLookup"];
                  ADTokenCacheStoreItem* broadItem = [self findCacheItemWithKey:broadKey userId:userId useAccessToken:&useAccessToken error:&error];
+                 [lookupSpan setAttribute:[NSNumber numberWithBool:(broadItem != nil)] forKey:@"found"];
+                 [lookupSpan endWithError:error];
                  if (error)
                  {
                      completionBlock([ADAuthenticationResult resultFromError:error]);
@@ -435,7 +525,7 @@ return; \
                                         resource:resource
                                         clientId:clientId
                                           userId:userId
-                                   correlationId:correlationId
+                                         context:context
                                  completionBlock:completionBlock];
                      return;//The call above takes over, no more processing
                  }//broad item
@@ -452,7 +542,7 @@ return; \
                                           scope:nil
                                        tryCache:NO
                               validateAuthority:NO /* Already validated in this block. */
-                                  correlationId:correlationId
+                                        context:context
                                 completionBlock:completionBlock];
      }];//End of the refreshing token completion block, executed asynchronously.
 }
@@ -469,7 +559,7 @@ return; \
                        silent: (BOOL) silent
                        userId: (NSString*) userId
          extraQueryParameters: (NSString*) queryParams
-                correlationId: (NSUUID*) correlationId
+                      context: (ADRequestContext*) context
               completionBlock: (ADAuthenticationCallback)completionBlock
 {
     //All of these should be set before calling this method:
@@ -477,7 +567,8 @@ return; \
     HANDLE_ARGUMENT(item);
     HANDLE_ARGUMENT(resource);
     HANDLE_ARGUMENT(clientId);
-    HANDLE_ARGUMENT(correlationId);//Should have been set before this call
+    HANDLE_ARGUMENT(context);//Should have been set before this call
+    AD_REQUEST_CONTEXT_SCOPE(context);
     
     if (useAccessToken)
     {
@@ -502,7 +593,7 @@ return; \
                                       userId:item.userInformation.userId
                                    cacheItem:item
                            validateAuthority:NO /* Done by the caller. */
-                               correlationId:correlationId
+                                     context:context
                              completionBlock:^(ADAuthenticationResult *result)
      {
          //Asynchronous block:
@@ -520,7 +611,10 @@ return; \
              {
                  BOOL useAccessToken;
                  ADAuthenticationError* error;
+                 ADTraceSpan* lookupSpan = [context.span childWithName:@"mrrtLookup"];
                  ADTokenCacheStoreItem* broadItem = [self findCacheItemWithKey:broadKey userId:userId useAccessToken:&useAccessToken error:&error];
+                 [lookupSpan setAttribute:[NSNumber numberWithBool:(broadItem != nil)] forKey:@"found"];
+                 [lookupSpan endWithError:error];
                  if (error)
                  {
                      completionBlock([ADAuthenticationResult resultFromError:error]);
@@ -547,7 +641,7 @@ return; \
                                           silent:silent
                                           userId:userId
                             extraQueryParameters:queryParams
-                                   correlationId:correlationId
+                                         context:context
                                  completionBlock:completionBlock];
                      return;//The call above takes over, no more processing
                  }//broad item
@@ -566,7 +660,7 @@ return; \
                            extraQueryParameters: queryParams
                                        tryCache: NO
                               validateAuthority: NO
-                                  correlationId:correlationId
+                                        context:context
                                 completionBlock: completionBlock];
      }];//End of the refreshing token completion block, executed asynchronously.
 }
@@ -591,7 +685,7 @@ return; \
                       extraQueryParameters:queryParams
                                   tryCache:YES
                          validateAuthority:self.validateAuthority
-                             correlationId:[self getCorrelationId]
+                                   context:[self requestContext]
                            completionBlock:completionBlock];
 }
 
@@ -697,18 +791,6 @@ return; \
     return nil;//Nothing suitable
 }
 
-//Makes sure that the correlation id contains a valid UUID.
-//Generates a new one if needed.
--(void) updateCorrelationId: (NSUUID* __autoreleasing*) correlationId
-{
-    THROW_ON_NIL_ARGUMENT(correlationId);
-    if (!*correlationId || !isCorrelationIdUserProvided)
-    {
-       [ADLogger setCorrelationId:[NSUUID UUID]];
-        *correlationId = [self getCorrelationId];
-    }
-}
-
 
 -(void) internalAcquireTokenForAssertion: (NSString*) samlAssertion
                                 clientId: (NSString*) clientId
@@ -718,20 +800,30 @@ return; \
                                    scope: (NSString*) scope
                                 tryCache:(BOOL) tryCache
                        validateAuthority: (BOOL) validateAuthority
-                           correlationId: (NSUUID*) correlationId
+                                 context: (ADRequestContext*) context
                          completionBlock: (ADAuthenticationCallback)completionBlock
 {
     
     THROW_ON_NIL_ARGUMENT(completionBlock);
     HANDLE_ARGUMENT(resource);
     HANDLE_ARGUMENT(samlAssertion);
+    HANDLE_ARGUMENT(context);
     
-    [self updateCorrelationId:&correlationId];
+    if (!context.span)
+    {
+        //The entry point of the operation; the internal calls pass the context with its span:
+        context = [context contextWithSpan:[ADTraceSpan rootSpanWithName:@"acquireTokenForAssertion" correlationId:context.correlationId]];
+        [context.span setAttribute:resource forKey:@"resource"];
+        completionBlock = completionEndingSpan(context.span, completionBlock);
+    }
+    AD_REQUEST_CONTEXT_SCOPE(context);
     
     if (validateAuthority)
     {
-        [[ADInstanceDiscovery sharedInstance] validateAuthority:self.authority correlationId:correlationId completionBlock:^(BOOL validated, ADAuthenticationError *error)
+        ADTraceSpan* validationSpan = [context.span childWithName:@"authorityValidation"];
+        [[ADInstanceDiscovery sharedInstance] validateAuthority:self.authority correlationId:context.correlationId completionBlock:^(BOOL validated, ADAuthenticationError *error)
          {
+             [validationSpan endWithError:error];
              //Error should always be raised if the authority cannot be validated
 #pragma unused(validated)
              if (error)
@@ -748,63 +840,71 @@ return; \
                                                   scope:scope
                                                tryCache:tryCache
                                       validateAuthority:NO /* Already validated in this block. */
-                                          correlationId:correlationId
+                                                context:context
                                         completionBlock:completionBlock];
              }
          }];
         return;//The asynchronous handler above will do the work.
     }
     
-    //Check the cache:
-    ADAuthenticationError* error = nil;
-    //We are explicitly creating a key first to ensure indirectly that all of the required arguments are correct.
-    //This is the safest way to guarantee it, it will raise an error, if the the any argument is not correct:
-    ADTokenCacheStoreKey* key = [ADTokenCacheStoreKey keyWithAuthority:self.authority resource:resource clientId:clientId error:&error];
-    if (!key)
-    {
-        //If the key cannot be extracted, call the callback with the information:
-        ADAuthenticationResult* result = [ADAuthenticationResult resultFromError:error];
-        completionBlock(result);
-        return;
-    }
-    
-    if (tryCache && self.tokenCacheStore)
+    //The cache lookup and the rest of the work run on the library work queue, rather than on the caller's thread:
+    dispatch_async([ADAuthenticationSettings sharedInstance].dispatchQueue, ^
     {
-        //Cache should be used in this case:
-        BOOL accessTokenUsable;
-        ADTokenCacheStoreItem* cacheItem = [self findCacheItemWithKey:key userId:userId useAccessToken:&accessTokenUsable error:&error];
-        if (error)
+        AD_REQUEST_CONTEXT_SCOPE(context);
+        //Check the cache:
+        ADAuthenticationError* error = nil;
+        //We are explicitly creating a key first to ensure indirectly that all of the required arguments are correct.
+        //This is the safest way to guarantee it, it will raise an error, if the the any argument is not correct:
+        ADTokenCacheStoreKey* key = [ADTokenCacheStoreKey keyWithAuthority:self.authority resource:resource clientId:clientId error:&error];
+        if (!key)
         {
-            completionBlock([ADAuthenticationResult resultFromError:error]);
+            //If the key cannot be extracted, call the callback with the information:
+            ADAuthenticationResult* result = [ADAuthenticationResult resultFromError:error];
+            completionBlock(result);
             return;
         }
-        
-        if (cacheItem)
+        [self trackBackgroundRefreshOfResource:resource clientId:clientId];
+    
+        if (tryCache && self.tokenCacheStore)
         {
-            //Found a promising item in the cache, try using it:
-            [self attemptToUseCacheItem:cacheItem
-                         useAccessToken:accessTokenUsable
-                          samlAssertion:samlAssertion
-                          assertionType:assertionType
-                               resource:resource
-                               clientId:clientId
-                                 userId:userId
-                          correlationId:correlationId
-                        completionBlock:completionBlock];
-            return; //The tryRefreshingFromCacheItem has taken care of the token obtaining
+            //Cache should be used in this case:
+            BOOL accessTokenUsable = NO;
+            ADTraceSpan* lookupSpan = [context.span childWithName:@"cacheLookup"];
+            ADTokenCacheStoreItem* cacheItem = [self findCacheItemWithKey:key userId:userId useAccessToken:&accessTokenUsable error:&error];
+            [lookupSpan setAttribute:[NSNumber numberWithBool:(cacheItem && accessTokenUsable)] forKey:@"hit"];
+            [lookupSpan endWithError:error];
+            if (error)
+            {
+                completionBlock([ADAuthenticationResult resultFromError:error]);
+                return;
+            }
+            //Only the lookups, which do not need to go to the server, are hits:
+            [[ADClientMetrics getInstance] incrementCounter:(cacheItem && accessTokenUsable) ? AD_COUNTER_CACHE_HIT : AD_COUNTER_CACHE_MISS];
+        
+            if (cacheItem)
+            {
+                //Found a promising item in the cache, try using it:
+                [self attemptToUseCacheItem:cacheItem
+                             useAccessToken:accessTokenUsable
+                              samlAssertion:samlAssertion
+                              assertionType:assertionType
+                                   resource:resource
+                                   clientId:clientId
+                                     userId:userId
+                                    context:context
+                            completionBlock:completionBlock];
+                return; //The tryRefreshingFromCacheItem has taken care of the token obtaining
+            }
         }
-    }
     
-    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0), ^
-                   {
-                       [self requestTokenByAssertion: samlAssertion
-                                       assertionType: assertionType
-                                            resource: resource
-                                            clientId: clientId
-                                               scope: nil//For future use
-                                       correlationId: correlationId
-                                          completion: completionBlock];
-                   });
+        [self requestTokenByAssertion: samlAssertion
+                        assertionType: assertionType
+                             resource: resource
+                             clientId: clientId
+                                scope: nil//For future use
+                              context: context
+                           completion: completionBlock];
+    });
 }
 
 
@@ -819,18 +919,29 @@ return; \
                     extraQueryParameters: (NSString*) queryParams
                                 tryCache: (BOOL) tryCache /* set internally to avoid infinite recursion */
                        validateAuthority: (BOOL) validateAuthority
-                           correlationId: (NSUUID*) correlationId
+                                 context: (ADRequestContext*) context
                          completionBlock: (ADAuthenticationCallback)completionBlock
 {
     THROW_ON_NIL_ARGUMENT(completionBlock);
     HANDLE_ARGUMENT(resource);
+    HANDLE_ARGUMENT(context);
     
-    [self updateCorrelationId:&correlationId];
+    if (!context.span)
+    {
+        //The entry point of the operation; the internal calls pass the context with its span:
+        context = [context contextWithSpan:[ADTraceSpan rootSpanWithName:@"acquireToken" correlationId:context.correlationId]];
+        [context.span setAttribute:resource forKey:@"resource"];
+        [context.span setAttribute:[NSNumber numberWithBool:silent] forKey:@"silent"];
+        completionBlock = completionEndingSpan(context.span, completionBlock);
+    }
+    AD_REQUEST_CONTEXT_SCOPE(context);
     
     if (validateAuthority)
     {
-        [[ADInstanceDiscovery sharedInstance] validateAuthority:self.authority correlationId:correlationId completionBlock:^(BOOL validated, ADAuthenticationError *error)
+        ADTraceSpan* validationSpan = [context.span childWithName:@"authorityValidation"];
+        [[ADInstanceDiscovery sharedInstance] validateAuthority:self.authority correlationId:context.correlationId completionBlock:^(BOOL validated, ADAuthenticationError *error)
          {
+             [validationSpan endWithError:error];
              if (error)
              {
                  completionBlock([ADAuthenticationResult resultFromError:error]);
@@ -847,108 +958,118 @@ return; \
                                    extraQueryParameters:queryParams
                                                tryCache:tryCache
                                       validateAuthority:NO /* Already validated in this block. */
-                                          correlationId:correlationId
+                                                context:context
                                         completionBlock:completionBlock];
              }
          }];
         return;//The asynchronous handler above will do the work.
     }
     
-    //Check the cache:
-    ADAuthenticationError* error;
-    //We are explicitly creating a key first to ensure indirectly that all of the required arguments are correct.
-    //This is the safest way to guarantee it, it will raise an error, if the the any argument is not correct:
-    ADTokenCacheStoreKey* key = [ADTokenCacheStoreKey keyWithAuthority:self.authority resource:resource clientId:clientId error:&error];
-    if (!key)
-    {
-        //If the key cannot be extracted, call the callback with the information:
-        ADAuthenticationResult* result = [ADAuthenticationResult resultFromError:error];
-        completionBlock(result);
-        return;
-    }
-    
-    if (tryCache && ![self.class isForcedAuthorization:promptBehavior] && self.tokenCacheStore)
+    //The cache lookup and the rest of the work run on the library work queue, rather than on the caller's thread:
+    dispatch_async([ADAuthenticationSettings sharedInstance].dispatchQueue, ^
     {
-        //Cache should be used in this case:
-        BOOL accessTokenUsable;
-        ADTokenCacheStoreItem* cacheItem = [self findCacheItemWithKey:key userId:userId useAccessToken:&accessTokenUsable error:&error];
-        if (error)
+        AD_REQUEST_CONTEXT_SCOPE(context);
+        //Check the cache:
+        ADAuthenticationError* error;
+        //We are explicitly creating a key first to ensure indirectly that all of the required arguments are correct.
+        //This is the safest way to guarantee it, it will raise an error, if the the any argument is not correct:
+        ADTokenCacheStoreKey* key = [ADTokenCacheStoreKey keyWithAuthority:self.authority resource:resource clientId:clientId error:&error];
+        if (!key)
         {
-            completionBlock([ADAuthenticationResult resultFromError:error]);
+            //If the key cannot be extracted, call the callback with the information:
+            ADAuthenticationResult* result = [ADAuthenticationResult resultFromError:error];
+            completionBlock(result);
             return;
         }
-        
-        if (cacheItem)
+        [self trackBackgroundRefreshOfResource:resource clientId:clientId];
+    
+        if (tryCache && ![self.class isForcedAuthorization:promptBehavior] && self.tokenCacheStore)
         {
-            //Found a promising item in the cache, try using it:
-            [self attemptToUseCacheItem:cacheItem
-                         useAccessToken:accessTokenUsable
-                               resource:resource
-                               clientId:clientId
-                            redirectUri:redirectUri
-                         promptBehavior:promptBehavior
-                                 silent:silent
-                                 userId:userId
-                   extraQueryParameters:queryParams
-                          correlationId:correlationId
-                        completionBlock:completionBlock];
-            return; //The tryRefreshingFromCacheItem has taken care of the token obtaining
+            //Cache should be used in this case:
+            BOOL accessTokenUsable = NO;
+            ADTraceSpan* lookupSpan = [context.span childWithName:@"cacheLookup"];
+            ADTokenCacheStoreItem* cacheItem = [self findCacheItemWithKey:key userId:userId useAccessToken:&accessTokenUsable error:&error];
+            [lookupSpan setAttribute:[NSNumber numberWithBool:(cacheItem && accessTokenUsable)] forKey:@"hit"];
+            [lookupSpan endWithError:error];
+            if (error)
+            {
+                completionBlock([ADAuthenticationResult resultFromError:error]);
+                return;
+            }
+            //Only the lookups, which do not need to go to the server, are hits:
+            [[ADClientMetrics getInstance] incrementCounter:(cacheItem && accessTokenUsable) ? AD_COUNTER_CACHE_HIT : AD_COUNTER_CACHE_MISS];
+        
+            if (cacheItem)
+            {
+                //Found a promising item in the cache, try using it:
+                [self attemptToUseCacheItem:cacheItem
+                             useAccessToken:accessTokenUsable
+                                   resource:resource
+                                   clientId:clientId
+                                redirectUri:redirectUri
+                             promptBehavior:promptBehavior
+                                     silent:silent
+                                     userId:userId
+                       extraQueryParameters:queryParams
+                                    context:context
+                            completionBlock:completionBlock];
+                return; //The tryRefreshingFromCacheItem has taken care of the token obtaining
+            }
         }
-    }
     
-    if (silent)
-    {
-        //The cache lookup and refresh token attempt have been unsuccessful,
-        //so credentials are needed to get an access token, but the developer, requested
-        //no UI to be shown:
-        ADAuthenticationError* error =
-        [ADAuthenticationError errorFromAuthenticationError:AD_ERROR_USER_INPUT_NEEDED
-                                               protocolCode:nil
-                                               errorDetails:credentialsNeeded];
-        ADAuthenticationResult* result = [ADAuthenticationResult resultFromError:error];
-        completionBlock(result);
-        return;
-    }
+        if (silent)
+        {
+            //The cache lookup and refresh token attempt have been unsuccessful,
+            //so credentials are needed to get an access token, but the developer, requested
+            //no UI to be shown:
+            ADAuthenticationError* error =
+            [ADAuthenticationError errorFromAuthenticationError:AD_ERROR_USER_INPUT_NEEDED
+                                                   protocolCode:nil
+                                                   errorDetails:credentialsNeeded];
+            ADAuthenticationResult* result = [ADAuthenticationResult resultFromError:error];
+            completionBlock(result);
+            return;
+        }
     
-    dispatch_async([ADAuthenticationSettings sharedInstance].dispatchQueue, ^
-                   {
-                       //Get the code first:
-                       [self requestCodeByResource:resource
-                                          clientId:clientId
-                                       redirectUri:redirectUri
-                                             scope:scope
-                                            userId:userId
-                                    promptBehavior:promptBehavior
-                              extraQueryParameters:queryParams
-                                     correlationId:correlationId
-                                        completion:^(NSString * code, ADAuthenticationError *error)
-                        {
-                            if (error)
-                            {
-                                ADAuthenticationResult* result = (AD_ERROR_USER_CANCEL == error.code) ? [ADAuthenticationResult resultFromCancellation]
-                                : [ADAuthenticationResult resultFromError:error];
-                                completionBlock(result);
-                            }
-                            else
-                            {
-                                [self requestTokenByCode:code
-                                                resource:resource
-                                                clientId:clientId
-                                             redirectUri:redirectUri
-                                                   scope:scope
-                                           correlationId:correlationId
-                                              completion:^(ADAuthenticationResult *result)
-                                 {
-                                     if (AD_SUCCEEDED == result.status)
-                                     {
-                                         [self updateCacheToResult:result cacheItem:nil withRefreshToken:nil];
-                                         result = [self updateResult:result toUser:userId];
-                                     }
-                                     completionBlock(result);
-                                 }];
-                            }
-                        }];
-                   });
+        ADTraceSpan* codeSpan = [context.span childWithName:@"authorizationCode"];
+        //Get the code first:
+        [self requestCodeByResource:resource
+                           clientId:clientId
+                        redirectUri:redirectUri
+                              scope:scope
+                             userId:userId
+                     promptBehavior:promptBehavior
+               extraQueryParameters:queryParams
+                            context:context
+                         completion:^(NSString * code, ADAuthenticationError *error)
+         {
+             [codeSpan endWithError:error];
+             if (error)
+             {
+                 ADAuthenticationResult* result = (AD_ERROR_USER_CANCEL == error.code) ? [ADAuthenticationResult resultFromCancellation]
+                 : [ADAuthenticationResult resultFromError:error];
+                 completionBlock(result);
+             }
+             else
+             {
+                 [self requestTokenByCode:code
+                                 resource:resource
+                                 clientId:clientId
+                              redirectUri:redirectUri
+                                    scope:scope
+                                  context:context
+                               completion:^(ADAuthenticationResult *result)
+                  {
+                      if (AD_SUCCEEDED == result.status)
+                      {
+                          [self updateCacheToResult:result cacheItem:nil withRefreshToken:nil];
+                          result = [self updateResult:result toUser:userId];
+                      }
+                      completionBlock(result);
+                  }];
+             }
+         }];
+    });
 }
 
 -(void) acquireTokenByRefreshToken: (NSString*)refreshToken
@@ -962,7 +1083,7 @@ return; \
                                       userId:nil
                                    cacheItem:nil
                            validateAuthority:self.validateAuthority
-                               correlationId:[self getCorrelationId]
+                                     context:[self requestContext]
                              completionBlock:completionBlock];
 }
 
@@ -978,10 +1099,26 @@ return; \
                                       userId:nil
                                    cacheItem:nil
                            validateAuthority:self.validateAuthority
-                               correlationId:[self getCorrelationId]
+                                     context:[self requestContext]
                              completionBlock:completionBlock];
 }
 
+//Stores the items in the cache, in a single batch if the cache store supports it:
+-(void) addOrUpdateCacheItems: (NSArray*) items
+{
+    id<ADTokenCacheStoring> cache = self.tokenCacheStore;
+    if ([(id)cache respondsToSelector:@selector(addOrUpdateItems:failures:error:)])
+    {
+        [cache addOrUpdateItems:items failures:nil error:nil];
+        return;
+    }
+    
+    for(ADTokenCacheStoreItem* item in items)
+    {
+        [cache addOrUpdateItem:item error:nil];
+    }
+}
+
 //Stores the result in the cache. cacheItem parameter may be nil, if the result is successfull and contains
 //the item to be stored.
 -(void) updateCacheToResult: (ADAuthenticationResult*) result
@@ -1007,6 +1144,7 @@ return; \
         //In case of success we use explicitly the item that comes back in the result:
         cacheItem = result.tokenCacheStoreItem;
         NSString* savedRefreshToken = cacheItem.refreshToken;
+        NSMutableArray* toStore = [[NSMutableArray alloc] initWithCapacity:2];
         if (result.multiResourceRefreshToken)
         {
             AD_LOG_VERBOSE_F(@"Token cache store", @"Storing multi-resource refresh token for authority: %@", self.authority);
@@ -1021,11 +1159,12 @@ return; \
             multiRefreshTokenItem.accessToken = nil;
             multiRefreshTokenItem.resource = nil;
             multiRefreshTokenItem.expiresOn = nil;
-            [self.tokenCacheStore addOrUpdateItem:multiRefreshTokenItem error:nil];
+            [toStore addObject:multiRefreshTokenItem];
         }
         
         AD_LOG_VERBOSE_F(@"Token cache store", @"Storing access token for resource: %@", cacheItem.resource);
-        [self.tokenCacheStore addOrUpdateItem:cacheItem error:nil];
+        [toStore addObject:cacheItem];
+        [self addOrUpdateCacheItems:toStore];
         cacheItem.refreshToken = savedRefreshToken;//Restore for the result
     }
     else
@@ -1071,28 +1210,84 @@ return; \
     }
 }
 
+//Returns the key, which identifies the equivalent refresh token redemptions for this authority:
+-(NSString*) pendingRefreshKeyWithResource: (NSString*) resource
+                                  clientId: (NSString*) clientId
+                                    userId: (NSString*) userId
+{
+    userId = [ADUserInformation normalizeUserId:userId];
+    return [NSString stringWithFormat:@"%@|%@|%@|%@",
+            self.authority, resource ? resource : @"", clientId, userId ? userId : @""];
+}
+
+//Registers the completion block as waiting for the refresh token redemption, identified by the key.
+//Returns YES if the caller should send the request, or NO if an equivalent request is already in
+//flight, in which case the block will be called with the result of that request.
++(BOOL) addPendingRefreshWithKey: (NSString*) key
+                 completionBlock: (ADAuthenticationCallback) completionBlock
+{
+    @synchronized(self)
+    {
+        if (!sPendingRefreshes)
+        {
+            sPendingRefreshes = [NSMutableDictionary new];
+        }
+        NSMutableArray* waiting = [sPendingRefreshes objectForKey:key];
+        if (waiting)
+        {
+            [waiting addObject:[completionBlock copy]];
+            return NO;
+        }
+        [sPendingRefreshes setObject:[NSMutableArray arrayWithObject:[completionBlock copy]] forKey:key];
+        return YES;
+    }
+}
+
+//Removes the redemption from the in-flight table and returns all of the completion blocks waiting for it:
++(NSArray*) removePendingRefreshWithKey: (NSString*) key
+{
+    @synchronized(self)
+    {
+        NSArray* waiting = [sPendingRefreshes objectForKey:key];
+        [sPendingRefreshes removeObjectForKey:key];
+        return waiting;
+    }
+}
+
 //Obtains an access token from the passed refresh token. If "cacheItem" is passed, updates it with the additional
-//information and updates the cache:
+//information and updates the cache. The redemptions of cache items are coalesced: if an equivalent one is already
+//in flight, the completion block is called with its result instead of sending another request:
 -(void) internalAcquireTokenByRefreshToken: (NSString*) refreshToken
                                   clientId: (NSString*) clientId
                                   resource: (NSString*) resource
                                     userId: (NSString*) userId
                                  cacheItem: (ADTokenCacheStoreItem*) cacheItem
                          validateAuthority: (BOOL) validateAuthority
-                             correlationId: correlationId
+                                   context: (ADRequestContext*) context
                            completionBlock: (ADAuthenticationCallback)completionBlock
 {
     THROW_ON_NIL_ARGUMENT(completionBlock);
     HANDLE_ARGUMENT(refreshToken);
     HANDLE_ARGUMENT(clientId);
+    HANDLE_ARGUMENT(context);
+    
+    if (!context.span)
+    {
+        //The entry point of the operation; the internal calls pass the context with its span:
+        context = [context contextWithSpan:[ADTraceSpan rootSpanWithName:@"acquireTokenByRefreshToken" correlationId:context.correlationId]];
+        [context.span setAttribute:resource forKey:@"resource"];
+        completionBlock = completionEndingSpan(context.span, completionBlock);
+    }
+    AD_REQUEST_CONTEXT_SCOPE(context);
     
     AD_LOG_VERBOSE_F(@"Attempting to acquire an access token from refresh token.", @"Resource: %@", resource);
     
-    [self updateCorrelationId:&correlationId];
     if (validateAuthority)
     {
-        [[ADInstanceDiscovery sharedInstance] validateAuthority:self.authority correlationId:correlationId completionBlock:^(BOOL validated, ADAuthenticationError *error)
+        ADTraceSpan* validationSpan = [context.span childWithName:@"authorityValidation"];
+        [[ADInstanceDiscovery sharedInstance] validateAuthority:self.authority correlationId:context.correlationId completionBlock:^(BOOL validated, ADAuthenticationError *error)
          {
+             [validationSpan endWithError:error];
              if (error)
              {
                  completionBlock([ADAuthenticationResult resultFromError:error]);
@@ -1105,7 +1300,7 @@ return; \
                                                    userId:userId
                                                 cacheItem:cacheItem
                                         validateAuthority:NO /*Already validated in this block. */
-                                            correlationId:correlationId
+                                                  context:context
                                           completionBlock:completionBlock];
              }
          }];
@@ -1130,16 +1325,35 @@ return; \
             [request_data setObject:resource forKey:OAUTH2_RESOURCE];
         }
     
-    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0), ^
+    //Only the redemptions of the cached refresh tokens are coalesced. The explicit acquireTokenByRefreshToken
+    //calls can pass arbitrary tokens, so they always go to the server:
+    ADTraceSpan* refreshSpan = [context.span childWithName:@"refreshTokenRedemption"];
+    completionBlock = completionEndingSpan(refreshSpan, completionBlock);
+    NSString* pendingKey = nil;
+    if (cacheItem)
+    {
+        pendingKey = [self pendingRefreshKeyWithResource:resource clientId:clientId userId:userId];
+        if (![self.class addPendingRefreshWithKey:pendingKey completionBlock:completionBlock])
+        {
+            AD_LOG_VERBOSE_F(@"Refresh token redemption is already in progress.", @"Resource: %@; waiting for its result. Correlation id: %@", resource, [context.correlationId UUIDString]);
+            [refreshSpan setAttribute:@YES forKey:@"coalesced"];
+            return;
+        }
+    }
+    
+    dispatch_async([ADAuthenticationSettings sharedInstance].dispatchQueue, ^
                    {
+                       AD_REQUEST_CONTEXT_SCOPE(context);
                        AD_LOG_INFO_F(@"Sending request for refreshing token.", @"Client id: '%@'; resource: '%@';", clientId, resource);
+                       [[ADClientMetrics getInstance] incrementCounter:AD_COUNTER_REFRESH];
                        [self request:self.authority
                          requestData:request_data
-                requestCorrelationId:correlationId
+                             context:[context contextWithSpan:refreshSpan]
          isHandlingPKeyAuthChallenge:FALSE
                    additionalHeaders:nil
                           completion:^(NSDictionary *response)
                         {
+                            AD_REQUEST_CONTEXT_SCOPE(context);
                             ADTokenCacheStoreItem* resultItem = (cacheItem) ? cacheItem : [ADTokenCacheStoreItem new];
                             
                             //Always ensure that the cache item has all of these set, especially in the broad token case, where the passed item
@@ -1149,7 +1363,7 @@ return; \
                             resultItem.authority = self.authority;
                             
                             
-                            ADAuthenticationResult *result = [self processTokenResponse:response forItem:resultItem fromRefresh:YES requestCorrelationId:correlationId];
+                            ADAuthenticationResult *result = [self processTokenResponse:response forItem:resultItem fromRefresh:YES requestCorrelationId:context.correlationId];
                             if (cacheItem)//The request came from the cache item, update it:
                             {
                                 [self updateCacheToResult:result
@@ -1158,11 +1372,523 @@ return; \
                             }
                             result = [self updateResult:result toUser:userId];//Verify the user (just in case)
                             
-                            completionBlock(result);
+                            if (!pendingKey)
+                            {
+                                completionBlock(result);
+                                return;
+                            }
+                            
+                            //The cache is updated before the entry is removed, so the callers arriving after
+                            //this point will find the new tokens there:
+                            for(ADAuthenticationCallback waitingBlock in [self.class removePendingRefreshWithKey:pendingKey])
+                            {
+                                waitingBlock(result);
+                            }
                         }];
                    });
 }
 
+-(BOOL) getBackgroundRefreshEnabled
+{
+    @synchronized(self)
+    {
+        return mBackgroundRefreshEnabled;
+    }
+}
+
+-(void) setBackgroundRefreshEnabled: (BOOL) backgroundRefreshEnabled
+{
+    NSUInteger schedule;
+    @synchronized(self)
+    {
+        if (mBackgroundRefreshEnabled == backgroundRefreshEnabled)
+        {
+            return;
+        }
+        mBackgroundRefreshEnabled = backgroundRefreshEnabled;
+        schedule = ++mBackgroundRefreshSchedule;
+    }
+    
+    AD_LOG_INFO_F(@"Background token refresh", @"%@ for authority: %@", backgroundRefreshEnabled ? @"Enabled" : @"Disabled", self.authority);
+    if (backgroundRefreshEnabled)
+    {
+        [self scheduleBackgroundRefreshScan:schedule after:0];
+    }
+}
+
+//Remembers that the application requested the token, so that the background refresh keeps it fresh:
+-(void) trackBackgroundRefreshOfResource: (NSString*) resource
+                                clientId: (NSString*) clientId
+{
+    NSString* key = [self pendingRefreshKeyWithResource:resource clientId:clientId userId:nil];
+    @synchronized(self)
+    {
+        if (!mBackgroundRefreshEnabled)
+        {
+            return;
+        }
+        if (!mRefreshLastUse)
+        {
+            mRefreshLastUse = [NSMutableDictionary new];
+            mRefreshFailures = [NSMutableDictionary new];
+            mRefreshRetryAt = [NSMutableDictionary new];
+        }
+        [mRefreshLastUse setObject:[NSDate date] forKey:key];
+    }
+}
+
+//Records the outcome of a background refresh. The failures postpone the next attempt for the
+//token exponentially: 30 seconds, 1 minute, 2 minutes and so on, up to an hour:
+-(void) backgroundRefreshOfKey: (NSString*) key
+                     succeeded: (BOOL) succeeded
+{
+    @synchronized(self)
+    {
+        if (succeeded)
+        {
+            [mRefreshFailures removeObjectForKey:key];
+            [mRefreshRetryAt removeObjectForKey:key];
+            return;
+        }
+        
+        NSUInteger failures = [[mRefreshFailures objectForKey:key] unsignedIntegerValue] + 1;
+        NSTimeInterval backoff = MIN(sBackgroundRefreshMinInterval * pow(2, MIN(failures - 1, 16)), sBackgroundRefreshMaxBackoff);
+        [mRefreshFailures setObject:[NSNumber numberWithUnsignedInteger:failures] forKey:key];
+        [mRefreshRetryAt setObject:[NSDate dateWithTimeIntervalSinceNow:backoff] forKey:key];
+    }
+}
+
+//Schedules a scan of the cache for tokens about to expire. The weak reference makes sure that
+//the pending scans do not keep the context alive:
+-(void) scheduleBackgroundRefreshScan: (NSUInteger) schedule
+                                after: (NSTimeInterval) delay
+{
+    __weak ADAuthenticationContext* weakSelf = self;
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(delay * NSEC_PER_SEC)),
+                   dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0), ^
+                   {
+                       [weakSelf backgroundRefreshScan:schedule];
+                   });
+}
+
+//Redeems the refresh tokens for the cached access tokens of this authority, which the application
+//used recently and which will expire soon. Schedules the next scan for the earliest expiration of the rest.
+-(void) backgroundRefreshScan: (NSUInteger) schedule
+{
+    NSDictionary* retryAt;
+    NSMutableSet* recent = [NSMutableSet new];
+    @synchronized(self)
+    {
+        if (schedule != mBackgroundRefreshSchedule)
+        {
+            return;//Turned off or restarted in the meantime
+        }
+        
+        //Forget the tokens, which the application does not use anymore:
+        for(NSString* key in mRefreshLastUse.allKeys)
+        {
+            if (-[[mRefreshLastUse objectForKey:key] timeIntervalSinceNow] > sBackgroundRefreshRecentUse)
+            {
+                [mRefreshLastUse removeObjectForKey:key];
+                [mRefreshFailures removeObjectForKey:key];
+                [mRefreshRetryAt removeObjectForKey:key];
+            }
+            else
+            {
+                [recent addObject:key];
+            }
+        }
+        retryAt = [mRefreshRetryAt copy];
+    }
+    
+    NSTimeInterval nextScan = sBackgroundRefreshMaxInterval;
+    id<ADTokenCacheStoring> cache = self.tokenCacheStore;
+    if (!recent.count || !cache)
+    {
+        [self scheduleBackgroundRefreshScan:schedule after:nextScan];
+        return;
+    }
+    
+    ADAuthenticationError* error = nil;
+    //Only the items of this authority are needed, so avoid reading the whole shared cache when possible:
+    NSArray* items = ([(id)cache respondsToSelector:@selector(itemsWithAuthority:clientId:error:)])
+        ? [cache itemsWithAuthority:self.authority clientId:nil error:&error]
+        : [cache allItemsWithError:&error];
+    if (error)
+    {
+        AD_LOG_WARN_F(@"Background token refresh", @"Cannot read the cache: %@", error.errorDetails);
+    }
+    
+    NSTimeInterval lead = sBackgroundRefreshLead + [ADAuthenticationSettings sharedInstance].expirationBuffer;
+    for(ADTokenCacheStoreItem* item in items)
+    {
+        if (!item.expiresOn || !item.resource || [NSString adIsStringNilOrBlank:item.accessToken]
+            || ![self.authority isEqualToString:item.authority])
+        {
+            continue;
+        }
+        NSString* key = [self pendingRefreshKeyWithResource:item.resource clientId:item.clientId userId:nil];
+        if (![recent containsObject:key])
+        {
+            continue;
+        }
+        
+        NSTimeInterval refreshIn = [item.expiresOn timeIntervalSinceNow] - lead - arc4random_uniform(sBackgroundRefreshJitter);
+        NSDate* retryDate = [retryAt objectForKey:key];
+        if (retryDate)
+        {
+            //Backing off after failures:
+            refreshIn = MAX(refreshIn, [retryDate timeIntervalSinceNow]);
+        }
+        if (refreshIn <= 0)
+        {
+            [self backgroundRefreshItem:item cache:cache key:key];
+        }
+        else if (refreshIn < nextScan)
+        {
+            nextScan = refreshIn;
+        }
+    }
+    
+    [self scheduleBackgroundRefreshScan:schedule after:MAX(nextScan, sBackgroundRefreshMinInterval)];
+}
+
+//Redeems the refresh token, which applies to the passed access token item. The cache is
+//updated through the regular refresh token path.
+-(void) backgroundRefreshItem: (ADTokenCacheStoreItem*) item
+                        cache: (id<ADTokenCacheStoring>) cache
+                          key: (NSString*) key
+{
+    NSString* userId = item.userInformation.userId;
+    ADTokenCacheStoreItem* refreshItem = item;
+    if ([NSString adIsStringNilOrBlank:item.refreshToken])
+    {
+        //The access token items do not contain the multi-resource refresh tokens, look up the broad item:
+        ADTokenCacheStoreKey* broadKey = [ADTokenCacheStoreKey keyWithAuthority:self.authority resource:nil clientId:item.clientId error:nil];
+        refreshItem = (broadKey) ? [cache getItemWithKey:broadKey userId:userId error:nil] : nil;
+        if ([NSString adIsStringNilOrBlank:refreshItem.refreshToken])
+        {
+            return;//Nothing to refresh with, leave it to the interactive flows
+        }
+    }
+    
+    NSString* resource = item.resource;
+    AD_LOG_VERBOSE_F(@"Background token refresh", @"Refreshing the access token for resource: %@", resource);
+    __weak ADAuthenticationContext* weakSelf = self;
+    [self internalAcquireTokenByRefreshToken:refreshItem.refreshToken
+                                    clientId:item.clientId
+                                    resource:resource
+                                      userId:userId
+                                   cacheItem:refreshItem
+                           validateAuthority:NO /* The item came from the cache */
+                                     context:[self requestContext]
+                             completionBlock:^(ADAuthenticationResult *result)
+     {
+         if (AD_SUCCEEDED != result.status)
+         {
+             AD_LOG_WARN_F(@"Background token refresh", @"Failed to refresh the token for resource: %@. Error: %@", resource, result.error.errorDetails);
+         }
+         [weakSelf backgroundRefreshOfKey:key succeeded:(AD_SUCCEEDED == result.status)];
+     }];
+}
+
+//Reads the items of this authority and client with a single cache query and groups them by their keys:
+-(NSDictionary*) cacheSnapshotWithClientId: (NSString*) clientId
+                                     error: (ADAuthenticationError* __autoreleasing*) error
+{
+    id<ADTokenCacheStoring> cache = self.tokenCacheStore;
+    if (!cache)
+    {
+        return [NSDictionary new];
+    }
+    
+    NSArray* items = ([(id)cache respondsToSelector:@selector(itemsWithAuthority:clientId:error:)])
+        ? [cache itemsWithAuthority:self.authority clientId:clientId error:error]
+        : [cache allItemsWithError:error];
+    if (!items)
+    {
+        return nil;
+    }
+    
+    NSMutableDictionary* snapshot = [NSMutableDictionary new];
+    for(ADTokenCacheStoreItem* item in items)
+    {
+        ADTokenCacheStoreKey* key = [item extractKeyWithError:nil];
+        if (!key)
+        {
+            continue;
+        }
+        NSMutableArray* keyItems = [snapshot objectForKey:key];
+        if (!keyItems)
+        {
+            keyItems = [NSMutableArray new];
+            [snapshot setObject:keyItems forKey:key];
+        }
+        [keyItems addObject:item];
+    }
+    return snapshot;
+}
+
+//The snapshot counterpart of extractCacheItemWithKey. The userId should be normalized:
+-(ADTokenCacheStoreItem*) itemFromSnapshot: (NSDictionary*) snapshot
+                                   withKey: (ADTokenCacheStoreKey*) key
+                                    userId: (NSString*) userId
+                                     error: (ADAuthenticationError* __autoreleasing*) error
+{
+    NSArray* items = [snapshot objectForKey:key];
+    if (!userId)
+    {
+        if (items.count > 1)
+        {
+            if (error)
+            {
+                *error = [ADAuthenticationError errorFromAuthenticationError:AD_ERROR_MULTIPLE_USERS
+                                                                protocolCode:nil
+                                                                errorDetails:sMultiUserError];
+            }
+            return nil;
+        }
+        return items.firstObject;
+    }
+    
+    ADTokenCacheStoreItem* noUserItem = nil;
+    for(ADTokenCacheStoreItem* item in items)
+    {
+        if (!item.userInformation)
+        {
+            noUserItem = item;
+        }
+        else if ([userId isEqualToString:item.userInformation.userId])
+        {
+            return item;
+        }
+    }
+    return noUserItem;//ADFS fix, where the userId is not received by the server
+}
+
+//Obtains the tokens for all of the resources with a single authority validation and a single cache read:
+-(void) internalAcquireTokensSilentWithResources: (NSArray*) resources
+                                        clientId: (NSString*) clientId
+                                          userId: (NSString*) userId
+                               validateAuthority: (BOOL) validateAuthority
+                                         context: (ADRequestContext*) context
+                                 completionBlock: (ADAuthenticationBulkCallback) completionBlock
+{
+    THROW_ON_NIL_ARGUMENT(completionBlock);
+    THROW_ON_NIL_ARGUMENT(context);
+    
+    //Each resource is processed once, even if requested several times:
+    NSOrderedSet* uniqueResources = [NSOrderedSet orderedSetWithArray:(resources) ? resources : @[]];
+    if (!uniqueResources.count)
+    {
+        completionBlock([NSDictionary new]);
+        return;
+    }
+    
+    if (!context.span)
+    {
+        //The entry point of the operation:
+        ADTraceSpan* span = [ADTraceSpan rootSpanWithName:@"acquireTokensSilent" correlationId:context.correlationId];
+        [span setAttribute:[NSNumber numberWithUnsignedInteger:uniqueResources.count] forKey:@"resources"];
+        context = [context contextWithSpan:span];
+        if (span)
+        {
+            ADAuthenticationBulkCallback callback = completionBlock;
+            completionBlock = ^(NSDictionary* results)
+            {
+                [span end];
+                callback(results);
+            };
+        }
+    }
+    AD_REQUEST_CONTEXT_SCOPE(context);
+    
+    NSMutableDictionary* results = [[NSMutableDictionary alloc] initWithCapacity:uniqueResources.count];
+    if (validateAuthority)
+    {
+        ADTraceSpan* validationSpan = [context.span childWithName:@"authorityValidation"];
+        [[ADInstanceDiscovery sharedInstance] validateAuthority:self.authority correlationId:context.correlationId completionBlock:^(BOOL validated, ADAuthenticationError *error)
+         {
+#pragma unused(validated)
+             [validationSpan endWithError:error];
+             if (error)
+             {
+                 ADAuthenticationResult* result = [ADAuthenticationResult resultFromError:error];
+                 for(NSString* resource in uniqueResources)
+                 {
+                     [results setObject:result forKey:resource];
+                 }
+                 completionBlock(results);
+             }
+             else
+             {
+                 [self internalAcquireTokensSilentWithResources:resources
+                                                       clientId:clientId
+                                                         userId:userId
+                                              validateAuthority:NO /* Already validated in this block. */
+                                                        context:context
+                                                completionBlock:completionBlock];
+             }
+         }];
+        return;//The asynchronous handler above will do the work.
+    }
+    
+    userId = [ADUserInformation normalizeUserId:userId];
+    //The cache lookup and the rest of the work run on the library work queue, rather than on the caller's thread:
+    dispatch_async([ADAuthenticationSettings sharedInstance].dispatchQueue, ^
+    {
+        AD_REQUEST_CONTEXT_SCOPE(context);
+        ADAuthenticationError* error = nil;
+        ADTraceSpan* lookupSpan = [context.span childWithName:@"cacheLookup"];
+        NSDictionary* snapshot = [self cacheSnapshotWithClientId:clientId error:&error];
+        [lookupSpan endWithError:error];
+        if (!snapshot)
+        {
+            ADAuthenticationResult* result = [ADAuthenticationResult resultFromError:error];
+            for(NSString* resource in uniqueResources)
+            {
+                [results setObject:result forKey:resource];
+            }
+            completionBlock(results);
+            return;
+        }
+    
+        //The multi-resource refresh token is shared by all of the resources:
+        ADAuthenticationError* broadError = nil;
+        ADTokenCacheStoreKey* broadKey = [ADTokenCacheStoreKey keyWithAuthority:self.authority resource:nil clientId:clientId error:&broadError];
+        ADTokenCacheStoreItem* broadItem = (broadKey) ? [self itemFromSnapshot:snapshot withKey:broadKey userId:userId error:&broadError] : nil;
+        if (![NSString adIsStringNilOrBlank:broadItem.refreshToken] && !broadItem.multiResourceRefreshToken)
+        {
+            AD_LOG_WARN(@"Unexpected", @"Multi-resource refresh token expected here.");
+            broadItem = nil;
+        }
+    
+        //Maps the resources, which need refresh token redemption, to the cache items to redeem:
+        NSMutableDictionary* redemptions = [NSMutableDictionary new];
+        for(NSString* resource in uniqueResources)
+        {
+            if ([NSString adIsStringNilOrBlank:resource])
+            {
+                [results setObject:[ADAuthenticationResult resultFromError:[ADAuthenticationError errorFromArgument:resource argumentName:@"resource"]]
+                            forKey:resource];
+                continue;
+            }
+        
+            error = nil;
+            [self trackBackgroundRefreshOfResource:resource clientId:clientId];
+            ADTokenCacheStoreKey* key = [ADTokenCacheStoreKey keyWithAuthority:self.authority resource:resource clientId:clientId error:&error];
+            ADTokenCacheStoreItem* item = (key) ? [self itemFromSnapshot:snapshot withKey:key userId:userId error:&error] : nil;
+            if (error)
+            {
+                [results setObject:[ADAuthenticationResult resultFromError:error] forKey:resource];
+                continue;
+            }
+        
+            BOOL accessTokenUsable = item.accessToken && !item.isExpired;
+            [[ADClientMetrics getInstance] incrementCounter:(accessTokenUsable) ? AD_COUNTER_CACHE_HIT : AD_COUNTER_CACHE_MISS];
+            if (accessTokenUsable)
+            {
+                [ADLogger logToken:item.accessToken tokenType:@"access token" expiresOn:item.expiresOn correlationId:nil];
+                [results setObject:[ADAuthenticationResult resultFromTokenCacheStoreItem:item multiResourceRefreshToken:NO] forKey:resource];
+            }
+            else if (![NSString adIsStringNilOrBlank:item.refreshToken])
+            {
+                [redemptions setObject:item forKey:resource];
+            }
+            else if (![NSString adIsStringNilOrBlank:broadItem.refreshToken])
+            {
+                [redemptions setObject:broadItem forKey:resource];
+            }
+            else
+            {
+                error = (broadError) ? broadError : [ADAuthenticationError errorFromAuthenticationError:AD_ERROR_USER_INPUT_NEEDED
+                                                                                           protocolCode:nil
+                                                                                           errorDetails:credentialsNeeded];
+                [results setObject:[ADAuthenticationResult resultFromError:error] forKey:resource];
+            }
+        }
+    
+        AD_LOG_VERBOSE_F(@"Bulk silent token acquisition.", @"Resources: %lu; resolved from the cache: %lu; to redeem: %lu",
+                         (unsigned long)uniqueResources.count, (unsigned long)(results.count), (unsigned long)redemptions.count);
+        if (!redemptions.count)
+        {
+            completionBlock(results);
+            return;
+        }
+    
+        NSMutableArray* queue = [redemptions.allKeys mutableCopy];
+        for(NSUInteger i = 0; i < MIN(sBulkRedemptionFanOut, redemptions.count); ++i)
+        {
+            [self redeemNextFromQueue:queue
+                          redemptions:redemptions
+                             clientId:clientId
+                               userId:userId
+                              results:results
+                                total:uniqueResources.count
+                              context:context
+                      completionBlock:completionBlock];
+        }
+    });
+}
+
+//Takes the next resource from the queue and redeems the refresh token of its cache item. Upon completion, continues
+//with the next one, so that each call keeps one redemption in flight. The last completed redemption calls the
+//completion block with all of the results:
+-(void) redeemNextFromQueue: (NSMutableArray*) queue
+                redemptions: (NSDictionary*) redemptions
+                   clientId: (NSString*) clientId
+                     userId: (NSString*) userId
+                    results: (NSMutableDictionary*) results
+                      total: (NSUInteger) total
+                    context: (ADRequestContext*) context
+            completionBlock: (ADAuthenticationBulkCallback) completionBlock
+{
+    NSString* resource;
+    @synchronized(queue)
+    {
+        resource = queue.firstObject;
+        if (!resource)
+        {
+            return;
+        }
+        [queue removeObjectAtIndex:0];
+    }
+    
+    [self attemptToUseCacheItem:[redemptions objectForKey:resource]
+                 useAccessToken:NO
+                       resource:resource
+                       clientId:clientId
+                    redirectUri:nil /* Not used by the silent flows. */
+                 promptBehavior:AD_PROMPT_AUTO
+                         silent:YES
+                         userId:userId
+           extraQueryParameters:nil
+                        context:context
+                completionBlock:^(ADAuthenticationResult *result)
+     {
+         BOOL done;
+         @synchronized(results)
+         {
+             [results setObject:result forKey:resource];
+             done = (results.count == total);
+         }
+         if (done)
+         {
+             completionBlock(results);
+             return;
+         }
+         
+         [self redeemNextFromQueue:queue
+                       redemptions:redemptions
+                          clientId:clientId
+                            userId:userId
+                           results:results
+                             total:total
+                           context:context
+                   completionBlock:completionBlock];
+     }];
+}
+
 //Used in the flows, where developer requested an explicit user. The method compares
 //the user for the obtained tokens (if provided by the server). If the user is different,
 //an error result is returned. Returns the same result, if no issues are found.
@@ -1441,14 +2167,15 @@ return; \
                        userId: (NSString*) userId
                promptBehavior: (ADPromptBehavior) promptBehavior
          extraQueryParameters: (NSString*) queryParams
-                correlationId: (NSUUID*) correlationId
+                      context: (ADRequestContext*) context
                    completion: (ADAuthorizationCodeCallback) completionBlock
 {
     THROW_ON_NIL_ARGUMENT(completionBlock);
-    if(!correlationId){
-        completionBlock(nil, [ADAuthenticationError errorFromArgument:correlationId argumentName:@"correlationId"]);
+    if(!context){
+        completionBlock(nil, [ADAuthenticationError errorFromArgument:context argumentName:@"context"]);
         return;
     }
+    AD_REQUEST_CONTEXT_SCOPE(context);
     
     AD_LOG_VERBOSE_F(@"Requesting authorization code.", @"Requesting authorization code for resource: %@", resource);
     if (![self takeExclusionLockWithCallback:completionBlock])
@@ -1466,44 +2193,51 @@ return; \
                                         promptBehavior:promptBehavior
                                   extraQueryParameters:queryParams];
     
-    [[ADAuthenticationBroker sharedInstance] start:[NSURL URLWithString:startUrl]
-                                               end:[NSURL URLWithString:[redirectUri absoluteString]]
-                                  parentController:self.parentController
-                                           webView:self.webView
-                                        fullScreen:settings.enableFullScreen
-                                     correlationId:correlationId
-                                        completion:^( ADAuthenticationError *error, NSURL *end )
-     {
-         [self releaseExclusionLock]; // Allow other operations that use the UI for credentials.
-         
-         NSString* code = nil;
-         if (!error)
+    [[ADClientMetrics getInstance] incrementCounter:AD_COUNTER_UI_PROMPT];
+    //The URL is built on the work queue; only the presentation of the web view needs the main one.
+    //The broker calls the completion back on the work queue:
+    dispatch_async(dispatch_get_main_queue(), ^
+    {
+        [[ADAuthenticationBroker sharedInstance] start:[NSURL URLWithString:startUrl]
+                                                   end:[NSURL URLWithString:[redirectUri absoluteString]]
+                                      parentController:self.parentController
+                                               webView:self.webView
+                                            fullScreen:settings.enableFullScreen
+                                         correlationId:context.correlationId
+                                            completion:^( ADAuthenticationError *error, NSURL *end )
          {
-             //Try both the URL and the fragment parameters:
-             NSDictionary *parameters = [end adFragmentParameters];
-             if ( parameters.count == 0 )
-             {
-                 parameters = [end adQueryParameters];
-             }
-             
-             //OAuth2 error may be passed by the server:
-             error = [self errorFromDictionary:parameters errorCode:AD_ERROR_AUTHENTICATION];
+             AD_REQUEST_CONTEXT_SCOPE(context);
+             [self releaseExclusionLock]; // Allow other operations that use the UI for credentials.
+         
+             NSString* code = nil;
              if (!error)
              {
-                 //Note that we do not enforce the state, just log it:
-                 [self verifyStateFromDictionary:parameters];
-                 code = [parameters objectForKey:OAUTH2_CODE];
-                 if ([NSString adIsStringNilOrBlank:code])
+                 //Try both the URL and the fragment parameters:
+                 NSDictionary *parameters = [end adFragmentParameters];
+                 if ( parameters.count == 0 )
                  {
-                     error = [ADAuthenticationError errorFromAuthenticationError:AD_ERROR_AUTHENTICATION
-                                                                    protocolCode:nil
-                                                                    errorDetails:@"The authorization server did not return a valid authorization code."];
+                     parameters = [end adQueryParameters];
+                 }
+             
+                 //OAuth2 error may be passed by the server:
+                 error = [self errorFromDictionary:parameters errorCode:AD_ERROR_AUTHENTICATION];
+                 if (!error)
+                 {
+                     //Note that we do not enforce the state, just log it:
+                     [self verifyStateFromDictionary:parameters];
+                     code = [parameters objectForKey:OAUTH2_CODE];
+                     if ([NSString adIsStringNilOrBlank:code])
+                     {
+                         error = [ADAuthenticationError errorFromAuthenticationError:AD_ERROR_AUTHENTICATION
+                                                                        protocolCode:nil
+                                                                        errorDetails:@"The authorization server did not return a valid authorization code."];
+                     }
                  }
              }
-         }
          
-         completionBlock(code, error);
-     }];
+             completionBlock(code, error);
+         }];
+    });
 }
 
 
@@ -1514,11 +2248,12 @@ return; \
                        resource: (NSString *) resource
                        clientId: (NSString*) clientId
                           scope: (NSString*) scope //For future use
-                  correlationId: (NSUUID*) correlationId
+                        context: (ADRequestContext*) context
                      completion: (ADAuthenticationCallback) completionBlock
 {
 #pragma unused(scope)
-    HANDLE_ARGUMENT(correlationId);//Should be set by the caller
+    HANDLE_ARGUMENT(context);//Should be set by the caller
+    AD_REQUEST_CONTEXT_SCOPE(context);
     AD_LOG_VERBOSE_F(@"Requesting token from authorization code.", @"Requesting token by authorization code for resource: %@", resource);
     
     //samlAssertion = [NSString samlAssertion adBase64];
@@ -1531,7 +2266,7 @@ return; \
                                          clientId, OAUTH2_CLIENT_ID,
                                          resource, OAUTH2_RESOURCE,
                                          nil];
-    [self executeRequest:self.authority requestData:request_data resource:resource clientId:clientId requestCorrelationId:correlationId isHandlingPKeyAuthChallenge:NO additionalHeaders:nil completion:completionBlock];
+    [self executeRequest:self.authority requestData:request_data resource:resource clientId:clientId context:context isHandlingPKeyAuthChallenge:NO additionalHeaders:nil completion:completionBlock];
 }
 
 - (NSString*) getAssertionTypeGrantValue:(ADAssertionType) assertionType
@@ -1553,11 +2288,12 @@ return; \
                   clientId: (NSString*) clientId
                redirectUri: (NSURL*) redirectUri
                      scope: (NSString*) scope
-             correlationId: (NSUUID*) correlationId
+                   context: (ADRequestContext*) context
                 completion: (ADAuthenticationCallback) completionBlock
 {
     HANDLE_ARGUMENT(code);
-    HANDLE_ARGUMENT(correlationId);//Should be set by the caller
+    HANDLE_ARGUMENT(context);//Should be set by the caller
+    AD_REQUEST_CONTEXT_SCOPE(context);
     AD_LOG_VERBOSE_F(@"Requesting token from authorization code.", @"Requesting token by authorization code for resource: %@", resource);
     
     //Fill the data for the token refreshing:
@@ -1568,7 +2304,7 @@ return; \
                                          [redirectUri absoluteString], OAUTH2_REDIRECT_URI,
                                          nil];
     
-    [self executeRequest:self.authority requestData:request_data resource:resource clientId:clientId requestCorrelationId:correlationId isHandlingPKeyAuthChallenge:NO additionalHeaders:nil completion:completionBlock];
+    [self executeRequest:self.authority requestData:request_data resource:resource clientId:clientId context:context isHandlingPKeyAuthChallenge:NO additionalHeaders:nil completion:completionBlock];
 }
 
 
@@ -1576,23 +2312,24 @@ return; \
            requestData:(NSDictionary *)request_data
               resource: (NSString *) resource
               clientId: (NSString*) clientId
-  requestCorrelationId: (NSUUID*) requestCorrelationId
+               context: (ADRequestContext*) context
 isHandlingPKeyAuthChallenge: (BOOL) isHandlingPKeyAuthChallenge
      additionalHeaders:(NSDictionary *)additionalHeaders
             completion: (ADAuthenticationCallback) completionBlock
 {
     [self request:authorizationServer
       requestData:request_data
-requestCorrelationId:requestCorrelationId
+          context:context
 isHandlingPKeyAuthChallenge:isHandlingPKeyAuthChallenge
 additionalHeaders:additionalHeaders
        completion:^(NSDictionary *response)
      {
+         AD_REQUEST_CONTEXT_SCOPE(context);
          //Prefill the known elements in the item. These can be overridden by the response:
          ADTokenCacheStoreItem* item = [ADTokenCacheStoreItem new];
          item.resource = resource;
          item.clientId = clientId;
-         completionBlock([self processTokenResponse:response forItem:item fromRefresh:NO requestCorrelationId:requestCorrelationId]);
+         completionBlock([self processTokenResponse:response forItem:item fromRefresh:NO requestCorrelationId:context.correlationId]);
      }];
 }
 
@@ -1601,19 +2338,22 @@ additionalHeaders:additionalHeaders
 // If the request generates an HTTP error, the method adds details to the "error" parameters of the dictionary.
 - (void)request:(NSString *)authorizationServer
     requestData:(NSDictionary *)request_data
-requestCorrelationId: (NSUUID*) requestCorrelationId
+        context: (ADRequestContext*) context
 isHandlingPKeyAuthChallenge: (BOOL) isHandlingPKeyAuthChallenge
 additionalHeaders:(NSDictionary *)additionalHeaders
      completion:( void (^)(NSDictionary *) )completionBlock
 {
+    AD_REQUEST_CONTEXT_SCOPE(context);
     NSString* endPoint = authorizationServer;
+    ADTraceSpan* requestSpan = [context.span childWithName:@"tokenRequest"];
+    [requestSpan setAttribute:[request_data objectForKey:OAUTH2_GRANT_TYPE] forKey:@"grantType"];
     
     if(!isHandlingPKeyAuthChallenge){
         endPoint = [authorizationServer stringByAppendingString:OAUTH2_TOKEN_SUFFIX];
     }
     
     ADWebRequest *webRequest = [[ADWebRequest alloc] initWithURL:[NSURL URLWithString:endPoint]
-                                                   correlationId:requestCorrelationId];
+                                                   correlationId:context.correlationId];
     
     webRequest.method = HTTPPost;
     [webRequest.headers setObject:@"application/json" forKey:@"Accept"];
@@ -1625,17 +2365,19 @@ additionalHeaders:(NSDictionary *)additionalHeaders
         }
     }
     
-    AD_LOG_VERBOSE_F(@"Post request", @"Sending POST request to %@ with client-request-id %@", endPoint, [requestCorrelationId UUIDString]);
+    AD_LOG_VERBOSE_F(@"Post request", @"Sending POST request to %@ with client-request-id %@", endPoint, [context.correlationId UUIDString]);
     
     webRequest.body = [[request_data adURLFormEncode] dataUsingEncoding:NSUTF8StringEncoding];
     __block NSDate* startTime = [NSDate new];
     [[ADClientMetrics getInstance] addClientMetrics:webRequest.headers endpoint:endPoint];
-    [webRequest send:^( NSError *error, ADWebResponse *webResponse ) {
+    void (^onResponse)(NSError*, ADWebResponse*) = ^( NSError *error, ADWebResponse *webResponse ) {
+        AD_REQUEST_CONTEXT_SCOPE(context);
         // Request completion callback
         NSMutableDictionary *response = [NSMutableDictionary new];
         
         if ( error == nil )
         {
+            [requestSpan setAttribute:[NSNumber numberWithInteger:webResponse.statusCode] forKey:@"statusCode"];
             NSDictionary* headers = webResponse.headers;
             //In most cases the correlation id is returned as a separate header
             NSString* responseCorrelationId = [headers objectForKey:OAUTH2_CORRELATION_ID_REQUEST_VALUE];
@@ -1653,33 +2395,28 @@ additionalHeaders:(NSDictionary *)additionalHeaders
                     if(!isHandlingPKeyAuthChallenge){
                         NSString* wwwAuthValue = [headers valueForKey:wwwAuthenticateHeader];
                         if(![NSString adIsStringNilOrBlank:wwwAuthValue] && [wwwAuthValue adContainsString:pKeyAuthName]){
-                            [self handlePKeyAuthChallenge:endPoint wwwAuthHeaderValue:wwwAuthValue requestData:request_data requestCorrelationId:requestCorrelationId completion:completionBlock];
+                            //The request span covers the signing and the second POST too:
+                            [self handlePKeyAuthChallenge:endPoint
+                                       wwwAuthHeaderValue:wwwAuthValue
+                                              requestData:request_data
+                                                  context:[context contextWithSpan:requestSpan]
+                                               completion:^(NSDictionary *challengeResponse)
+                             {
+                                 [requestSpan endWithError:[challengeResponse valueForKey:AUTH_NON_PROTOCOL_ERROR]];
+                                 completionBlock(challengeResponse);
+                             }];
                             return;
                         }
                     }
                     NSError   *jsonError  = nil;
-                    id         jsonObject = [NSJSONSerialization JSONObjectWithData:webResponse.body options:0 error:&jsonError];
-                    
-                    if ( nil != jsonObject && [jsonObject isKindOfClass:[NSDictionary class]] )
+                    // Load the response directly into the dictionary:
+                    if (![ADTokenResponseDecoder decodeData:webResponse.body intoDictionary:response error:&jsonError])
                     {
-                        // Load the response
-                        [response addEntriesFromDictionary:(NSDictionary*)jsonObject];
-                    }
-                    else
-                    {
-                        ADAuthenticationError* adError;
-                        if (jsonError)
-                        {
-                            // Unrecognized JSON response
-                            NSString* bodyStr = [[NSString alloc] initWithData:webResponse.body encoding:NSUTF8StringEncoding];
-                            AD_LOG_ERROR_F(@"JSON deserialization", jsonError.code, @"Error: %@. Body text: '%@'. HTTPS Code: %ld. Response correlation id: %@", jsonError.description, bodyStr, (long)webResponse.statusCode, responseCorrelationId);
-                            adError = [ADAuthenticationError errorFromNSError:jsonError errorDetails:jsonError.localizedDescription];
-                        }
-                        else
-                        {
-                            adError = [ADAuthenticationError unexpectedInternalError:[NSString stringWithFormat:@"Unexpected object type: %@", [jsonObject class]]];
-                        }
-                        [response setObject:adError forKey:AUTH_NON_PROTOCOL_ERROR];
+                        // Unrecognized JSON response
+                        NSString* bodyStr = [[NSString alloc] initWithData:webResponse.body encoding:NSUTF8StringEncoding];
+                        AD_LOG_ERROR_F(@"JSON deserialization", jsonError.code, @"Error: %@. Body text: '%@'. HTTPS Code: %ld. Response correlation id: %@", jsonError.description, bodyStr, (long)webResponse.statusCode, responseCorrelationId);
+                        [response setObject:[ADAuthenticationError errorFromNSError:jsonError errorDetails:jsonError.localizedDescription]
+                                     forKey:AUTH_NON_PROTOCOL_ERROR];
                     }
                 }
                     break;
@@ -1708,19 +2445,30 @@ additionalHeaders:(NSDictionary *)additionalHeaders
             NSString* errorDetails = [[response valueForKey:AUTH_NON_PROTOCOL_ERROR] errorDetails];
             [[ADClientMetrics getInstance] endClientMetricsRecord:endPoint
                                                         startTime:startTime
-                                                    correlationId:requestCorrelationId
+                                                    correlationId:context.correlationId
                                                      errorDetails:errorDetails];
         }
         else
         {
             [[ADClientMetrics getInstance] endClientMetricsRecord:endPoint
                                                         startTime:startTime
-                                                    correlationId:requestCorrelationId
+                                                    correlationId:context.correlationId
                                                      errorDetails:nil];
         }
+        [[ADClientMetrics getInstance] recordLatency:-[startTime timeIntervalSinceNow] type:AD_LATENCY_TOKEN];
+        [requestSpan endWithError:[response valueForKey:AUTH_NON_PROTOCOL_ERROR]];
         
         completionBlock( response );
-    }];
+    };
+    //The transport calls back on its own concurrent queue. The response decoding, its processing and
+    //the cache writes of the callers run on the library work queue instead:
+    [webRequest send:^( NSError *error, ADWebResponse *webResponse )
+     {
+         dispatch_async([ADAuthenticationSettings sharedInstance].dispatchQueue, ^
+                        {
+                            onResponse(error, webResponse);
+                        });
+     }];
 }
 
 // Encodes the state parameter for a protocol message
@@ -1734,9 +2482,11 @@ additionalHeaders:(NSDictionary *)additionalHeaders
 - (void) handlePKeyAuthChallenge:(NSString *)authorizationServer
               wwwAuthHeaderValue:(NSString *)wwwAuthHeaderValue
                      requestData:(NSDictionary *)request_data
-            requestCorrelationId: (NSUUID*) requestCorrelationId
+                         context: (ADRequestContext*) context
                       completion:( void (^)(NSDictionary *) )completionBlock
 {
+    AD_REQUEST_CONTEXT_SCOPE(context);
+    ADTraceSpan* challengeSpan = [context.span childWithName:@"pkeyAuthResponse"];
     //pkeyauth word length=8 + 1 whitespace
     wwwAuthHeaderValue = [wwwAuthHeaderValue substringFromIndex:[pKeyAuthName length] + 1];
     NSMutableDictionary* headerKeyValuePair = [[NSMutableDictionary alloc]init];
@@ -1750,8 +2500,9 @@ additionalHeaders:(NSDictionary *)additionalHeaders
     NSString* authHeader = [ADPkeyAuthHelper createDeviceAuthResponse:authorizationServer
                                                         challengeData:authHeaderParams];
     [headerKeyValuePair setObject:authHeader forKey:@"Authorization"];
+    [challengeSpan end];
     
-    [self request:authorizationServer requestData:request_data requestCorrelationId:requestCorrelationId isHandlingPKeyAuthChallenge:TRUE additionalHeaders:headerKeyValuePair completion:completionBlock];
+    [self request:authorizationServer requestData:request_data context:context isHandlingPKeyAuthChallenge:TRUE additionalHeaders:headerKeyValuePair completion:completionBlock];
 }
 
 @end
@@ -22,6 +22,7 @@
 #import "ADAuthenticationSettings.h"
 #import "ADWebRequest.h"
 #import "ADWebResponse.h"
+#import "ADClientMetrics.h"
 #import "NSString+ADHelperMethods.h"
 
 @implementation ADAuthenticationParameters
@@ -68,13 +69,15 @@
         return;
     }
 
-    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0),^
+    dispatch_async([ADAuthenticationSettings sharedInstance].dispatchQueue, ^
     {
         ADWebRequest* request = [[ADWebRequest alloc] initWithURL:resourceUrl correlationId:nil];
         request.method = HTTPGet;
         AD_LOG_VERBOSE_F(@"Starting authorization challenge request", @"Resource: %@", resourceUrl);
         
+        NSDate* startTime = [NSDate new];
         [request send:^(NSError * error, ADWebResponse *response) {
+            [[ADClientMetrics getInstance] recordLatency:-[startTime timeIntervalSinceNow] type:AD_LATENCY_CHALLENGE];
             ADAuthenticationError* adError;
             ADAuthenticationParameters* parameters;
             if (error)
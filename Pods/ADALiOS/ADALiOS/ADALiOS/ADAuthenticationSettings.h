@@ -18,6 +18,7 @@
 #import <Foundation/Foundation.h>
 
 @protocol ADTokenCacheStoring;
+@protocol ADHTTPTransport;
 
 /*! The class stores global settings for the ADAL library. It is a singleton class
  and the alloc, init and new should not be called directly. The "sharedInstance" selector
@@ -37,10 +38,21 @@
  about to expire. */
 @property uint expirationBuffer;
 
+/*! How long (in seconds) a successful authority validation is trusted. The validations are persisted, so
+ that the authorities validated in a previous application run do not need to be validated again on startup.
+ Set to 0 to disable the persisting. Default is 24 hours. */
+@property NSTimeInterval authorityValidationLifetime;
+
 /*! Used for the webView. Default is YES.*/
 @property BOOL enableFullScreen;
 
-/*! The dispatch queue to be used for the asynchronous calls. */
+/*! The dispatch queue, on which the library does its non-UI work: building the requests, accessing the
+ token cache and processing the server responses. The completion blocks of the acquireToken methods are
+ called on this queue too, including the ones answered from the cache, and not on the calling thread; the
+ applications should dispatch their UI work to the main queue. The default is a private concurrent queue.
+ Setting a serial queue serializes all of the library work, including the completion blocks, so that a
+ blocking completion block delays every other request. The authorization web view is always presented
+ on the main queue, regardless of this setting. */
 @property dispatch_queue_t dispatchQueue;
 
 /*! The default token cache store to be used by the ADAuthenticationContext instances. */
@@ -55,6 +67,12 @@
  sharing. The property has no effect if other cache mechanisms are used (non-keychain). */
 @property (getter = getSharedCacheKeychainGroup, setter = setSharedCacheKeychainGroup:) NSString* sharedCacheKeychainGroup;
 
+/*! The transport, which sends all of the HTTP requests of the library: token redemptions, authority
+ validations and resource challenges. The default one uses a shared NSURLSession. Can be replaced with
+ an ADLoopbackTransport to run the flows against canned responses, e.g. for load testing. Changing the
+ property does not affect the requests in flight. */
+@property id<ADHTTPTransport> httpTransport;
+
 /*! Some servers may require client authentication over TLS. The certificate will be stored in the
  shared keychain group, pointed by this property. */
 @property NSString* clientTLSKeychainGroup;
@@ -17,6 +17,8 @@
 // governing permissions and limitations under the License.
 #import "ADAuthenticationSettings.h"
 #import "ADKeychainTokenCacheStore.h"
+#import "ADMemoryTokenCacheStore.h"
+#import "ADURLSessionTransport.h"
 
 @implementation ADAuthenticationSettings
 
@@ -33,12 +35,16 @@
         self.requestTimeOut = 300;//in seconds.
         self.expirationBuffer = 300;//in seconds, ensures catching of clock differences between the server and the device
         self.enableFullScreen = YES;
+        self.authorityValidationLifetime = 24 * 60 * 60;//in seconds
         
-        //The current ADWebRequest implementation uses NSURLConnection, which calls its delegate on the same thread
-        //that created the object. Unfortunately with Grand Central Dispatch, it is not guaranteed that the thread
-        //exists. Hence for now, we create the connection on the main thread by default:
-        self.dispatchQueue = dispatch_get_main_queue();
-        self.defaultTokenCacheStore = [ADKeychainTokenCacheStore new];
+        //The library work runs on its own queue, so that the token processing does not compete with the
+        //application UI. Only the web view is presented on the main queue. The queue is concurrent: the shared
+        //state is guarded by its own locks, and a slow completion block must not hold up the other requests:
+        self.dispatchQueue = dispatch_queue_create("com.microsoft.adal.work", DISPATCH_QUEUE_CONCURRENT);
+        //The keychain is the persistent store; the memory store in front of it saves the keychain
+        //reads and the unarchiving for the repeated lookups of the same tokens:
+        self.defaultTokenCacheStore = [[ADMemoryTokenCacheStore alloc] initWithStore:[ADKeychainTokenCacheStore new]];
+        self.httpTransport = [ADURLSessionTransport new];
     }
     return self;
 }
@@ -57,26 +63,26 @@
     return instance;
 }
 
--(NSString*) getSharedCacheKeychainGroup
+//Returns the keychain store behind the default cache store, if any:
+-(ADKeychainTokenCacheStore*) keychainStore
 {
     id store = self.defaultTokenCacheStore;
-    if ([store isKindOfClass:[ADKeychainTokenCacheStore class]])
-    {
-        return ((ADKeychainTokenCacheStore*)store).sharedGroup;
-    }
-    else
+    if ([store isKindOfClass:[ADMemoryTokenCacheStore class]])
     {
-        return nil;
+        store = ((ADMemoryTokenCacheStore*)store).store;
     }
+    return [store isKindOfClass:[ADKeychainTokenCacheStore class]] ? store : nil;
+}
+
+-(NSString*) getSharedCacheKeychainGroup
+{
+    return [self keychainStore].sharedGroup;
 }
 
 -(void) setSharedCacheKeychainGroup:(NSString *)sharedKeychainGroup
 {
-    id store = self.defaultTokenCacheStore;
-    if ([store isKindOfClass:[ADKeychainTokenCacheStore class]])
-    {
-        ((ADKeychainTokenCacheStore*)store).sharedGroup = sharedKeychainGroup;
-    }
+    //Switching the group bumps the keychain store generation, which in turn drops the memory cache:
+    [self keychainStore].sharedGroup = sharedKeychainGroup;
 }
 
 @end
@@ -18,6 +18,46 @@
 
 #import <Foundation/Foundation.h>
 
+/*! The operations, whose latencies are tracked by ADClientMetrics. */
+typedef enum
+{
+    /*! Requests to the token endpoint, including the refresh token redemptions. */
+    AD_LATENCY_TOKEN,
+    
+    /*! Authority validation (instance discovery) requests. */
+    AD_LATENCY_DISCOVERY,
+    
+    /*! The requests to the resources, done to obtain the authentication challenge. */
+    AD_LATENCY_CHALLENGE,
+    
+    /*! The individual keychain operations of the token cache store. The other keychain accesses of the library
+     (broker keys, workplace join, TLS certificates) are not recorded. */
+    AD_LATENCY_KEYCHAIN,
+    
+    AD_LATENCY_COUNT
+} ADLatencyType;
+
+/*! The events, counted by ADClientMetrics. */
+typedef enum
+{
+    /*! A usable access token was found in the cache. */
+    AD_COUNTER_CACHE_HIT,
+    
+    /*! The cache did not have a usable access token for the request. */
+    AD_COUNTER_CACHE_MISS,
+    
+    /*! A refresh token was sent to the server. */
+    AD_COUNTER_REFRESH,
+    
+    /*! The user was prompted for credentials. */
+    AD_COUNTER_UI_PROMPT,
+    
+    /*! A duplicated keychain cache entry was removed, keeping its newest copy. */
+    AD_COUNTER_DUPLICATE_COMPACTION,
+    
+    AD_COUNTER_COUNT
+} ADCounterType;
+
 @interface ADClientMetrics : NSObject
 {
 @private
@@ -46,4 +86,24 @@
                  correlationId:(NSUUID *)correlationId
                   errorDetails:(NSString *)errorDetails;
 
+/*! Adds a latency sample to the histogram of the operation type. The samples are kept with ~6% precision,
+ so that the memory used does not depend on their number.
+ @param seconds: The duration of the operation. */
+- (void)recordLatency:(NSTimeInterval)seconds
+                 type:(ADLatencyType)type;
+
+/*! Increments the counter of the event type. The method does not take locks. */
+- (void)incrementCounter:(ADCounterType)counter;
+
+/*! Returns a copy of the current metrics, suitable for logging or reporting by the application.
+ The dictionary contains two entries:
+ "latencies": maps the names of the operation types ("token", "discovery", "challenge", "keychain") to dictionaries
+ with "count", "min", "max", "mean", "p50", "p90" and "p99" entries. The durations are NSNumbers in milliseconds.
+ "counters": maps the event names ("cacheHits", "cacheMisses", "refreshes", "uiPrompts",
+ "duplicateCompactions") to NSNumber values. */
+- (NSDictionary*)snapshot;
+
+/*! Clears all of the latency histograms and counters. */
+- (void)resetMetrics;
+
 @end
\ No newline at end of file
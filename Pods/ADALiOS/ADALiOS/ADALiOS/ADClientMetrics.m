@@ -20,8 +20,84 @@
 #import "ADClientMetrics.h"
 #import "ADHelpers.h"
 #import "NSString+ADHelperMethods.h"
-#import "ADLogger.h"
+#import "ADLogger+Internal.h"
 #import "ADErrorCodes.h"
+#include <stdatomic.h>
+
+//The latency histograms keep the samples in microseconds. The values below 16us have a bucket each,
+//the larger ones are grouped by their power of two, which is split in 16 linear sub-buckets. This keeps
+//the relative error around 6% up to ~19 hours, with a fixed number of buckets:
+#define SUB_BUCKET_BITS 4
+#define SUB_BUCKET_COUNT (1 << SUB_BUCKET_BITS)
+#define MAX_EXPONENT 35
+#define BUCKET_COUNT (SUB_BUCKET_COUNT * (MAX_EXPONENT - SUB_BUCKET_BITS + 2))
+
+typedef struct
+{
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[BUCKET_COUNT];
+} ADLatencyHistogram;
+
+//Guarded by the singleton instance:
+static ADLatencyHistogram sHistograms[AD_LATENCY_COUNT];
+//The counters are updated on the hot paths, so they are lock-free:
+static _Atomic(uint64_t) sCounters[AD_COUNTER_COUNT];
+
+static NSString* const sLatencyNames[AD_LATENCY_COUNT] = { @"token", @"discovery", @"challenge", @"keychain" };
+static NSString* const sCounterNames[AD_COUNTER_COUNT] = { @"cacheHits", @"cacheMisses", @"refreshes", @"uiPrompts", @"duplicateCompactions" };
+
+static NSUInteger bucketIndex(uint64_t value)
+{
+    if (value < SUB_BUCKET_COUNT)
+    {
+        return (NSUInteger)value;
+    }
+    
+    int exponent = 63 - __builtin_clzll(value);
+    if (exponent > MAX_EXPONENT)
+    {
+        return BUCKET_COUNT - 1;
+    }
+    NSUInteger subBucket = (NSUInteger)(value >> (exponent - SUB_BUCKET_BITS)) & (SUB_BUCKET_COUNT - 1);
+    return (exponent - SUB_BUCKET_BITS + 1) * SUB_BUCKET_COUNT + subBucket;
+}
+
+//Returns the middle of the range of values, which fall in the bucket:
+static uint64_t bucketValue(NSUInteger index)
+{
+    NSUInteger group = index / SUB_BUCKET_COUNT;
+    uint64_t subBucket = index % SUB_BUCKET_COUNT;
+    if (!group)
+    {
+        return subBucket;
+    }
+    uint64_t lowest = (SUB_BUCKET_COUNT + subBucket) << (group - 1);
+    return lowest + ((1ull << (group - 1)) >> 1);
+}
+
+static uint64_t percentile(const ADLatencyHistogram* histogram, double fraction)
+{
+    uint64_t rank = (uint64_t)ceil(fraction * histogram->count);
+    uint64_t seen = 0;
+    for(NSUInteger i = 0; i < BUCKET_COUNT; ++i)
+    {
+        seen += histogram->buckets[i];
+        if (seen >= rank)
+        {
+            //The bucket middle may lie outside of the actual samples:
+            return MAX(histogram->min, MIN(histogram->max, bucketValue(i)));
+        }
+    }
+    return histogram->max;
+}
+
+static NSNumber* milliseconds(uint64_t microseconds)
+{
+    return [NSNumber numberWithDouble:microseconds / 1000.0];
+}
 
 @implementation ADClientMetrics
 
@@ -119,6 +195,98 @@ const NSString* HeaderLastEndpoint = @"x-client-last-endpoint";
     }
 }
 
+- (void)recordLatency:(NSTimeInterval)seconds
+                 type:(ADLatencyType)type
+{
+    if (type >= AD_LATENCY_COUNT)
+    {
+        return;
+    }
+    
+    uint64_t microseconds = (seconds > 0) ? (uint64_t)(seconds * 1000000.0) : 0;
+    NSUInteger index = bucketIndex(microseconds);
+    @synchronized(self)
+    {
+        ADLatencyHistogram* histogram = &sHistograms[type];
+        if (!histogram->count || microseconds < histogram->min)
+        {
+            histogram->min = microseconds;
+        }
+        if (microseconds > histogram->max)
+        {
+            histogram->max = microseconds;
+        }
+        ++histogram->count;
+        histogram->sum += microseconds;
+        ++histogram->buckets[index];
+    }
+}
+
+- (void)incrementCounter:(ADCounterType)counter
+{
+    if (counter < AD_COUNTER_COUNT)
+    {
+        atomic_fetch_add_explicit(&sCounters[counter], 1, memory_order_relaxed);
+    }
+}
+
+- (NSDictionary*)snapshot
+{
+    //The histograms are copied, so that the percentiles are calculated outside of the lock:
+    ADLatencyHistogram* histograms = malloc(sizeof(sHistograms));
+    if (!histograms)
+    {
+        return nil;
+    }
+    @synchronized(self)
+    {
+        memcpy(histograms, sHistograms, sizeof(sHistograms));
+    }
+    
+    NSMutableDictionary* latencies = [NSMutableDictionary dictionaryWithCapacity:AD_LATENCY_COUNT];
+    for(NSUInteger i = 0; i < AD_LATENCY_COUNT; ++i)
+    {
+        const ADLatencyHistogram* histogram = &histograms[i];
+        if (!histogram->count)
+        {
+            [latencies setObject:@{ @"count":@0 } forKey:sLatencyNames[i]];
+            continue;
+        }
+        [latencies setObject:@{
+                               @"count":[NSNumber numberWithUnsignedLongLong:histogram->count],
+                               @"min":milliseconds(histogram->min),
+                               @"max":milliseconds(histogram->max),
+                               @"mean":milliseconds(histogram->sum / histogram->count),
+                               @"p50":milliseconds(percentile(histogram, 0.5)),
+                               @"p90":milliseconds(percentile(histogram, 0.9)),
+                               @"p99":milliseconds(percentile(histogram, 0.99)),
+                               }
+                      forKey:sLatencyNames[i]];
+    }
+    free(histograms);
+    
+    NSMutableDictionary* counters = [NSMutableDictionary dictionaryWithCapacity:AD_COUNTER_COUNT];
+    for(NSUInteger i = 0; i < AD_COUNTER_COUNT; ++i)
+    {
+        uint64_t value = atomic_load_explicit(&sCounters[i], memory_order_relaxed);
+        [counters setObject:[NSNumber numberWithUnsignedLongLong:value] forKey:sCounterNames[i]];
+    }
+    
+    return @{ @"latencies":latencies, @"counters":counters };
+}
+
+- (void)resetMetrics
+{
+    @synchronized(self)
+    {
+        memset(sHistograms, 0, sizeof(sHistograms));
+    }
+    for(NSUInteger i = 0; i < AD_COUNTER_COUNT; ++i)
+    {
+        atomic_store_explicit(&sCounters[i], 0, memory_order_relaxed);
+    }
+}
+
 
 
 @end
\ No newline at end of file
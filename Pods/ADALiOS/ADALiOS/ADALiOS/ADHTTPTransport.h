@@ -0,0 +1,41 @@
+// Copyright © Microsoft Open Technologies, Inc.
+//
+// All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS
+// OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION
+// ANY IMPLIED WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A
+// PARTICULAR PURPOSE, MERCHANTABILITY OR NON-INFRINGEMENT.
+//
+// See the Apache License, Version 2.0 for the specific language
+// governing permissions and limitations under the License.
+
+#import <Foundation/Foundation.h>
+
+/*! The completion block of the HTTP transport. Either "error" is set, or "response" and "data" are. */
+typedef void(^ADHTTPTransportCallback)(NSError* error, NSHTTPURLResponse* response, NSData* data);
+
+/*! The network layer, used by the library for all of its HTTP requests: token, authority validation and
+ resource challenge requests. The default implementation is ADURLSessionTransport. A different one can be
+ set through ADAuthenticationSettings' httpTransport property, e.g. ADLoopbackTransport for testing the
+ library without a network. The implementations should be thread-safe. */
+@protocol ADHTTPTransport <NSObject>
+
+/*! Sends the request asynchronously.
+ @param request: The fully prepared request.
+ @param completionHandler: Called exactly once, on an arbitrary thread, when the request completes or fails.
+ Returns an object, which identifies the request in cancelRequest calls. */
+-(id) sendRequest: (NSURLRequest*) request
+completionHandler: (ADHTTPTransportCallback) completionHandler;
+
+/*! Cancels the request, identified by the object returned from sendRequest. If the request is still in flight,
+ its completion handler is called with NSURLErrorCancelled. */
+-(void) cancelRequest: (id) request;
+
+@end
@@ -23,11 +23,20 @@
 /*! The completion block declaration. */
 typedef void(^ADDiscoveryCallback)(BOOL validated, ADAuthenticationError* error);
 
-/*! A singleton class, used to validate authorities with in-memory caching of the previously validated ones.
+/*! A singleton class, used to validate authorities with caching of the previously validated ones. The validations
+ are persisted on the device for the time, specified by ADAuthenticationSettings' authorityValidationLifetime.
  The class is thread-safe. */
 @interface ADInstanceDiscovery : NSObject
 {
     NSMutableSet* mValidatedAuthorities;
+    //Authority host -> dictionary with the validation time and the tenant discovery endpoints (see sValidatedOnKey):
+    NSMutableDictionary* mValidationRecords;
+    //Authority host -> array of the completion blocks, waiting for the validation request in flight:
+    NSMutableDictionary* mPendingValidations;
+    //Authority host -> array of the time and the error of the last rejected validation:
+    NSMutableDictionary* mFailedValidations;
+    //Serializes the writes of the validation records, so that an older snapshot never overwrites a newer one:
+    dispatch_queue_t mPersistenceQueue;
 }
 
 @property (readonly, getter = getValidatedAuthorities) NSSet* validatedAuthorities;
@@ -44,6 +53,10 @@ typedef void(^ADDiscoveryCallback)(BOOL validated, ADAuthenticationError* error)
             correlationId: (NSUUID*) correlationId
           completionBlock: (ADDiscoveryCallback) completionBlock;
 
+/*! Returns the "tenant_discovery_endpoint", returned by the server during the validation of the authority.
+ Returns nil if the authority has not been validated through the server, or the validation has expired. */
+-(NSString*) tenantDiscoveryEndpointForAuthority: (NSString*) authority;
+
 /*! Takes the string and makes it canonical URL, e.g. lowercase with
  ending trailing "/". If the authority is not a valid URL, the method
  will return nil. */
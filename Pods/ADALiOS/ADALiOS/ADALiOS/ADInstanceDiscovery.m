@@ -36,6 +36,19 @@ NSString* const sTenantDiscoveryEndpoint = @"tenant_discovery_endpoint";
 
 NSString* const sValidationServerError = @"The authority validation server returned an error: %@.";
 
+//The persisted validation records:
+NSString* const sValidationCacheFile = @"ADALAuthorityValidations.plist";
+NSString* const sValidatedOnKey = @"validatedOn";
+NSString* const sTenantDiscoveryEndpointsKey = @"tenantDiscoveryEndpoints";
+NSString* const sValidationCacheLog = @"Authority Validation Cache";
+
+//For how long (in seconds) a rejected authority is not sent for validation again:
+static const NSTimeInterval sFailedValidationLifetime = 30;
+
+//The completion block of the validation requests. "rejected" is set only if the server explicitly
+//rejected the authority, as opposed to the transient failures:
+typedef void(^ADValidationRequestCallback)(BOOL validated, BOOL rejected, ADAuthenticationError* error);
+
 @implementation ADInstanceDiscovery
 
 -(id) init
@@ -56,11 +69,83 @@ NSString* const sValidationServerError = @"The authority validation server retur
         [mValidatedAuthorities addObject:@"https://login.chinacloudapi.cn"];
         [mValidatedAuthorities addObject:@"https://login.cloudgovapi.us"];
         [mValidatedAuthorities addObject:@"https://login.microsoftonline.com"];
+        
+        mValidationRecords = [NSMutableDictionary new];
+        mPendingValidations = [NSMutableDictionary new];
+        mFailedValidations = [NSMutableDictionary new];
+        mPersistenceQueue = dispatch_queue_create("com.microsoft.adal.validations", DISPATCH_QUEUE_SERIAL);
+        dispatch_set_target_queue(mPersistenceQueue, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0));
+        [self loadValidationRecords];
     }
     
     return self;
 }
 
++(NSString*) validationCachePath
+{
+    NSString* cachesDirectory = [NSSearchPathForDirectoriesInDomains(NSCachesDirectory, NSUserDomainMask, YES) firstObject];
+    return [cachesDirectory stringByAppendingPathComponent:sValidationCacheFile];
+}
+
+//Returns YES if the validation record is too old to be used.
+-(BOOL) isRecordExpired: (NSDictionary*) record
+{
+    NSTimeInterval lifetime = [ADAuthenticationSettings sharedInstance].authorityValidationLifetime;
+    NSDate* validatedOn = [record objectForKey:sValidatedOnKey];
+    return ![validatedOn isKindOfClass:[NSDate class]] || -[validatedOn timeIntervalSinceNow] > lifetime;
+}
+
+//Reads the validations, persisted by the previous runs of the application. Called on initialization only.
+-(void) loadValidationRecords
+{
+    if ([ADAuthenticationSettings sharedInstance].authorityValidationLifetime <= 0)
+    {
+        return;
+    }
+    
+    NSDictionary* persisted = [NSDictionary dictionaryWithContentsOfFile:[self.class validationCachePath]];
+    for(NSString* host in persisted)
+    {
+        NSDictionary* record = [persisted objectForKey:host];
+        if (![record isKindOfClass:[NSDictionary class]] || [self isRecordExpired:record])
+        {
+            continue;
+        }
+        NSMutableDictionary* loaded = [record mutableCopy];
+        NSDictionary* endpoints = [record objectForKey:sTenantDiscoveryEndpointsKey];
+        [loaded setObject:([endpoints isKindOfClass:[NSDictionary class]] ? [endpoints mutableCopy] : [NSMutableDictionary new])
+                   forKey:sTenantDiscoveryEndpointsKey];
+        [mValidationRecords setObject:loaded forKey:host];
+        [mValidatedAuthorities addObject:host];
+    }
+    AD_LOG_VERBOSE_F(sValidationCacheLog, @"Loaded %lu persisted authority validations.", (unsigned long)mValidationRecords.count);
+}
+
+//Writes the validation records in the background, in the order of the calls. The method is not thread-safe.
+-(void) persistValidationRecords
+{
+    if ([ADAuthenticationSettings sharedInstance].authorityValidationLifetime <= 0)
+    {
+        return;
+    }
+    
+    //Deep copy, as the records are mutable:
+    NSMutableDictionary* snapshot = [[NSMutableDictionary alloc] initWithCapacity:mValidationRecords.count];
+    for(NSString* host in mValidationRecords)
+    {
+        NSMutableDictionary* record = [[mValidationRecords objectForKey:host] mutableCopy];
+        [record setObject:[[record objectForKey:sTenantDiscoveryEndpointsKey] copy] forKey:sTenantDiscoveryEndpointsKey];
+        [snapshot setObject:record forKey:host];
+    }
+    dispatch_async(mPersistenceQueue, ^
+                   {
+                       if (![snapshot writeToFile:[self.class validationCachePath] atomically:YES])
+                       {
+                           AD_LOG_WARN(sValidationCacheLog, @"Cannot persist the authority validations.");
+                       }
+                   });
+}
+
 /*! The getter of the public "validatedAuthorities" property. */
 - (NSSet*) getValidatedAuthorities
 {
@@ -146,8 +231,7 @@ NSString* const sValidationServerError = @"The authority validation server retur
         correlationId = [NSUUID UUID];//Create one if not passed.
     }
     
-    NSString* message = [NSString stringWithFormat:@"Attempting to validate the authority: %@; CorrelationId: %@", authority, [correlationId UUIDString]];
-    AD_LOG_VERBOSE(@"Instance discovery", message);
+    AD_LOG_VERBOSE_F(@"Instance discovery", @"Attempting to validate the authority: %@; CorrelationId: %@", authority, [correlationId UUIDString]);
     
     ADAuthenticationError* error;
     NSString* authorityHost = [self extractHost:authority correlationId:correlationId error:&error];
@@ -164,18 +248,75 @@ NSString* const sValidationServerError = @"The authority validation server retur
         return;
     }
     
+    ADAuthenticationError* recentFailure = [self recentValidationFailure:authorityHost];
+    if (recentFailure)
+    {
+        completionBlock(NO, recentFailure);
+        return;
+    }
     
-    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0), ^
+    //A single request serves all of the callers, validating the same host at the same time:
+    @synchronized(self)
+    {
+        NSMutableArray* waiting = [mPendingValidations objectForKey:authorityHost];
+        if (waiting)
+        {
+            AD_LOG_VERBOSE_F(@"Instance discovery", @"Validation of '%@' is in progress. Waiting for it. CorrelationId: %@", authorityHost, [correlationId UUIDString]);
+            [waiting addObject:[completionBlock copy]];
+            return;
+        }
+        [mPendingValidations setObject:[NSMutableArray arrayWithObject:[completionBlock copy]] forKey:authorityHost];
+    }
+    
+    dispatch_async([ADAuthenticationSettings sharedInstance].dispatchQueue, ^
                    {
                        //Nothing in the cache, ask the server:
                        [self requestValidationOfAuthority:authority
                                                      host:authorityHost
                                          trustedAuthority:sTrustedAuthority
                                             correlationId:correlationId
-                                          completionBlock:completionBlock];
+                                          completionBlock:^(BOOL validated, BOOL rejected, ADAuthenticationError *error)
+                        {
+                            NSArray* waiting;
+                            @synchronized(self)
+                            {
+                                if (rejected)
+                                {
+                                    //The server rejected the authority. The other errors (e.g. no connection, server
+                                    //errors or malformed responses) are not remembered, as they are likely to go away:
+                                    [mFailedValidations setObject:@[[NSDate date], error] forKey:authorityHost];
+                                }
+                                waiting = [mPendingValidations objectForKey:authorityHost];
+                                [mPendingValidations removeObjectForKey:authorityHost];
+                            }
+                            for(ADDiscoveryCallback waitingBlock in waiting)
+                            {
+                                waitingBlock(validated, error);
+                            }
+                        }];
                    });
 }
 
+//Returns the error of the last validation of the host, if the server rejected it recently.
+-(ADAuthenticationError*) recentValidationFailure: (NSString*) authorityHost
+{
+    @synchronized(self)
+    {
+        NSArray* failure = [mFailedValidations objectForKey:authorityHost];
+        if (!failure)
+        {
+            return nil;
+        }
+        if (-[[failure objectAtIndex:0] timeIntervalSinceNow] > sFailedValidationLifetime)
+        {
+            [mFailedValidations removeObjectForKey:authorityHost];
+            return nil;
+        }
+        AD_LOG_VERBOSE_F(sValidationCacheLog, @"The validation of '%@' failed recently. Not retrying yet.", authorityHost);
+        return [failure objectAtIndex:1];
+    }
+}
+
 //Checks the cache for previously validated authority.
 //Note that the authority host should be normalized: no ending "/" and lowercase.
 -(BOOL) isAuthorityValidated: (NSString*) authorityHost
@@ -186,35 +327,58 @@ NSString* const sValidationServerError = @"The authority validation server retur
     @synchronized(self)
     {
         validated = [mValidatedAuthorities containsObject:authorityHost];
+        NSDictionary* record = [mValidationRecords objectForKey:authorityHost];
+        if (validated && record && [self isRecordExpired:record])
+        {
+            //The pre-validated authorities do not have records, so they never expire:
+            AD_LOG_VERBOSE_F(sValidationCacheLog, @"The validation of '%@' has expired.", authorityHost);
+            [mValidatedAuthorities removeObject:authorityHost];
+            [mValidationRecords removeObjectForKey:authorityHost];
+            validated = NO;
+        }
     }
     
-    NSString* message = [NSString stringWithFormat:@"Checking cache for '%@'. Result: %d", authorityHost, validated];
-    AD_LOG_VERBOSE(@"Authority Validation Cache", message);
+    AD_LOG_VERBOSE_F(@"Authority Validation Cache", @"Checking cache for '%@'. Result: %d", authorityHost, validated);
     return validated;
 }
 
 //Note that the authority host should be normalized: no ending "/" and lowercase.
 -(void) setAuthorityValidation: (NSString*) authorityHost
+                     authority: (NSString*) authority
+       tenantDiscoveryEndpoint: (NSString*) tenantDiscoveryEndpoint
 {
     THROW_ON_NIL_EMPTY_ARGUMENT(authorityHost);
     
+    authority = [self.class canonicalizeAuthority:authority];
     @synchronized(self)
     {
         [mValidatedAuthorities addObject:authorityHost];
+        
+        NSMutableDictionary* record = [mValidationRecords objectForKey:authorityHost];
+        if (!record)
+        {
+            record = [NSMutableDictionary dictionaryWithObject:[NSMutableDictionary new] forKey:sTenantDiscoveryEndpointsKey];
+            [mValidationRecords setObject:record forKey:authorityHost];
+        }
+        [record setObject:[NSDate date] forKey:sValidatedOnKey];
+        if (authority && tenantDiscoveryEndpoint)
+        {
+            [[record objectForKey:sTenantDiscoveryEndpointsKey] setObject:tenantDiscoveryEndpoint forKey:authority];
+        }
+        [self persistValidationRecords];
     }
     
-    NSString* message = [NSString stringWithFormat:@"Setting validation set to YES for authority '%@'", authorityHost];
-    AD_LOG_VERBOSE(@"Authority Validation Cache", message);
+    AD_LOG_VERBOSE_F(@"Authority Validation Cache", @"Setting validation set to YES for authority '%@'", authorityHost);
 }
 
 //Sends authority validation to the trustedAuthority by leveraging the instance discovery endpoint
 //If the authority is known, the server will set the "tenant_discovery_endpoint" parameter in the response.
-//The method should be executed on a thread that is guarranteed to exist upon completion, e.g. the UI thread.
+//The method is executed on the library work queue (ADAuthenticationSettings.dispatchQueue).
 -(void) requestValidationOfAuthority: (NSString*) authority
                                 host: (NSString*) authorityHost
                     trustedAuthority: (NSString*) trustedAuthority
                        correlationId: (NSUUID*) correlationId
-                     completionBlock: (ADDiscoveryCallback) completionBlock
+                     completionBlock: (ADValidationRequestCallback) completionBlock
 {
     THROW_ON_NIL_ARGUMENT(completionBlock);
     THROW_ON_NIL_ARGUMENT(correlationId);//Should be set by the caller
@@ -245,6 +409,7 @@ NSString* const sValidationServerError = @"The authority validation server retur
          NSDictionary *response = nil;
          
          BOOL verified = NO;
+         BOOL rejected = NO;
          ADAuthenticationError* adError = nil;
          if ( error == nil )
          {
@@ -262,16 +427,22 @@ NSString* const sValidationServerError = @"The authority validation server retur
                          // Load the response
                          response = (NSDictionary *)jsonObject;
                          AD_LOG_VERBOSE(@"Discovery response", response.description);
-                         verified = ![NSString adIsStringNilOrBlank:[response objectForKey:sTenantDiscoveryEndpoint]];
+                         NSString* tenantDiscoveryEndpoint = [response objectForKey:sTenantDiscoveryEndpoint];
+                         verified = [tenantDiscoveryEndpoint isKindOfClass:[NSString class]] && ![NSString adIsStringNilOrBlank:tenantDiscoveryEndpoint];
                          if (verified)
                          {
-                             [self setAuthorityValidation:authorityHost];
+                             [self setAuthorityValidation:authorityHost
+                                                authority:authority
+                                  tenantDiscoveryEndpoint:tenantDiscoveryEndpoint];
                          }
                          else
                          {
                              //First check for explicit OAuth2 protocol error:
                              NSString* serverOAuth2Error = [response objectForKey:OAUTH2_ERROR];
                              NSString* errorDetails = [response objectForKey:OAUTH2_ERROR_DESCRIPTION];
+                             //Only an error response with an explicit OAuth2 error code is a rejection of the authority:
+                             rejected = (webResponse.statusCode != 200) && [serverOAuth2Error isKindOfClass:[NSString class]]
+                                && ![NSString adIsStringNilOrBlank:serverOAuth2Error];
                              // Error response from the server
                              adError = [ADAuthenticationError errorFromAuthenticationError:AD_ERROR_AUTHORITY_VALIDATION
                                                                               protocolCode:serverOAuth2Error
@@ -328,11 +499,29 @@ NSString* const sValidationServerError = @"The authority validation server retur
                                                      correlationId:correlationId
                                                       errorDetails:nil];
          }
+         [[ADClientMetrics getInstance] recordLatency:-[startTime timeIntervalSinceNow] type:AD_LATENCY_DISCOVERY];
          
-         completionBlock( verified, adError );
+         completionBlock( verified, rejected, adError );
      }];
 }
 
+-(NSString*) tenantDiscoveryEndpointForAuthority: (NSString*) authority
+{
+    API_ENTRY;
+    NSString* canonical = [self.class canonicalizeAuthority:authority];
+    NSString* host = (canonical) ? [self extractHost:canonical correlationId:nil error:nil] : nil;
+    if (!host || ![self isAuthorityValidated:host])
+    {
+        return nil;
+    }
+    
+    @synchronized(self)
+    {
+        NSDictionary* record = [mValidationRecords objectForKey:host];
+        return [[record objectForKey:sTenantDiscoveryEndpointsKey] objectForKey:canonical];
+    }
+}
+
 +(NSString*) canonicalizeAuthority: (NSString*) authority
 {
     if ([NSString adIsStringNilOrBlank:authority])
@@ -38,6 +38,10 @@
 //Shared keychain group. Can be nil.
 @property NSString*       sharedGroup;
 
+//If set, the durations of the keychain operations are recorded as AD_LATENCY_KEYCHAIN in ADClientMetrics.
+//Set by the token cache store only, so that the other keychain reads do not skew its latencies. Default is NO.
+@property BOOL            recordsLatency;
+
 
 /*! Returns the attributes (as dictionary values in the array) of the items that match the query.
  If query is nil or empty dictionary, all items in the keychain of the specifed type, with the
@@ -59,6 +63,12 @@
 -(BOOL) deleteByAttributes: (NSDictionary*) attributes
                      error: (ADAuthenticationError* __autoreleasing*) error;
 
+/*! Same as deleteByAttributes, but keeps the access group of the passed attributes instead of
+ replacing it with the sharedGroup, so that exactly the item, which was read, is deleted.
+ @param attributes: The attributes, as returned by SecItemCopyMatching (wrapped by getItemsWithAttributes). */
+-(BOOL) deleteItemWithAttributes: (NSDictionary*) attributes
+                           error: (ADAuthenticationError* __autoreleasing*) error;
+
 -(BOOL) updateItemByAttributes: (NSDictionary*) attributes
                          value: (NSData*) value
                          error: (ADAuthenticationError* __autoreleasing*) error;
@@ -19,6 +19,7 @@
 #import "ADKeyChainHelper.h"
 #import "ADKeyChainHelper.h"
 #import "ADWorkPlaceJoinUtil.h"
+#import "ADClientMetrics.h"
 
 extern NSString* const sKeyChainlog;
 
@@ -54,6 +55,15 @@ extern NSString* const sKeyChainlog;
     return self;
 }
 
+//Records the duration of a keychain operation, which started at startTime, if the owner asked for it:
+-(void) recordLatencySince: (CFAbsoluteTime) startTime
+{
+    if (_recordsLatency)
+    {
+        [[ADClientMetrics getInstance] recordLatency:CFAbsoluteTimeGetCurrent() - startTime type:AD_LATENCY_KEYCHAIN];
+    }
+}
+
 //Adds the attributes which need to be set before each operation:
 -(void) addStandardAttributes: (NSMutableDictionary*) attributes
 {
@@ -84,10 +94,35 @@ extern NSString* const sKeyChainlog;
 
     NSMutableDictionary* query = [NSMutableDictionary dictionaryWithDictionary:attributes];
     [self addStandardAttributes:query];
+    return [self deleteWithQuery:query attributes:attributes error:error];
+}
+
+-(BOOL) deleteItemWithAttributes: (NSDictionary*) attributes
+                           error: (ADAuthenticationError* __autoreleasing*) error
+{
+    RETURN_NO_ON_NIL_ARGUMENT(attributes);
     
+    NSMutableDictionary* query = [NSMutableDictionary dictionaryWithDictionary:attributes];
+    [self addStandardAttributes:query];
+    //The standard attributes replace the access group with the configured one; the item may be in another group:
+    id accessGroup = [attributes objectForKey:(__bridge id)kSecAttrAccessGroup];
+    if (accessGroup)
+    {
+        [query setObject:accessGroup forKey:(__bridge id)kSecAttrAccessGroup];
+    }
+    return [self deleteWithQuery:query attributes:attributes error:error];
+}
+
+//Deletes the items, which match the full query. The attributes are used for the logging only:
+-(BOOL) deleteWithQuery: (NSDictionary*) query
+             attributes: (NSDictionary*) attributes
+                  error: (ADAuthenticationError* __autoreleasing*) error
+{
     AD_LOG_VERBOSE_F(sKeyChainlog, @"Attempting to remove items that match attributes: %@", attributes);
     
+    CFAbsoluteTime startTime = CFAbsoluteTimeGetCurrent();
     OSStatus res = SecItemDelete((__bridge CFDictionaryRef)query);
+    [self recordLatencySince:startTime];
     switch (res)
     {
         case errSecSuccess:
@@ -124,8 +159,10 @@ extern NSString* const sKeyChainlog;
     NSMutableDictionary* updatedAttributes = [NSMutableDictionary dictionaryWithDictionary:attributes];
     [self addStandardAttributes:updatedAttributes];
     
+    CFAbsoluteTime startTime = CFAbsoluteTimeGetCurrent();
     OSStatus res = SecItemUpdate((__bridge CFMutableDictionaryRef)updatedAttributes,
                                  (__bridge CFDictionaryRef)@{ mValueDataKey:value });
+    [self recordLatencySince:startTime];
     ADAuthenticationError* toReport = nil;
     switch(res)
     {
@@ -176,7 +213,9 @@ extern NSString* const sKeyChainlog;
        }];
     
     CFArrayRef all;
+    CFAbsoluteTime startTime = CFAbsoluteTimeGetCurrent();
     OSStatus res = SecItemCopyMatching((__bridge CFMutableDictionaryRef)updatedQuery, (CFTypeRef*)&all);
+    [self recordLatencySince:startTime];
     switch(res)
     {
         case errSecSuccess:
@@ -218,7 +257,9 @@ extern NSString* const sKeyChainlog;
         mValueDataKey:value,//Item data
     }];
     
+    CFAbsoluteTime startTime = CFAbsoluteTimeGetCurrent();
     OSStatus res = SecItemAdd((__bridge CFMutableDictionaryRef)updatedAttributes, NULL);
+    [self recordLatencySince:startTime];
     if (errSecSuccess != res)
     {
         NSString* errorDetails = [NSString stringWithFormat:@"Cannot add a new item in the keychain. Error code: %ld. Attributes: %@", (long)res, attributes];
@@ -255,7 +296,9 @@ extern NSString* const sKeyChainlog;
         [updatedAttributes setObject:(__bridge id)kCFBooleanTrue forKey:(__bridge id<NSCopying>)kSecReturnRef];
     }
     
+    CFAbsoluteTime startTime = CFAbsoluteTimeGetCurrent();
     OSStatus res = SecItemCopyMatching((__bridge CFMutableDictionaryRef)updatedAttributes, item);
+    [self recordLatencySince:startTime];
     switch (res)
     {
         case errSecSuccess:
@@ -35,4 +35,34 @@
  automatically. */
 @property (getter = getSharedGroup, setter = setSharedGroup:) NSString* sharedGroup;
 
+/*! Incremented every time the store adds, updates or deletes a keychain item, or switches
+ the keychain group. It is incremented only after the keychain operation has succeeded: once for a single
+ item write, once for a whole batch (addOrUpdateItems, removeItemsWithKeys) with at least one successful
+ item, and not at all if nothing was modified. In-memory caches layered on top of the store compare it against the value
+ they last observed to detect changes made behind their back. For the shared keychain groups, it is
+ also incremented when another application modifies the group; that is detected on a background queue,
+ when the other application signals the modification, and by the reading methods of the store. Reading
+ the property never accesses the keychain. */
+@property (readonly, getter = getGeneration) uint64_t generation;
+
+/*! The maximum number of items in the store. When the keychain contains more, the garbage collection
+ evicts the least recently written ones. 0 means no limit. The default is 500, or no limit for a group
+ shared with other applications; changing the sharedGroup between the two kinds resets it to the default.
+ In a shared group, only the items of the clientIds written by this application are ever evicted. */
+@property NSUInteger maxItemCount;
+
+/*! Runs a garbage collection pass: evicts the items over maxItemCount, least recently written first, and then
+ the items, which cannot provide an access token anymore (no refresh token and no valid access token). The usability
+ checks continue where the previous pass stopped, so that all items are visited over several passes. The store runs
+ the passes on a background queue on its own, after scanning the keychain, at most once per 10 minutes unless it is
+ over the limit. The method can be called explicitly, e.g. when the application is in the background; it returns
+ without doing anything while another pass is in progress.
+ @param budget: The maximum number of the keychain operations (item reads and deletes) of the pass. */
+-(void) collectGarbageWithBudget: (NSUInteger) budget;
+
+/*! The cumulative statistics of the garbage collection. The keys are "passes", "examined", "evictedUnusable" and
+ "evictedOverLimit" (the counts since the store creation), "itemCount" (the number of items after the last pass)
+ and "lastPassDuration" (in seconds). The values are NSNumber objects. */
+-(NSDictionary*) garbageCollectionStats;
+
 @end
@@ -22,8 +22,15 @@
 #import "ADTokenCacheStoreItem.h"
 #import "NSString+ADHelperMethods.h"
 #import "ADTokenCacheStoreKey.h"
+#import "ADTokenCacheStoreKey+Internal.h"
 #import "ADUserInformation.h"
 #import "ADKeyChainHelper.h"
+#import "ADTokenCacheItemSerializer.h"
+#import "ADInstanceDiscovery.h"
+#import "ADClientMetrics.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <notify.h>
 
 NSString* const sNilKey = @"CC3513A0-0E69-4B4D-97FC-DFB6C91EE132";//A special attribute to write, instead of nil/empty one.
 NSString* const sDelimiter = @"|";
@@ -31,7 +38,21 @@ NSString* const sKeyChainlog = @"Keychain token cache store";
 NSString* const sMultiUserError = @"The token cache store for this resource contain more than one user. Please set the 'userId' parameter to determine which one to be used.";
 NSString* const sKeychainSharedGroup = @"com.microsoft.adalcache";
 
-const long sKeychainVersion = 1;//will need to increase when we break the forward compatibility
+const long sKeychainVersion = 2;//will need to increase when we break the forward compatibility
+//Version 1 stored NSKeyedArchiver data. Its items are copied by the first operation, see migrateLegacyItems:
+const long sLegacyKeychainVersion = 1;
+
+//The number of the locks, which the modifications of the single item keys are distributed over:
+static const NSUInteger sKeyStripes = 16;
+
+//Background garbage collection: the number of keychain operations a pass may spend, the minimum time
+//between two passes (unless the store is over its item limit) and the default item limit:
+static const NSUInteger sGarbageCollectionBudget = 32;
+static const NSTimeInterval sGarbageCollectionInterval = 10 * 60;
+static const NSUInteger sDefaultMaxItemCount = 500;
+
+//The prefix of the Darwin notification, posted when a process modifies a shared keychain group:
+NSString* const sChangeNotificationPrefix = @"com.microsoft.adal.cache.changed.";
 
 @implementation ADKeychainTokenCacheStore
 {
@@ -47,6 +68,54 @@ const long sKeychainVersion = 1;//will need to increase when we break the forwar
     BOOL mSharedCache;
 
     ADKeyChainHelper* mHelper;
+    //Accesses the items, written by the previous version of the library:
+    ADKeyChainHelper* mLegacyHelper;
+    //Set once the legacy items are migrated. The migration itself runs under the exclusive mode of mModificationLock:
+    _Atomic(BOOL) mLegacyItemsMigrated;
+    
+    //Bumped on every keychain modification, see the "generation" property:
+    _Atomic(uint64_t) mGeneration;
+    
+    //The readers do not take any lock around the keychain I/O, so a slow modification never delays the
+    //token lookups. The modifications of known item keys (single items and batches) take the shared mode
+    //of this lock plus the stripes of the keys, so that the modifications of different keys run in parallel.
+    //The modifications, which span unknown keys (removals by user, removeAll, switching the group), take the exclusive mode:
+    pthread_rwlock_t mModificationLock;
+    NSArray* mStripes;//NSLock objects
+    
+    //Secondary index over the item attributes. Built from a full attributes scan (no item data is read)
+    //and then maintained by the modifications done through this object. All of the dictionaries are nil
+    //while the index is not built. The index keys are the encoded values, as stored in the keychain.
+    //The index is guarded by @synchronized(self); no keychain I/O is done under that lock:
+    NSMutableDictionary* mIndexedAttributes;//Full keychain key -> attributes
+    NSMutableDictionary* mUserIndex;//Encoded userId -> set of full keychain keys
+    NSMutableDictionary* mAuthorityIndex;//Encoded authority -> set of full keychain keys
+    NSMutableDictionary* mClientIdIndex;//Encoded clientId -> set of full keychain keys
+    //Incremented on every change of the index, so that a full scan, which raced with a modification,
+    //does not install a stale index:
+    uint64_t mIndexEpoch;
+    
+    //Detection of the modifications done by the other processes, which share the keychain group. Each
+    //modification writes a new random stamp in the marker item and posts a Darwin notification. The other
+    //processes read the marker from the notification handler, on a background queue, and treat a stamp,
+    //which they did not write, as an external modification. Guarded by @synchronized(mChangesHelper):
+    ADKeyChainHelper* mChangesHelper;
+    BOOL mChangesRegistered;
+    NSString* mChangeNotification;//Nil if the group is not shared
+    int mChangeNotifyToken;//NOTIFY_TOKEN_INVALID if the notification is not available
+    NSData* mLastStamp;//The last stamp written or observed by this object
+    //Set by the notification handler until the marker is read:
+    _Atomic(BOOL) mChangePosted;
+    
+    //Background garbage collection, see collectGarbageWithBudget. Guarded by @synchronized(mGarbageStats):
+    NSMutableDictionary* mGarbageStats;
+    BOOL mGarbageCollectionRunning;
+    CFAbsoluteTime mLastGarbageCollection;
+    NSDate* mGarbageCursor;//The modification date of the last item checked for usability
+    NSMutableSet* mOwnClientIds;//The encoded clientIds of the items written by this application
+    
+    //The full keychain keys, whose duplicates are queued for deletion. Guarded by @synchronized(mCompactingKeys):
+    NSMutableSet* mCompactingKeys;
 }
 
 //Shouldn't be called.
@@ -80,10 +149,252 @@ const long sKeychainVersion = 1;//will need to increase when we break the forwar
         mHelper = [[ADKeyChainHelper alloc] initWithClass:mClassValue
                                                   generic:mLibraryValue
                                               sharedGroup:sharedGroup];
+        
+        NSString* legacyLibraryString = [NSString stringWithFormat:@"MSOpenTech.ADAL.%ld", sLegacyKeychainVersion];
+        mLegacyHelper = [[ADKeyChainHelper alloc] initWithClass:mClassValue
+                                                        generic:[legacyLibraryString dataUsingEncoding:NSUTF8StringEncoding]
+                                                    sharedGroup:sharedGroup];
+        
+        NSString* changesString = [NSString stringWithFormat:@"MSOpenTech.ADAL.%ld.changes", sKeychainVersion];
+        mChangesHelper = [[ADKeyChainHelper alloc] initWithClass:mClassValue
+                                                         generic:[changesString dataUsingEncoding:NSUTF8StringEncoding]
+                                                     sharedGroup:sharedGroup];
+        mChangeNotifyToken = NOTIFY_TOKEN_INVALID;
+        //Only the token cache operations count towards the keychain latency metric:
+        mHelper.recordsLatency = YES;
+        mLegacyHelper.recordsLatency = YES;
+        mChangesHelper.recordsLatency = YES;
+        
+        //The other applications of a shared group may rely on its items, so the limit is off there by default:
+        _maxItemCount = (mSharedCache) ? 0 : sDefaultMaxItemCount;
+        mGarbageStats = [NSMutableDictionary new];
+        mOwnClientIds = [NSMutableSet new];
+        mCompactingKeys = [NSMutableSet new];
+        
+        pthread_rwlock_init(&mModificationLock, NULL);
+        NSMutableArray* stripes = [[NSMutableArray alloc] initWithCapacity:sKeyStripes];
+        for(NSUInteger i = 0; i < sKeyStripes; ++i)
+        {
+            [stripes addObject:[NSLock new]];
+        }
+        mStripes = stripes;
     }
     return self;
 }
 
+-(void) dealloc
+{
+    pthread_rwlock_destroy(&mModificationLock);
+    if (mChangeNotifyToken != NOTIFY_TOKEN_INVALID)
+    {
+        notify_cancel(mChangeNotifyToken);
+    }
+}
+
+//Takes the locks for modifying the items with the specified keychain key (without the user).
+//Returns the stripe, which should be passed to unlockStripe:
+-(NSLock*) lockKeychainKey: (NSString*) keychainKey
+{
+    pthread_rwlock_rdlock(&mModificationLock);
+    NSLock* stripe = [mStripes objectAtIndex:(keychainKey.hash % mStripes.count)];
+    [stripe lock];
+    return stripe;
+}
+
+-(void) unlockStripe: (NSLock*) stripe
+{
+    [stripe unlock];
+    pthread_rwlock_unlock(&mModificationLock);
+}
+
+//Takes the locks for modifying the items with any of the specified keychain keys. The stripes are always
+//taken in the same order, so that the concurrent batches cannot deadlock. Returns the stripes, which
+//should be passed to unlockStripes:
+-(NSArray*) lockKeychainKeys: (NSSet*) keychainKeys
+{
+    NSMutableIndexSet* indices = [NSMutableIndexSet new];
+    for(NSString* keychainKey in keychainKeys)
+    {
+        [indices addIndex:(keychainKey.hash % mStripes.count)];
+    }
+    NSArray* stripes = [mStripes objectsAtIndexes:indices];
+    pthread_rwlock_rdlock(&mModificationLock);
+    for(NSLock* stripe in stripes)
+    {
+        [stripe lock];
+    }
+    return stripes;
+}
+
+-(void) unlockStripes: (NSArray*) stripes
+{
+    for(NSLock* stripe in stripes)
+    {
+        [stripe unlock];
+    }
+    pthread_rwlock_unlock(&mModificationLock);
+}
+
+//Takes the lock for the modifications, which span many keys. Waits for the single key modifications
+//in progress and blocks the new ones, but not the readers:
+-(void) lockAllKeys
+{
+    pthread_rwlock_wrlock(&mModificationLock);
+}
+
+-(void) unlockAllKeys
+{
+    pthread_rwlock_unlock(&mModificationLock);
+}
+
+#pragma mark - Cross-process changes
+
+//The attributes of the marker item, which carries the stamp of the last modification of the group:
+-(NSDictionary*) changeMarkerAttributes
+{
+    return @{
+             mItemKeyAttributeKey:[NSString stringWithFormat:@"%@%@changes", mLibraryString, sDelimiter],
+             mUserIdKey:sNilKey,
+             };
+}
+
+//Starts watching the changes of the current group, if it is shared. The method should be called
+//under @synchronized(mChangesHelper).
+-(void) registerForChanges
+{
+    mChangePosted = NO;
+    mChangesRegistered = YES;
+    if (mChangeNotifyToken != NOTIFY_TOKEN_INVALID)
+    {
+        notify_cancel(mChangeNotifyToken);
+        mChangeNotifyToken = NOTIFY_TOKEN_INVALID;
+    }
+    mChangeNotification = nil;
+    mLastStamp = nil;
+    if (!mSharedCache)
+    {
+        return;//Only this process writes in the group
+    }
+    
+    mChangeNotification = [sChangeNotificationPrefix stringByAppendingString:mHelper.sharedGroup];
+    //The marker is read by the handler, so that the readers of the generation never wait for the keychain:
+    __weak ADKeychainTokenCacheStore* weakSelf = self;
+    if (NOTIFY_STATUS_OK != notify_register_dispatch(mChangeNotification.UTF8String, &mChangeNotifyToken,
+                                                     dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0), ^(int token)
+                                                     {
+                                                         ADKeychainTokenCacheStore* store = weakSelf;
+                                                         if (store)
+                                                         {
+                                                             store->mChangePosted = YES;
+                                                             [store checkForExternalChanges];
+                                                         }
+                                                     }))
+    {
+        //Fall back to reading the marker on every check:
+        AD_LOG_WARN(sKeyChainlog, @"Cannot register for the cache change notifications.");
+        mChangeNotifyToken = NOTIFY_TOKEN_INVALID;
+    }
+    mLastStamp = [mChangesHelper getItemDataWithAttributes:[self changeMarkerAttributes] error:nil];
+}
+
+//Returns YES if another process modified the group since the last call. Costs a single flag check,
+//unless a change notification was posted. The method should be called under @synchronized(mChangesHelper).
+-(BOOL) detectExternalChange
+{
+    if (!mChangesRegistered)
+    {
+        [self registerForChanges];
+    }
+    if (!mChangeNotification)
+    {
+        return NO;
+    }
+    if (mChangeNotifyToken != NOTIFY_TOKEN_INVALID && !atomic_exchange(&mChangePosted, NO))
+    {
+        return NO;
+    }
+    
+    //Either our own or somebody else's notification. The stamp tells which:
+    NSData* stamp = [mChangesHelper getItemDataWithAttributes:[self changeMarkerAttributes] error:nil];
+    if (!stamp || [stamp isEqualToData:mLastStamp])
+    {
+        return NO;
+    }
+    mLastStamp = stamp;
+    return YES;
+}
+
+//Treats the whole keychain group as modified: the index is rebuilt on the next query and
+//the layers on top of the store see a new generation.
+-(void) handleExternalChange
+{
+    AD_LOG_VERBOSE(sKeyChainlog, @"The shared cache was modified by another application.");
+    @synchronized(self)
+    {
+        [self invalidateIndex];
+    }
+    atomic_fetch_add(&mGeneration, 1);
+}
+
+//Detects the modifications done by the other processes. Called by the notification handler and by the
+//reading entry points, which also cover the fallback without the notifications. The method is thread-safe.
+-(void) checkForExternalChanges
+{
+    BOOL changed;
+    @synchronized(mChangesHelper)
+    {
+        changed = [self detectExternalChange];
+    }
+    if (changed)
+    {
+        [self handleExternalChange];
+    }
+}
+
+//Publishes the modification of the keychain, done by this object, to the other processes sharing
+//the group. The method is thread-safe.
+-(void) signalChange
+{
+    BOOL changed;
+    @synchronized(mChangesHelper)
+    {
+        //A modification by another process, which was not observed yet, is about to be overwritten:
+        changed = [self detectExternalChange];
+        if (mChangeNotification)
+        {
+            uuid_t uuid;
+            [[NSUUID UUID] getUUIDBytes:uuid];
+            NSData* stamp = [NSData dataWithBytes:uuid length:sizeof(uuid)];
+            NSDictionary* attributes = [self changeMarkerAttributes];
+            if ([mChangesHelper updateItemByAttributes:attributes value:stamp error:nil]
+                || [mChangesHelper addItemWithAttributes:attributes value:stamp error:nil])
+            {
+                mLastStamp = stamp;
+                notify_post(mChangeNotification.UTF8String);
+            }
+            else
+            {
+                AD_LOG_WARN(sKeyChainlog, @"Cannot signal the cache change to the other applications.");
+            }
+        }
+    }
+    if (changed)
+    {
+        [self handleExternalChange];
+    }
+}
+
+//The attributes of the marker item, which records that the legacy items of the shared group were copied:
+-(NSDictionary*) migrationMarkerAttributes
+{
+    return @{
+             mItemKeyAttributeKey:[NSString stringWithFormat:@"%@%@migrated", mLibraryString, sDelimiter],
+             mUserIdKey:sNilKey,
+             };
+}
+
+#pragma mark - Keys
+
 //Extracts all of the key and user data fields into a single string.
 //Used for comparison and verification that the item exists.
 -(NSString*) fullKeychainKeyFromAttributes: (NSDictionary*)attributes
@@ -100,15 +411,24 @@ const long sKeychainVersion = 1;//will need to increase when we break the forwar
 //Given an item key, generates the string key used in the keychain:
 -(NSString*) keychainKeyFromCacheKey: (ADTokenCacheStoreKey*) itemKey
 {
+    //The cache key is immutable, so its keychain key is built once and memoized on it:
+    NSString* keychainKey = [itemKey keychainKeyWithPrefix:mLibraryString];
+    if (keychainKey)
+    {
+        return keychainKey;
+    }
+    
     //The key contains all of the ADAL cache key elements plus the version of the
     //library. The latter is required to ensure that SecItemAdd won't break on collisions
     //with items left over from the previous versions of the library.
-    return [NSString stringWithFormat:@"%@%@%@%@%@%@%@",
-            mLibraryString, sDelimiter,
-            [itemKey.authority adBase64UrlEncode], sDelimiter,
-            [self.class getAttributeName:itemKey.resource], sDelimiter,
-            [itemKey.clientId adBase64UrlEncode]
-            ];
+    keychainKey = [NSString stringWithFormat:@"%@%@%@%@%@%@%@",
+                   mLibraryString, sDelimiter,
+                   [itemKey.authority adBase64UrlEncode], sDelimiter,
+                   [self.class getAttributeName:itemKey.resource], sDelimiter,
+                   [itemKey.clientId adBase64UrlEncode]
+                   ];
+    [itemKey setKeychainKey:keychainKey prefix:mLibraryString];
+    return keychainKey;
 }
 
 
@@ -149,6 +469,14 @@ const long sKeychainVersion = 1;//will need to increase when we break the forwar
 -(NSMutableDictionary*) keychainAttributesWithQuery: (NSMutableDictionary*) query
                                               error: (ADAuthenticationError* __autoreleasing*)error
 {
+    uint64_t epoch = 0;
+    if (!query.count)
+    {
+        @synchronized(self)
+        {
+            epoch = mIndexEpoch;
+        }
+    }
     NSArray* allAttributes = [mHelper getItemsAttributes:query error:error];
     if (!allAttributes)
     {
@@ -156,21 +484,31 @@ const long sKeychainVersion = 1;//will need to increase when we break the forwar
     }
 
     NSMutableDictionary* toReturn = [[NSMutableDictionary alloc] initWithCapacity:allAttributes.count];
+    NSMutableArray* stale = nil;
     for(NSDictionary* dictionary in allAttributes)
     {
         NSString* key = [self fullKeychainKeyFromAttributes:dictionary];
         NSDictionary* first = [toReturn objectForKey:key];
         if (first != nil)
         {
-            AD_LOG_INFO_F(sKeyChainlog, @"Duplicated keychain cache entry: %@. Picking the newest...", key);
+            AD_LOG_INFO_F(sKeyChainlog, @"Duplicated keychain cache entry: %@. Picking the newest and removing the other one...", key);
             //Note that this can happen if the application has multiple keychain groups and the keychain group is
             //not specified explicitly:
             //Recover by picking the newest (based on modification date):
             NSDate* firstMod = [first objectForKey:(__bridge id)kSecAttrModificationDate];
             NSDate* secondMod = [dictionary objectForKey:(__bridge id)kSecAttrModificationDate];
+            if (!stale)
+            {
+                stale = [NSMutableArray new];
+            }
             if (!firstMod || [secondMod compare:firstMod] == NSOrderedDescending)
             {
                 [toReturn setObject:dictionary forKey:key];
+                [stale addObject:first];
+            }
+            else
+            {
+                [stale addObject:dictionary];
             }
         }
         else
@@ -178,6 +516,283 @@ const long sKeychainVersion = 1;//will need to increase when we break the forwar
             [toReturn setObject:dictionary forKey:key];
         }
     }
+    [self compactDuplicatesWithAttributes:stale];
+    
+    if (!query.count)
+    {
+        //A full scan: refresh the index with the real state of the keychain, unless the keychain
+        //was modified through this object during the scan:
+        @synchronized(self)
+        {
+            if (epoch == mIndexEpoch)
+            {
+                [self buildIndexWithAttributes:toReturn];
+            }
+        }
+        [self scheduleGarbageCollectionWithItemCount:toReturn.count];
+    }
+    return toReturn;
+}
+
+//Deletes the older copies of the duplicated items on a background queue, so that the following scans
+//do not have to read and resolve them again. The attributes are used exactly as read, including the
+//access group (see ADKeyChainHelper deleteItemWithAttributes) and the modification date, so only the
+//stale copy is deleted and never a newer write. The keys, which are queued already by a previous scan,
+//are skipped, so that the concurrent scans do not pile up the same deletions.
+-(void) compactDuplicatesWithAttributes: (NSArray*) staleAttributes
+{
+    if (!staleAttributes.count)
+    {
+        return;
+    }
+    
+    NSMutableArray* toDelete = [[NSMutableArray alloc] initWithCapacity:staleAttributes.count];
+    NSMutableSet* queuedKeys = [NSMutableSet new];
+    @synchronized(mCompactingKeys)
+    {
+        for(NSDictionary* attributes in staleAttributes)
+        {
+            NSString* fullKey = [self fullKeychainKeyFromAttributes:attributes];
+            //All of the stale copies of a key come from the same scan:
+            if ([queuedKeys containsObject:fullKey] || ![mCompactingKeys containsObject:fullKey])
+            {
+                [queuedKeys addObject:fullKey];
+                [mCompactingKeys addObject:fullKey];
+                [toDelete addObject:attributes];
+            }
+        }
+    }
+    if (!toDelete.count)
+    {
+        return;
+    }
+    
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0), ^
+                   {
+                       for(NSDictionary* attributes in toDelete)
+                       {
+                           NSLock* stripe = [self lockKeychainKey:[attributes objectForKey:mItemKeyAttributeKey]];
+                           //The copy may be already removed by a parallel scan, so the failures are not reported:
+                           if ([mHelper deleteItemWithAttributes:attributes error:nil])
+                           {
+                               [[ADClientMetrics getInstance] incrementCounter:AD_COUNTER_DUPLICATE_COMPACTION];
+                           }
+                           [self unlockStripe:stripe];
+                       }
+                       @synchronized(mCompactingKeys)
+                       {
+                           [mCompactingKeys minusSet:queuedKeys];
+                       }
+                   });
+}
+
+#pragma mark - Secondary index
+
+//Splits the item attributes into the encoded user, authority and clientId values. Returns nil for
+//attributes, which are not in the expected format.
+-(NSArray*) indexValuesFromAttributes: (NSDictionary*) attributes
+{
+    //Item key: library|authority|resource|clientId. The encoded values do not contain the delimiter:
+    NSArray* parts = [[attributes objectForKey:mItemKeyAttributeKey] componentsSeparatedByString:sDelimiter];
+    NSString* user = [attributes objectForKey:mUserIdKey];
+    if (parts.count != 4 || !user)
+    {
+        return nil;
+    }
+    return @[user, [parts objectAtIndex:1], [parts objectAtIndex:3]];
+}
+
+//Adds the item with the specified attributes to the index, if the index is built.
+//The attributes should contain at least the item key and the user attributes.
+//The method should be called under @synchronized(self).
+-(void) indexAttributes: (NSDictionary*) attributes
+{
+    ++mIndexEpoch;
+    if (!mIndexedAttributes)
+    {
+        return;
+    }
+    NSArray* values = [self indexValuesFromAttributes:attributes];
+    if (!values)
+    {
+        return;
+    }
+    
+    NSString* fullKey = [self fullKeychainKeyFromAttributes:attributes];
+    [mIndexedAttributes setObject:attributes forKey:fullKey];
+    NSArray* indices = @[mUserIndex, mAuthorityIndex, mClientIdIndex];
+    for(NSUInteger i = 0; i < indices.count; ++i)
+    {
+        NSMutableDictionary* index = [indices objectAtIndex:i];
+        NSMutableSet* keys = [index objectForKey:[values objectAtIndex:i]];
+        if (!keys)
+        {
+            keys = [NSMutableSet new];
+            [index setObject:keys forKey:[values objectAtIndex:i]];
+        }
+        [keys addObject:fullKey];
+    }
+}
+
+//Removes the item from the index. The method should be called under @synchronized(self).
+-(void) unindexFullKey: (NSString*) fullKey
+{
+    ++mIndexEpoch;
+    NSArray* values = [self indexValuesFromAttributes:[mIndexedAttributes objectForKey:fullKey]];
+    if (!values)
+    {
+        return;
+    }
+    
+    [mIndexedAttributes removeObjectForKey:fullKey];
+    NSArray* indices = @[mUserIndex, mAuthorityIndex, mClientIdIndex];
+    for(NSUInteger i = 0; i < indices.count; ++i)
+    {
+        NSMutableDictionary* index = [indices objectAtIndex:i];
+        NSMutableSet* keys = [index objectForKey:[values objectAtIndex:i]];
+        [keys removeObject:fullKey];
+        if (keys && !keys.count)
+        {
+            [index removeObjectForKey:[values objectAtIndex:i]];
+        }
+    }
+}
+
+//Recreates the index from the results of a full attributes scan. The method should be called under @synchronized(self).
+-(void) buildIndexWithAttributes: (NSDictionary*) allAttributes
+{
+    mIndexedAttributes = [[NSMutableDictionary alloc] initWithCapacity:allAttributes.count];
+    mUserIndex = [NSMutableDictionary new];
+    mAuthorityIndex = [NSMutableDictionary new];
+    mClientIdIndex = [NSMutableDictionary new];
+    for(NSDictionary* attributes in allAttributes.allValues)
+    {
+        [self indexAttributes:attributes];
+    }
+}
+
+//Drops the index, so that the next query rebuilds it. Used when the keychain changes in a way,
+//which cannot be reflected in the index. The method should be called under @synchronized(self).
+-(void) invalidateIndex
+{
+    ++mIndexEpoch;
+    mIndexedAttributes = nil;
+    mUserIndex = nil;
+    mAuthorityIndex = nil;
+    mClientIdIndex = nil;
+}
+
+//Returns YES if the item attributes match all of the non-null filters (see indexedAttributesWithUser):
+-(BOOL) attributes: (NSDictionary*) attributes
+     matchFilters: (NSArray*) filters
+{
+    NSArray* values = [self indexValuesFromAttributes:attributes];
+    if (!values)
+    {
+        return NO;
+    }
+    for(NSUInteger i = 0; i < filters.count; ++i)
+    {
+        id filter = [filters objectAtIndex:i];
+        if (filter != [NSNull null] && ![filter isEqualToString:[values objectAtIndex:i]])
+        {
+            return NO;
+        }
+    }
+    return YES;
+}
+
+//Returns the attributes of the items, which match all of the passed (encoded) values, keyed by the full
+//keychain keys. Nil values are not taken into account; at least one value should be set. Answered from the
+//index if it is built, else from a full attributes scan, which builds the index too. Returns nil in case
+//of error. The method is thread-safe.
+-(NSDictionary*) indexedAttributesWithUser: (NSString*) userValue
+                                 authority: (NSString*) authorityValue
+                                  clientId: (NSString*) clientIdValue
+                                     error: (ADAuthenticationError* __autoreleasing*) error
+{
+    //The index does not reflect the modifications done by the other processes:
+    [self checkForExternalChanges];
+    NSArray* filters = @[(userValue) ? userValue : [NSNull null],
+                         (authorityValue) ? authorityValue : [NSNull null],
+                         (clientIdValue) ? clientIdValue : [NSNull null]];
+    @synchronized(self)
+    {
+        if (mIndexedAttributes)
+        {
+            NSMutableSet* keys = nil;
+            NSArray* indices = @[mUserIndex, mAuthorityIndex, mClientIdIndex];
+            for(NSUInteger i = 0; i < indices.count; ++i)
+            {
+                id filter = [filters objectAtIndex:i];
+                if (filter == [NSNull null])
+                {
+                    continue;
+                }
+                NSSet* filterKeys = [[indices objectAtIndex:i] objectForKey:filter];
+                if (!filterKeys.count)
+                {
+                    return [NSDictionary new];
+                }
+                if (keys)
+                {
+                    [keys intersectSet:filterKeys];
+                }
+                else
+                {
+                    keys = [NSMutableSet setWithSet:filterKeys];
+                }
+            }
+            
+            NSMutableDictionary* toReturn = [[NSMutableDictionary alloc] initWithCapacity:keys.count];
+            for(NSString* fullKey in keys)
+            {
+                [toReturn setObject:[mIndexedAttributes objectForKey:fullKey] forKey:fullKey];
+            }
+            return toReturn;
+        }
+    }
+    
+    NSDictionary* all = [self keychainAttributesWithQuery:nil error:error];
+    if (!all)
+    {
+        return nil;
+    }
+    NSMutableDictionary* toReturn = [NSMutableDictionary new];
+    for(NSString* fullKey in all)
+    {
+        NSDictionary* attributes = [all objectForKey:fullKey];
+        if ([self attributes:attributes matchFilters:filters])
+        {
+            [toReturn setObject:attributes forKey:fullKey];
+        }
+    }
+    return toReturn;
+}
+
+//Reads the items with the passed attributes (full keychain key -> attributes). The method is thread-safe.
+-(NSArray*) readCacheItemsWithAttributesDictionaries: (NSDictionary*) keysAndAttributes
+                                               error: (ADAuthenticationError* __autoreleasing*) error
+{
+    NSMutableArray* toReturn = [[NSMutableArray alloc] initWithCapacity:keysAndAttributes.count];
+    for(NSDictionary* attributes in keysAndAttributes.allValues)
+    {
+        ADAuthenticationError* adError = nil;
+        ADTokenCacheStoreItem* item = [self readCacheItemWithAttributes:attributes error:&adError];
+        if (item)
+        {
+            [toReturn addObject:item];
+        }
+        else if (adError)
+        {
+            if (error)
+            {
+                *error = adError;
+            }
+            return nil;
+        }
+        //Else the item was removed by somebody else, ignore it.
+    }
     return toReturn;
 }
 
@@ -185,13 +800,15 @@ const long sKeychainVersion = 1;//will need to increase when we break the forwar
 -(void) LogItem: (ADTokenCacheStoreItem*) item
         message: (NSString*) additionalMessage
 {
-    AD_LOG_VERBOSE_F(sKeyChainlog, @"%@. Resource: %@ Access token hash: %@; Refresh token hash: %@", item.resource,additionalMessage, [ADLogger getHash:item.accessToken], [ADLogger getHash:item.refreshToken]);
+    //The hashes are only calculated if the verbose logging is enabled:
+    AD_LOG_VERBOSE_F(sKeyChainlog, @"%@. Resource: %@ Access token hash: %@; Refresh token hash: %@", additionalMessage, item.resource, [ADLogger getHash:item.accessToken], [ADLogger getHash:item.refreshToken]);
 }
 
 //Updates the keychain item. "attributes" parameter should ALWAYS come from previous
 //SecItemCopyMatching else the function will fail.
 -(void) updateKeychainItem: (ADTokenCacheStoreItem*) item
             withAttributes: (NSDictionary*) attributes /* The specific dictionary returned by previous SecItemCopyMatching call */
+                     value: (NSData*) value /* The serialized item */
                      error: (ADAuthenticationError* __autoreleasing*) error
 {
     RETURN_ON_NIL_ARGUMENT(item);
@@ -199,14 +816,18 @@ const long sKeychainVersion = 1;//will need to increase when we break the forwar
 
     [self LogItem:item message:@"Attempting to update an item"];
     if ([mHelper updateItemByAttributes:attributes
-                                  value:[NSKeyedArchiver archivedDataWithRootObject:item]
+                                  value:value
                                   error:error])
     {
+        //The generation tells the memory stores that their copies are stale, so only real writes bump it:
+        atomic_fetch_add(&mGeneration, 1);
+        [self signalChange];
         [self LogItem:item message:@"Item successfully updated"];
     }
 }
 
 -(void) addKeychainItem: (ADTokenCacheStoreItem*) item
+                  value: (NSData*) value /* The serialized item */
                   error: (ADAuthenticationError* __autoreleasing*) error
 {
     RETURN_ON_NIL_ARGUMENT(item);
@@ -223,10 +844,25 @@ const long sKeychainVersion = 1;//will need to increase when we break the forwar
         mItemKeyAttributeKey: keyText,//Item key
         mUserIdKey:[self.class getAttributeName:item.userInformation.userId],
         }];
-    if ([mHelper addItemWithAttributes:keychainItem
-                                 value:[NSKeyedArchiver archivedDataWithRootObject:item]
-                                 error:error])
+    BOOL added = [mHelper addItemWithAttributes:keychainItem
+                                          value:value
+                                          error:error];
+    @synchronized(self)
+    {
+        if (added)
+        {
+            atomic_fetch_add(&mGeneration, 1);
+            [self indexAttributes:keychainItem];
+        }
+        else
+        {
+            //Most likely the item was added by somebody else:
+            [self invalidateIndex];
+        }
+    }
+    if (added)
     {
+        [self signalChange];
         [self LogItem:item message:@"Item successfully added"];
     }
 }
@@ -245,8 +881,9 @@ const long sKeychainVersion = 1;//will need to increase when we break the forwar
         return nil;
     }
 
-    ADTokenCacheStoreItem* item = [NSKeyedUnarchiver unarchiveObjectWithData:data];
-    if ([item isKindOfClass:[ADTokenCacheStoreItem class]])
+    ADAuthenticationError* adError = nil;
+    ADTokenCacheStoreItem* item = [self.class itemFromData:data error:&adError];
+    if (item)
     {
         //Verify that the item is valid:
         ADTokenCacheStoreKey* key = [item extractKeyWithError:error];
@@ -260,64 +897,143 @@ const long sKeychainVersion = 1;//will need to increase when we break the forwar
     }
     else
     {
-        NSString* errorDetails = [NSString stringWithFormat:@"The key chain item data does not contain cache item. Attributes: %@",
-                        attributes];
-        ADAuthenticationError* toReport = [ADAuthenticationError errorFromAuthenticationError:AD_ERROR_CACHE_PERSISTENCE
-                                                                                 protocolCode:nil
-                                                                                 errorDetails:errorDetails];
+        if (!adError)
+        {
+            NSString* errorDetails = [NSString stringWithFormat:@"The key chain item data does not contain cache item. Attributes: %@",
+                            attributes];
+            adError = [ADAuthenticationError errorFromAuthenticationError:AD_ERROR_CACHE_PERSISTENCE
+                                                             protocolCode:nil
+                                                             errorDetails:errorDetails];
+        }
         if (error)
         {
-            *error = toReport;
+            *error = adError;
         }
         return nil;
     }
 }
 
-//We should not put nil keys in the keychain. The method substitutes nil with a special GUID:
-+(NSString*) getAttributeName: (NSString*)original
+//Decodes the keychain item data, in either the current or the legacy (NSKeyedArchiver) format.
+//Returns nil if the data does not contain a cache item.
++(ADTokenCacheStoreItem*) itemFromData: (NSData*) data
+                                 error: (ADAuthenticationError* __autoreleasing*) error
 {
-    return ([NSString adIsStringNilOrBlank:original]) ? sNilKey : [original adBase64UrlEncode];
+    if ([ADTokenCacheItemSerializer isSerializedItem:data])
+    {
+        return [ADTokenCacheItemSerializer itemFromData:data error:error];
+    }
+    
+    id item = [NSKeyedUnarchiver unarchiveObjectWithData:data];
+    return [item isKindOfClass:[ADTokenCacheStoreItem class]] ? item : nil;
 }
 
-//Stores the passed items in the group. Does not explicitly remove items that are not there.
-//The method is efficient only for bulk operations, as it pulls all items in the dictionary
-//first to determine which ones are new and which ones are existing.
--(BOOL) persistWithItems: (NSArray*) flatItemsList
-                   error: (ADAuthenticationError *__autoreleasing *) error
+//Copies the items, written by the previous version of the library in the same keychain group, to the
+//current format. The originals are deleted only in a private group, so that the sign out flows do not leave
+//tokens behind. In a shared group the applications on the previous version still read them, so they are kept,
+//and a marker item makes sure that they are copied only once: a later copy would bring back the tokens,
+//removed in the current format in the meantime. The items that fail to migrate are retried on the next call.
+//The method is thread-safe.
+-(void) migrateLegacyItems
 {
-    ADAuthenticationError* toReport;
-    //Get all items which are already in the cache:
-    NSMutableDictionary* stored = [self keychainAttributesWithQuery:nil error:&toReport];
-    if (stored)
+    if (mLegacyItemsMigrated)
     {
-        //Add or update all passed items:
-        for(ADTokenCacheStoreItem* item in flatItemsList)
-        {
-            NSString* fullKey = [self fullKeychainKeyFromCacheItem:item error:&toReport];
-            if (!fullKey)
-            {
-                continue;
-            }
-            NSDictionary* storedAttributes = [stored objectForKey:fullKey];
-            if (storedAttributes)
-            {
-                [stored removeObjectForKey:fullKey];//Clear, as it will be updated.
-                //Update item:
-                [self updateKeychainItem:item withAttributes:storedAttributes error:&toReport];
-            }
-            else
+        return;
+    }
+    
+    //No modification may interleave with the copying, hence the exclusive lock. The operations call
+    //the method at their start, before they take any of the locks themselves:
+    [self lockAllKeys];
+    if (!mLegacyItemsMigrated)//Otherwise done by another thread in the meantime
+    {
+        [self copyLegacyItems];
+    }
+    [self unlockAllKeys];
+}
+
+//Copies the legacy items into the current format. Called by migrateLegacyItems under the exclusive lock:
+-(void) copyLegacyItems
+{
+    BOOL sharedCache = mSharedCache;
+    if (sharedCache && [mChangesHelper getItemsAttributes:[self migrationMarkerAttributes] error:nil].count)
+    {
+        mLegacyItemsMigrated = YES;//Copied by this or another application before
+        return;
+    }
+    
+    ADAuthenticationError* error = nil;
+    NSArray* legacyAttributes = [mLegacyHelper getItemsAttributes:nil error:&error];
+    if (!legacyAttributes)
+    {
+        return;//The keychain may be locked; retry next time.
+    }
+    if (!legacyAttributes.count)
+    {
+        mLegacyItemsMigrated = YES;
+        return;
+    }
+    
+    AD_LOG_INFO_F(sKeyChainlog, @"Migrating %lu cache items from the previous keychain format.", (unsigned long)legacyAttributes.count);
+    NSArray* currentAttributes = [mHelper getItemsAttributes:nil error:nil];
+    NSMutableSet* currentKeys = [[NSMutableSet alloc] initWithCapacity:currentAttributes.count];
+    for(NSDictionary* attributes in currentAttributes)
+    {
+        [currentKeys addObject:[self fullKeychainKeyFromAttributes:attributes]];
+    }
+    
+    BOOL migrated = YES;
+    BOOL added = NO;
+    for(NSDictionary* attributes in legacyAttributes)
+    {
+        NSData* data = [mLegacyHelper getItemDataWithAttributes:attributes error:nil];
+        ADTokenCacheStoreItem* item = (data) ? [self.class itemFromData:data error:nil] : nil;
+        NSString* keyText = (item) ? [self keychainKeyFromCacheItem:item error:nil] : nil;
+        if (keyText)
+        {
+            NSString* userKey = [self.class getAttributeName:item.userInformation.userId];
+            //An item, already written in the current format, is newer than the legacy one:
+            if (![currentKeys containsObject:[NSString stringWithFormat:@"%@%@%@", keyText, sDelimiter, userKey]])
             {
-                //Add the new item:
-                [self addKeychainItem:item error:&toReport];
+                NSMutableDictionary* keychainItem = [NSMutableDictionary dictionaryWithDictionary:@{
+                    mItemKeyAttributeKey: keyText,//Item key
+                    mUserIdKey: userKey,
+                    }];
+                if (![mHelper addItemWithAttributes:keychainItem value:[ADTokenCacheItemSerializer dataFromItem:item] error:nil])
+                {
+                    migrated = NO;
+                    continue;//Keep the legacy item, so that the token is not lost
+                }
+                added = YES;
+                [self LogItem:item message:@"Item successfully migrated"];
             }
         }
+            
+        //Either migrated, superseded or unreadable:
+        if (!sharedCache)
+        {
+            [mLegacyHelper deleteByAttributes:attributes error:nil];
+        }
     }
-  
-    if (error && toReport)
+    if (migrated && sharedCache)
     {
-        *error = toReport;
+        [mChangesHelper addItemWithAttributes:[self migrationMarkerAttributes] value:mLibraryValue error:nil];
+    }
+    mLegacyItemsMigrated = migrated;
+    
+    if (added)
+    {
+        @synchronized(self)
+        {
+            [self invalidateIndex];
+        }
+        atomic_fetch_add(&mGeneration, 1);
+        [self signalChange];
     }
-    return !toReport;//No error
+}
+
+//We should not put nil keys in the keychain. The method substitutes nil with a special GUID:
++(NSString*) getAttributeName: (NSString*)original
+{
+    return ([NSString adIsStringNilOrBlank:original]) ? sNilKey : [original adBase64UrlEncode];
 }
 
 //Internal method: returns a dictionary with all items that match the criteria.
@@ -325,7 +1041,7 @@ const long sKeychainVersion = 1;//will need to increase when we break the forwar
 //keychain attributes as extracted by SecItemCopyMatching. The attributes
 //(represented as dictionaries) can be used to obtain the actual token cache item.
 //May return nil in case of error.
-//The method is not thread-safe.
+//The method is thread-safe.
 -(NSDictionary*) keychainAttributesWithKey: (ADTokenCacheStoreKey*) key
                                     userId: (NSString*) userId
                                      error: (ADAuthenticationError* __autoreleasing*) error
@@ -345,6 +1061,26 @@ const long sKeychainVersion = 1;//will need to increase when we break the forwar
 
 
 
+//Returns the attributes of the items with any of the specified keychain keys (without the user), in the
+//format of keychainAttributesWithQuery. Queries each key separately, so that the batch operations do not
+//need to read the whole keychain group. Returns nil in case of error.
+-(NSDictionary*) keychainAttributesWithKeychainKeys: (NSSet*) keychainKeys
+                                              error: (ADAuthenticationError* __autoreleasing*) error
+{
+    NSMutableDictionary* toReturn = [NSMutableDictionary new];
+    for(NSString* keychainKey in keychainKeys)
+    {
+        NSMutableDictionary* query = [NSMutableDictionary dictionaryWithObject:keychainKey forKey:mItemKeyAttributeKey];
+        NSDictionary* attributes = [self keychainAttributesWithQuery:query error:error];
+        if (!attributes)
+        {
+            return nil;
+        }
+        [toReturn addEntriesFromDictionary:attributes];
+    }
+    return toReturn;
+}
+
 //Internal method, used by getItemWithKey and getItemsWithKey public methods.
 //The method is thread-safe.
 -(NSArray*) readCacheItemsWithKey: (ADTokenCacheStoreKey*) key
@@ -356,38 +1092,22 @@ const long sKeychainVersion = 1;//will need to increase when we break the forwar
     NSArray* toReturn = nil;
     if (key)
     {
-        @synchronized(self)
+        //No lock is needed: the keychain calls are atomic and a concurrent modification
+        //of an item results in either its old or its new version being read:
+        NSDictionary* keyItemsAttributes = [self keychainAttributesWithKey:key userId:userId error:&adError];
+        if (keyItemsAttributes)
         {
-            NSDictionary* keyItemsAttributes = [self keychainAttributesWithKey:key userId:userId error:&adError];
-            if (keyItemsAttributes)
+            if (!allowMany && keyItemsAttributes.count > 1)
             {
-                if (!allowMany && keyItemsAttributes.count > 1)
-                {
-                    adError = [ADAuthenticationError errorFromAuthenticationError:AD_ERROR_MULTIPLE_USERS
-                                                                     protocolCode:nil
-                                                                     errorDetails:sMultiUserError];
-                }
-                else
-                {
-                    //Note that we may have an empty dictionary too:
-                    NSMutableArray* array = [[NSMutableArray alloc] initWithCapacity:keyItemsAttributes.count];
-                    for(NSDictionary* attributes in keyItemsAttributes.allValues)
-                    {
-                        ADTokenCacheStoreItem* item = [self readCacheItemWithAttributes:attributes
-                                                                                  error:&adError];
-                        if (item)
-                        {
-                            [array addObject:item];
-                        }
-                        else if (adError)//It is ok for the item to be nil, if it is not found
-                        {
-                            //Break on the first data issue:
-                            array = nil;
-                            break;
-                        }
-                    }
-                    toReturn = array;
-                }
+                adError = [ADAuthenticationError errorFromAuthenticationError:AD_ERROR_MULTIPLE_USERS
+                                                                 protocolCode:nil
+                                                                 errorDetails:sMultiUserError];
+            }
+            else
+            {
+                //Note that we may have an empty dictionary too. It is ok for the items to be
+                //missing, if they were removed after reading the attributes:
+                toReturn = [self readCacheItemsWithAttributesDictionaries:keyItemsAttributes error:&adError];
             }
         }
     }
@@ -407,7 +1127,7 @@ const long sKeychainVersion = 1;//will need to increase when we break the forwar
 //The dictionary contains item keychain keys (strings) as keys
 //and metadata attributes as values (dictionaries). The latter are provided
 //exactly as returned by SecItemCopyMatching function.
-//keysAndAttributes can be nil.
+//keysAndAttributes can be nil. The caller should hold the modification locks of the keys.
 -(void) removeWithAttributesDictionaries: (NSDictionary*) keysAndAttributes
                                    error: (ADAuthenticationError* __autoreleasing*) error
 {
@@ -415,44 +1135,254 @@ const long sKeychainVersion = 1;//will need to increase when we break the forwar
     {
         return;
     }
-    for(NSDictionary* attributes in keysAndAttributes.allValues)
+    BOOL removed = NO;
+    for(NSString* fullKey in keysAndAttributes)
     {
-        [mHelper deleteByAttributes:attributes error:error];
+        removed |= [mHelper deleteByAttributes:[keysAndAttributes objectForKey:fullKey] error:error];
+        @synchronized(self)
+        {
+            [self unindexFullKey:fullKey];
+        }
+    }
+    if (removed)
+    {
+        //Bumped only after the deletions, so that a memory store, which read the items in the meantime,
+        //sees a new generation and does not install them:
+        atomic_fetch_add(&mGeneration, 1);
+        [self signalChange];
     }
 }
 
 
-//From ADTokenCacheStoring protocol
--(NSArray*) allItemsWithError:(ADAuthenticationError *__autoreleasing *)error
+#pragma mark - Garbage collection
+
+//An item is usable if it can provide an access token, directly or through its refresh token:
++(BOOL) isUsableItem: (ADTokenCacheStoreItem*) item
+{
+    return ![NSString adIsStringNilOrBlank:item.refreshToken]
+        || (![NSString adIsStringNilOrBlank:item.accessToken] && !item.isExpired);
+}
+
+//Schedules a background garbage collection pass, if one is due. Called after the full scans,
+//which tell the current number of items:
+-(void) scheduleGarbageCollectionWithItemCount: (NSUInteger) count
+{
+    NSUInteger maxItemCount = self.maxItemCount;
+    @synchronized(mGarbageStats)
+    {
+        BOOL overLimit = (maxItemCount && count > maxItemCount);
+        if (mGarbageCollectionRunning
+            || (!overLimit && CFAbsoluteTimeGetCurrent() - mLastGarbageCollection < sGarbageCollectionInterval))
+        {
+            return;
+        }
+        mGarbageCollectionRunning = YES;//Prevents the scan of the pass itself from scheduling another one
+    }
+    
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0), ^
+                   {
+                       [self runGarbageCollectionWithBudget:sGarbageCollectionBudget];
+                   });
+}
+
+//Records the clientId of an item key, written by this application. In a shared group, the garbage
+//collection evicts only the items of these clientIds; the rest may belong to the other applications.
+//The key text is library|authority|resource|clientId, with the clientId already encoded:
+-(void) addOwnClientIdsOfKeyTexts: (id<NSFastEnumeration>) keyTexts
+{
+    NSMutableArray* clientIds = [NSMutableArray new];
+    for(NSString* keyText in keyTexts)
+    {
+        NSRange delimiter = [keyText rangeOfString:sDelimiter options:NSBackwardsSearch];
+        if (NSNotFound != delimiter.location)
+        {
+            [clientIds addObject:[keyText substringFromIndex:NSMaxRange(delimiter)]];
+        }
+    }
+    @synchronized(mGarbageStats)
+    {
+        [mOwnClientIds addObjectsFromArray:clientIds];
+    }
+}
+
+//Deletes the item, unless it was modified after its attributes were read. Takes the modification
+//lock of the item key, so that a concurrent update is never lost. Returns YES if the item was deleted.
+-(BOOL) removeUnmodifiedItemWithAttributes: (NSDictionary*) attributes
+{
+    NSString* keyText = [attributes objectForKey:mItemKeyAttributeKey];
+    NSString* userText = [attributes objectForKey:mUserIdKey];
+    if (!keyText || !userText)
+    {
+        return NO;
+    }
+    
+    NSLock* stripe = [self lockKeychainKey:keyText];
+    NSArray* current = [mHelper getItemsAttributes:@{ mItemKeyAttributeKey:keyText, mUserIdKey:userText }
+                                             error:nil];
+    NSDictionary* currentAttributes = current.firstObject;
+    BOOL removed = NO;
+    if ([[currentAttributes objectForKey:(__bridge id)kSecAttrModificationDate] isEqual:[attributes objectForKey:(__bridge id)kSecAttrModificationDate]]
+        && [mHelper deleteByAttributes:currentAttributes error:nil])
+    {
+        removed = YES;
+        @synchronized(self)
+        {
+            [self unindexFullKey:[self fullKeychainKeyFromAttributes:currentAttributes]];
+        }
+        atomic_fetch_add(&mGeneration, 1);
+    }
+    [self unlockStripe:stripe];
+    return removed;
+}
+
+//Adds the value to the statistics counter. The method should be called under @synchronized(mGarbageStats).
+-(void) addGarbageStat: (NSString*) name
+                 value: (NSUInteger) value
+{
+    NSUInteger current = [[mGarbageStats objectForKey:name] unsignedIntegerValue];
+    [mGarbageStats setObject:[NSNumber numberWithUnsignedInteger:current + value] forKey:name];
+}
+
+-(void) collectGarbageWithBudget: (NSUInteger) budget
 {
     API_ENTRY;
+    @synchronized(mGarbageStats)
+    {
+        if (mGarbageCollectionRunning)
+        {
+            return;//A scheduled or another explicit pass is in progress
+        }
+        mGarbageCollectionRunning = YES;
+    }
+    [self runGarbageCollectionWithBudget:budget];
+}
+
+//Runs the garbage collection pass. The caller sets mGarbageCollectionRunning; the method clears it when done.
+-(void) runGarbageCollectionWithBudget: (NSUInteger) budget
+{
+    NSDate* cursor;
+    NSSet* ownClientIds;
+    @synchronized(mGarbageStats)
+    {
+        mLastGarbageCollection = CFAbsoluteTimeGetCurrent();
+        cursor = mGarbageCursor;
+        ownClientIds = [mOwnClientIds copy];
+    }
+    CFAbsoluteTime startTime = CFAbsoluteTimeGetCurrent();
     
-    NSMutableArray* toReturn = nil;
-    ADAuthenticationError* adError;
+    ADAuthenticationError* error = nil;
+    NSDictionary* all = [self keychainAttributesWithQuery:nil error:&error];
+    NSArray* candidates = all.allValues;
+    if (mSharedCache)
+    {
+        //Only the items of this application are evicted from a shared group:
+        NSMutableArray* own = [[NSMutableArray alloc] initWithCapacity:candidates.count];
+        for(NSDictionary* attributes in candidates)
+        {
+            NSArray* values = [self indexValuesFromAttributes:attributes];
+            if (values && [ownClientIds containsObject:[values objectAtIndex:2]])
+            {
+                [own addObject:attributes];
+            }
+        }
+        candidates = own;
+    }
+    //Least recently written first:
+    NSArray* byAge = [candidates sortedArrayUsingComparator:^NSComparisonResult(NSDictionary* first, NSDictionary* second)
+    {
+        NSDate* firstDate = [first objectForKey:(__bridge id)kSecAttrModificationDate];
+        NSDate* secondDate = [second objectForKey:(__bridge id)kSecAttrModificationDate];
+        return [(firstDate) ? firstDate : [NSDate distantPast] compare:(secondDate) ? secondDate : [NSDate distantPast]];
+    }];
     
-    @synchronized(self)
+    //Over the limit: evict the least recently written items, without reading them:
+    NSUInteger maxItemCount = self.maxItemCount;
+    NSUInteger overLimit = (maxItemCount && all.count > maxItemCount) ? MIN(all.count - maxItemCount, byAge.count) : 0;
+    NSUInteger evictedOverLimit = 0;
+    NSUInteger i = 0;
+    for(; i < overLimit && budget > 0; ++i, --budget)
+    {
+        if ([self removeUnmodifiedItemWithAttributes:[byAge objectAtIndex:i]])
+        {
+            ++evictedOverLimit;
+        }
+    }
+    
+    //Check the rest for usability, continuing after the items checked by the previous passes:
+    NSUInteger examined = 0;
+    NSUInteger evictedUnusable = 0;
+    for(; i < byAge.count && budget > 0; ++i)
     {
-        //Read all stored keys, then extract the data (full cache item) for each key:
-        NSMutableDictionary* all = [self keychainAttributesWithQuery:nil error:&adError];
-        if (all)
+        NSDictionary* attributes = [byAge objectAtIndex:i];
+        NSDate* modified = [attributes objectForKey:(__bridge id)kSecAttrModificationDate];
+        if (cursor && modified && [modified compare:cursor] != NSOrderedDescending)
         {
-            toReturn = [[NSMutableArray alloc] initWithCapacity:all.count];
-            for(NSDictionary* attributes in all.allValues)
+            continue;
+        }
+        
+        --budget;
+        ++examined;
+        cursor = modified;
+        ADAuthenticationError* readError = nil;
+        ADTokenCacheStoreItem* item = [self readCacheItemWithAttributes:attributes error:&readError];
+        //The items, which cannot be decoded, cannot be used either:
+        if (((item && ![self.class isUsableItem:item]) || (!item && readError)) && budget > 0)
+        {
+            --budget;
+            if ([self removeUnmodifiedItemWithAttributes:attributes])
             {
-                ADTokenCacheStoreItem* item = [self readCacheItemWithAttributes:attributes error:&adError];//The error is always logged internally.
-                if (item)
-                {
-                    [toReturn addObject:item];
-                }
-                else if (adError)
-                {
-                    toReturn = nil;//Break on error, but ignore item being null if no error is raised
-                    break;
-                }
+                ++evictedUnusable;
             }
         }
     }
     
+    if (evictedOverLimit || evictedUnusable)
+    {
+        [self signalChange];
+        AD_LOG_INFO_F(sKeyChainlog, @"Garbage collection removed %lu unusable items and %lu items over the limit.",
+                      (unsigned long)evictedUnusable, (unsigned long)evictedOverLimit);
+    }
+    
+    @synchronized(mGarbageStats)
+    {
+        //Start over from the oldest items once all of them were checked:
+        mGarbageCursor = (i < byAge.count) ? cursor : nil;
+        mGarbageCollectionRunning = NO;
+        [self addGarbageStat:@"passes" value:1];
+        [self addGarbageStat:@"examined" value:examined];
+        [self addGarbageStat:@"evictedUnusable" value:evictedUnusable];
+        [self addGarbageStat:@"evictedOverLimit" value:evictedOverLimit];
+        [mGarbageStats setObject:[NSNumber numberWithUnsignedInteger:all.count - evictedOverLimit - evictedUnusable] forKey:@"itemCount"];
+        [mGarbageStats setObject:[NSNumber numberWithDouble:CFAbsoluteTimeGetCurrent() - startTime] forKey:@"lastPassDuration"];
+    }
+}
+
+-(NSDictionary*) garbageCollectionStats
+{
+    @synchronized(mGarbageStats)
+    {
+        return [mGarbageStats copy];
+    }
+}
+
+//From ADTokenCacheStoring protocol
+-(NSArray*) allItemsWithError:(ADAuthenticationError *__autoreleasing *)error
+{
+    API_ENTRY;
+    [self migrateLegacyItems];
+    [self checkForExternalChanges];
+    
+    NSArray* toReturn = nil;
+    ADAuthenticationError* adError;
+    
+    //Read all stored keys, then extract the data (full cache item) for each key:
+    NSMutableDictionary* all = [self keychainAttributesWithQuery:nil error:&adError];
+    if (all)
+    {
+        //Breaks on error, but ignores the items removed in the meantime:
+        toReturn = [self readCacheItemsWithAttributesDictionaries:all error:&adError];
+    }
+    
     if (error && adError)
     {
         *error = adError;
@@ -466,6 +1396,8 @@ const long sKeychainVersion = 1;//will need to increase when we break the forwar
                                    error: (ADAuthenticationError *__autoreleasing *)error
 {
     API_ENTRY;
+    [self migrateLegacyItems];
+    [self checkForExternalChanges];
 
     userId = [ADUserInformation normalizeUserId:userId];
     NSArray* items = [self readCacheItemsWithKey:key userId:userId allowMany:NO error:error];
@@ -478,6 +1410,8 @@ const long sKeychainVersion = 1;//will need to increase when we break the forwar
                       error: (ADAuthenticationError* __autoreleasing*) error
 {
     API_ENTRY;
+    [self migrateLegacyItems];
+    [self checkForExternalChanges];
     
     return [self readCacheItemsWithKey:key userId:nil allowMany:YES error:error];
 }
@@ -491,29 +1425,176 @@ const long sKeychainVersion = 1;//will need to increase when we break the forwar
                   error: (ADAuthenticationError* __autoreleasing*) error
 {
     API_ENTRY;
-    @synchronized(self)
+    [self migrateLegacyItems];
+    ADTokenCacheStoreKey* key = [item extractKeyWithError:error];
+    NSString* keychainKey = (key) ? [self fullKeychainKeyFromCacheItem:item error:error] : nil;
+    if (!keychainKey)
     {
-        ADTokenCacheStoreKey* key = [item extractKeyWithError:error];
-        if (!key)
+        return;
+    }
+    //Serialize outside of the critical section:
+    NSData* value = [ADTokenCacheItemSerializer dataFromItem:item];
+    
+    NSString* keyText = [self keychainKeyFromCacheKey:key];
+    [self addOwnClientIdsOfKeyTexts:@[keyText]];
+    
+    NSLock* stripe = [self lockKeychainKey:keyText];
+    NSDictionary* allAttributes = [self keychainAttributesWithKey:key userId:item.userInformation.userId error:error];
+    NSDictionary* attributes = [allAttributes objectForKey:keychainKey];
+    if (attributes)
+    {
+        [self updateKeychainItem:item withAttributes:attributes value:value error:error];
+    }
+    else
+    {
+        [self addKeychainItem:item value:value error:error];
+    }
+    [self unlockStripe:stripe];
+}
+
+//Reports the per-item failures of a batch operation through the out parameters.
+//Returns YES if there were no failures.
++(BOOL) reportFailures: (NSDictionary*) failed
+              failures: (NSDictionary* __autoreleasing*) failures
+                 error: (ADAuthenticationError* __autoreleasing*) error
+{
+    if (failures)
+    {
+        *failures = failed.count ? failed : nil;
+    }
+    if (!failed.count)
+    {
+        return YES;
+    }
+    if (error)
+    {
+        NSNumber* first = [[failed.allKeys sortedArrayUsingSelector:@selector(compare:)] firstObject];
+        *error = [failed objectForKey:first];
+    }
+    return NO;
+}
+
+//From ADTokenCacheStoring protocol
+-(BOOL) addOrUpdateItems: (NSArray*) items
+                failures: (NSDictionary* __autoreleasing*) failures
+                   error: (ADAuthenticationError* __autoreleasing*) error
+{
+    API_ENTRY;
+    [self migrateLegacyItems];
+    NSUInteger count = items.count;
+    NSMutableDictionary* failed = [NSMutableDictionary new];
+    
+    //Calculate the keys and archive the items outside of the critical section. The entries of the skipped items
+    //(invalid or superseded by a later item with the same key) are set to NSNull:
+    NSMutableArray* keyTexts = [[NSMutableArray alloc] initWithCapacity:count];
+    NSMutableArray* userKeys = [[NSMutableArray alloc] initWithCapacity:count];
+    NSMutableArray* values = [[NSMutableArray alloc] initWithCapacity:count];
+    NSMutableDictionary* indices = [[NSMutableDictionary alloc] initWithCapacity:count];//Full key -> index
+    NSMutableSet* distinctKeyTexts = [[NSMutableSet alloc] initWithCapacity:count];
+    for(NSUInteger i = 0; i < count; ++i)
+    {
+        ADTokenCacheStoreItem* item = [items objectAtIndex:i];
+        ADAuthenticationError* itemError = nil;
+        NSString* keyText = [self keychainKeyFromCacheItem:item error:&itemError];
+        if (!keyText)
         {
-            return;
+            [failed setObject:itemError forKey:@(i)];
+            [keyTexts addObject:[NSNull null]];
+            [userKeys addObject:[NSNull null]];
+            [values addObject:[NSNull null]];
+            continue;
         }
-        NSDictionary* allAttributes = [self keychainAttributesWithKey:key userId:item.userInformation.userId error:error];
-        NSString* keychainKey = [self fullKeychainKeyFromCacheItem:item error:error];
-        if (!keychainKey)
+        
+        NSString* userKey = [self.class getAttributeName:item.userInformation.userId];
+        NSString* fullKey = [NSString stringWithFormat:@"%@%@%@", keyText, sDelimiter, userKey];
+        NSNumber* previous = [indices objectForKey:fullKey];
+        if (previous)
         {
-            return;
+            [keyTexts replaceObjectAtIndex:previous.unsignedIntegerValue withObject:[NSNull null]];
+        }
+        [indices setObject:@(i) forKey:fullKey];
+        
+        [keyTexts addObject:keyText];
+        [userKeys addObject:userKey];
+        [values addObject:[ADTokenCacheItemSerializer dataFromItem:item]];
+        [distinctKeyTexts addObject:keyText];
+    }
+    [self addOwnClientIdsOfKeyTexts:distinctKeyTexts];
+    
+    NSArray* stripes = [self lockKeychainKeys:distinctKeyTexts];
+    //Only the keys of the batch are read, not the whole keychain group:
+    ADAuthenticationError* adError = nil;
+    NSDictionary* stored = [self keychainAttributesWithKeychainKeys:distinctKeyTexts error:&adError];
+    if (stored)
+    {
+        BOOL modified = NO;
+        for(NSUInteger i = 0; i < count; ++i)
+        {
+            NSString* keyText = [keyTexts objectAtIndex:i];
+            if ((id)keyText == [NSNull null])
+            {
+                continue;
+            }
+            
+            ADTokenCacheStoreItem* item = [items objectAtIndex:i];
+            NSString* userKey = [userKeys objectAtIndex:i];
+            NSData* value = [values objectAtIndex:i];
+            NSDictionary* attributes = [stored objectForKey:[NSString stringWithFormat:@"%@%@%@", keyText, sDelimiter, userKey]];
+            ADAuthenticationError* itemError = nil;
+            BOOL succeeded;
+            if (attributes)
+            {
+                succeeded = [mHelper updateItemByAttributes:attributes value:value error:&itemError];
+            }
+            else
+            {
+                NSMutableDictionary* keychainItem = [NSMutableDictionary dictionaryWithDictionary:@{
+                    mItemKeyAttributeKey: keyText,//Item key
+                    mUserIdKey: userKey,
+                    }];
+                succeeded = [mHelper addItemWithAttributes:keychainItem value:value error:&itemError];
+                @synchronized(self)
+                {
+                    if (succeeded)
+                    {
+                        [self indexAttributes:keychainItem];
+                    }
+                    else
+                    {
+                        [self invalidateIndex];
+                    }
+                }
+            }
+            
+            if (succeeded)
+            {
+                modified = YES;
+                [self LogItem:item message:@"Item successfully stored"];
+            }
+            else
+            {
+                [failed setObject:(itemError ? itemError : [ADAuthenticationError unexpectedInternalError:@"Cannot store the item."])
+                           forKey:@(i)];
+            }
         }
-        NSDictionary* attributes = [allAttributes objectForKey:keychainKey];
-        if (attributes)
+        //A single generation bump and signal for the whole batch, after the writes landed:
+        if (modified)
         {
-            [self updateKeychainItem:item withAttributes:attributes error:error];
+            atomic_fetch_add(&mGeneration, 1);
+            [self signalChange];
         }
-        else
+    }
+    [self unlockStripes:stripes];
+    
+    if (!stored)
+    {
+        if (error)
         {
-            [self addKeychainItem:item error:error];
+            *error = adError;
         }
+        return NO;
     }
+    return [self.class reportFailures:failed failures:failures error:error];
 }
 
 //From ADTokenCacheStoring protocol
@@ -522,6 +1603,7 @@ const long sKeychainVersion = 1;//will need to increase when we break the forwar
                     error: (ADAuthenticationError* __autoreleasing* ) error
 {
     API_ENTRY;
+    [self migrateLegacyItems];
     
     if (!key)
     {
@@ -529,16 +1611,85 @@ const long sKeychainVersion = 1;//will need to increase when we break the forwar
     }
     
     userId = [ADUserInformation normalizeUserId:userId];
-    @synchronized(self)
+    NSLock* stripe = [self lockKeychainKey:[self keychainKeyFromCacheKey:key]];
+    NSDictionary* allAttributes = [self keychainAttributesWithKey:key userId:userId error:error];
+    if (allAttributes)
+    {
+        
+        AD_LOG_VERBOSE(@"removing item from cache", nil);
+        [self removeWithAttributesDictionaries:allAttributes error:error];
+    }
+    [self unlockStripe:stripe];
+}
+
+//From ADTokenCacheStoring protocol
+-(BOOL) removeItemsWithKeys: (NSArray*) keys
+                     userId: (NSString*) userId
+                   failures: (NSDictionary* __autoreleasing*) failures
+                      error: (ADAuthenticationError* __autoreleasing*) error
+{
+    API_ENTRY;
+    [self migrateLegacyItems];
+    userId = [ADUserInformation normalizeUserId:userId];
+    NSString* userKey = (userId) ? [userId adBase64UrlEncode] : nil;
+    
+    //Keychain key -> index of the key in the passed array:
+    NSMutableDictionary* indices = [[NSMutableDictionary alloc] initWithCapacity:keys.count];
+    for(NSUInteger i = 0; i < keys.count; ++i)
+    {
+        [indices setObject:@(i) forKey:[self keychainKeyFromCacheKey:[keys objectAtIndex:i]]];
+    }
+    
+    NSMutableDictionary* failed = [NSMutableDictionary new];
+    NSSet* distinctKeyTexts = [NSSet setWithArray:indices.allKeys];
+    NSArray* stripes = [self lockKeychainKeys:distinctKeyTexts];
+    //Only the keys of the batch are read, not the whole keychain group:
+    ADAuthenticationError* adError = nil;
+    NSDictionary* stored = [self keychainAttributesWithKeychainKeys:distinctKeyTexts error:&adError];
+    if (stored)
     {
-        NSDictionary* allAttributes = [self keychainAttributesWithKey:key userId:userId error:error];
-        if (allAttributes)
+        BOOL modified = NO;
+        for(NSDictionary* attributes in stored.allValues)
         {
+            NSNumber* index = [indices objectForKey:[attributes objectForKey:mItemKeyAttributeKey]];
+            if (!index || (userKey && ![userKey isEqualToString:[attributes objectForKey:mUserIdKey]]))
+            {
+                continue;
+            }
             
-            AD_LOG_VERBOSE(@"removing item from cache", nil);
-            [self removeWithAttributesDictionaries:allAttributes error:error];
+            ADAuthenticationError* itemError = nil;
+            [mHelper deleteByAttributes:attributes error:&itemError];
+            if (itemError)
+            {
+                [failed setObject:itemError forKey:index];
+            }
+            else
+            {
+                modified = YES;
+                @synchronized(self)
+                {
+                    [self unindexFullKey:[self fullKeychainKeyFromAttributes:attributes]];
+                }
+            }
+        }
+        if (modified)
+        {
+            //After the deletions, see removeWithAttributesDictionaries:
+            atomic_fetch_add(&mGeneration, 1);
+            [self signalChange];
         }
     }
+    [self unlockStripes:stripes];
+    
+    if (!stored)
+    {
+        if (error)
+        {
+            *error = adError;
+        }
+        return NO;
+    }
+    return [self.class reportFailures:failed failures:failures error:error];
 }
 
 -(void) removeAllWithError:(ADAuthenticationError *__autoreleasing *)error
@@ -552,14 +1703,59 @@ const long sKeychainVersion = 1;//will need to increase when we break the forwar
         AD_LOG_INFO(@"Removing all tokens from the keychain cache.", nil);
     }
     API_ENTRY;
-    @synchronized(self)
+    [self migrateLegacyItems];
+    //Blocks the other modifications only; the lookups proceed while the items are being deleted:
+    [self lockAllKeys];
+    NSDictionary* allAttributes = [self keychainAttributesWithQuery:nil error:error];
+    if (allAttributes)
     {
-        NSDictionary* allAttributes = [self keychainAttributesWithQuery:nil error:error];
-        if (allAttributes)
-        {
-            [self removeWithAttributesDictionaries:allAttributes error:error];
-        }
+        [self removeWithAttributesDictionaries:allAttributes error:error];
+    }
+    [self unlockAllKeys];
+}
+
+//From ADTokenCacheStoring protocol
+-(NSArray*) itemsWithUserId: (NSString*) userId
+                      error: (ADAuthenticationError* __autoreleasing*) error
+{
+    API_ENTRY;
+    [self migrateLegacyItems];
+    NSString* userValue = [self.class getAttributeName:[ADUserInformation normalizeUserId:userId]];
+    NSDictionary* attributes = [self indexedAttributesWithUser:userValue authority:nil clientId:nil error:error];
+    return (attributes) ? [self readCacheItemsWithAttributesDictionaries:attributes error:error] : nil;
+}
+
+//From ADTokenCacheStoring protocol
+-(NSArray*) itemsWithAuthority: (NSString*) authority
+                      clientId: (NSString*) clientId
+                         error: (ADAuthenticationError* __autoreleasing*) error
+{
+    API_ENTRY;
+    [self migrateLegacyItems];
+    authority = [ADInstanceDiscovery canonicalizeAuthority:authority];
+    RETURN_NIL_ON_NIL_ARGUMENT(authority);
+    clientId = clientId.adTrimmedString.lowercaseString;
+    
+    NSString* clientIdValue = (clientId.length) ? [clientId adBase64UrlEncode] : nil;
+    NSDictionary* attributes = [self indexedAttributesWithUser:nil authority:[authority adBase64UrlEncode] clientId:clientIdValue error:error];
+    return (attributes) ? [self readCacheItemsWithAttributesDictionaries:attributes error:error] : nil;
+}
+
+//From ADTokenCacheStoring protocol
+-(void) removeItemsWithUserId: (NSString*) userId
+                        error: (ADAuthenticationError* __autoreleasing*) error
+{
+    API_ENTRY;
+    [self migrateLegacyItems];
+    NSString* userValue = [self.class getAttributeName:[ADUserInformation normalizeUserId:userId]];
+    [self lockAllKeys];
+    NSDictionary* toRemove = [self indexedAttributesWithUser:userValue authority:nil clientId:nil error:error];
+    if (toRemove.count)
+    {
+        AD_LOG_VERBOSE_F(sKeyChainlog, @"Removing %lu items of the user from the cache.", (unsigned long)toRemove.count);
+        [self removeWithAttributesDictionaries:toRemove error:error];
     }
+    [self unlockAllKeys];
 }
 
 -(NSString*) getSharedGroup
@@ -570,19 +1766,42 @@ const long sKeychainVersion = 1;//will need to increase when we break the forwar
 -(void) setSharedGroup:(NSString *)sharedGroup
 {
     API_ENTRY;
-    @synchronized(self)
+    [self lockAllKeys];
+    if (![NSString adSame:mHelper.sharedGroup toString:sharedGroup])
     {
-        if (![NSString adSame:mHelper.sharedGroup toString:sharedGroup])
+        NSString* bundleId = [[NSBundle mainBundle] bundleIdentifier];
+        BOOL wasShared = mSharedCache;
+        mSharedCache = (sharedGroup && ![sharedGroup isEqualToString:bundleId]);
+        if (!sharedGroup)
         {
-            NSString* bundleId = [[NSBundle mainBundle] bundleIdentifier];
-            mSharedCache = (sharedGroup && ![sharedGroup isEqualToString:bundleId]);
-            if (!sharedGroup)
-            {
-                sharedGroup = bundleId;
-            }
-            mHelper.sharedGroup = sharedGroup;
+            sharedGroup = bundleId;
         }
+        if (wasShared != mSharedCache)
+        {
+            self.maxItemCount = (mSharedCache) ? 0 : sDefaultMaxItemCount;
+        }
+        //A migration in progress holds the exclusive lock too, so it cannot mark the new group as migrated:
+        mHelper.sharedGroup = sharedGroup;
+        mLegacyHelper.sharedGroup = sharedGroup;
+        mLegacyItemsMigrated = NO;
+        @synchronized(mChangesHelper)
+        {
+            mChangesHelper.sharedGroup = sharedGroup;
+            mChangesRegistered = NO;//Watch the new group from now on
+        }
+        @synchronized(self)
+        {
+            [self invalidateIndex];
+        }
+        atomic_fetch_add(&mGeneration, 1);
     }
+    [self unlockAllKeys];
+}
+
+-(uint64_t) getGeneration
+{
+    //A plain load: the memory stores read it under their own lock, so no keychain access is allowed here:
+    return mGeneration;
 }
 
 
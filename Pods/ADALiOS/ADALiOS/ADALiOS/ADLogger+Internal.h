@@ -0,0 +1,44 @@
+// Copyright © Microsoft Open Technologies, Inc.
+//
+// All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS
+// OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION
+// ANY IMPLIED WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A
+// PARTICULAR PURPOSE, MERCHANTABILITY OR NON-INFRINGEMENT.
+//
+// See the Apache License, Version 2.0 for the specific language
+// governing permissions and limitations under the License.
+
+#import "ADLogger.h"
+
+//The most detailed level, which is compiled in. The statements above it are removed by the compiler,
+//together with the evaluation of their arguments. The release (NDEBUG) builds keep the warnings and
+//errors only; the other builds keep all of the levels. Define AD_LOG_LEVEL_COMPILED in the build
+//settings to override the floor, e.g. AD_LOG_LEVEL_COMPILED=ADAL_LOG_LEVEL_VERBOSE to diagnose a release build.
+#ifndef AD_LOG_LEVEL_COMPILED
+#ifdef NDEBUG
+#define AD_LOG_LEVEL_COMPILED ADAL_LOG_LEVEL_WARN
+#else
+#define AD_LOG_LEVEL_COMPILED ADAL_LOG_LEVEL_VERBOSE
+#endif
+#endif
+
+//The current level, as set by setLevel. Use setLevel to change it:
+extern ADAL_LOG_LEVEL ADLoggerCurrentLevel;
+
+//Reads the current level for the checks of the logging macros, without a method call:
+static inline ADAL_LOG_LEVEL ADLoggerGetCurrentLevel(void)
+{
+    return ADLoggerCurrentLevel;
+}
+
+//YES if the statements of the level are compiled in and enabled. The level is a constant in all of the
+//logging macros, so the first check is resolved at compile time:
+#define AD_LOG_ENABLED(level) ((level) <= AD_LOG_LEVEL_COMPILED && (level) <= ADLoggerGetCurrentLevel())
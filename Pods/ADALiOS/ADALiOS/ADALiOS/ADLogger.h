@@ -29,6 +29,41 @@ typedef enum
     ADAL_LOG_LAST = ADAL_LOG_LEVEL_VERBOSE,
 } ADAL_LOG_LEVEL;
 
+/*! A single logged event. The records are created by the logging calls and delivered to the
+ record callback (see ADLogger setLogRecordCallback) on a background queue. The object is immutable. */
+@interface ADLogRecord : NSObject
+
+/*! The priority of the record. */
+@property (readonly) ADAL_LOG_LEVEL level;
+
+/*! Short text defining the operation/condition, e.g. "Token returned". */
+@property (readonly) NSString* tag;
+
+/*! Full details. May be nil. */
+@property (readonly) NSString* additionalInformation;
+
+/*! Named values, attached to the record. May be nil. */
+@property (readonly) NSDictionary* fields;
+
+/*! The error code, if an explicit error has occurred. */
+@property (readonly) NSInteger errorCode;
+
+/*! The correlation id of the operation, which logged the record. For the records logged outside of
+ the authentication operations, the id set through ADLogger setCorrelationId. May be nil. */
+@property (readonly) NSUUID* correlationId;
+
+/*! The time of the logging call (not of the delivery). */
+@property (readonly) NSDate* timestamp;
+
+@end
+
+//The block, which receives the structured records:
+typedef void (^ADLogRecordCallback)(ADLogRecord* record);
+
+/*! The logging calls only capture the records into a fixed size, lock-free buffer. The records are
+ formatted and delivered to NSLog and to the callbacks on a background queue, in the order of the
+ logging. If the buffer is full, the new records are dropped rather than blocking the caller; the
+ number of the dropped records is reported with the next delivered one. */
 @interface ADLogger : NSObject
 
 /*! Sets the logging level for the internal logging messages. Messages with
@@ -50,6 +85,17 @@ typedef enum
   errorCode: (NSInteger) errorCode
 additionalInformation: (NSString*) additionalInformation;
 
+/*! Same as log:message:errorCode:additionalInformation:, but also attaches named values to the record.
+ @param fields: Values to attach to the record, e.g. @{ @"tokenType":@"access token" }. May be nil. */
++(void) log: (ADAL_LOG_LEVEL)logLevel
+    message: (NSString*) message
+  errorCode: (NSInteger) errorCode
+additionalInformation: (NSString*) additionalInformation
+     fields: (NSDictionary*) fields;
+
+/*! Waits until all of the records logged so far are delivered. Should not be called from the logging callbacks. */
++(void) flush;
+
 /*! Logs obtaining of a token. The method does not log the actual token, only its hash.
  @param token: the token to log.
  @param tokenType: "access token", "refresh token", "multi-resource refresh token"
@@ -73,12 +119,19 @@ typedef void (^LogCallback)(ADAL_LOG_LEVEL logLevel,
 /*! Provided block will be called when the logged messages meet the priority threshold
  @param callback: The block to be executed when suitable messages are logged. By default, when
  callback is set, messages will contingue to be logged through NSLog. Such logging can be disabled
- through setNSLogging. */
+ through setNSLogging. The block is called on a background queue, one record at a time. */
 +(void) setLogCallBack: (LogCallback) callback;
 
 /*! Returns previously set callback call or nil, if the user has not set such callback. */
 +(LogCallback) getLogCallBack;
 
+/*! Provided block will receive the structured records, which meet the priority threshold. Unlike
+ the LogCallback, no formatting is done for this callback. The block is called on a background queue. */
++(void) setLogRecordCallback: (ADLogRecordCallback) callback;
+
+/*! Returns previously set record callback or nil. */
++(ADLogRecordCallback) getLogRecordCallback;
+
 /*! By default, logging sends messages through standard NSLog. This function allows to disable this
  behavior. Disabling is useful if faster logging is implemented through the callback. */
 +(void) setNSLogging: (BOOL) nslogging;
@@ -93,7 +146,10 @@ typedef void (^LogCallback)(ADAL_LOG_LEVEL logLevel,
  the actual contents, but still want to log something that can be correlated. */
 +(NSString*) getHash: (NSString*) input;
 
-/*! Sets correlation id to be used in the requests sent to server. */
+/*! Sets the correlation id of the log records, which are logged outside of the authentication operations.
+ It is also sent with the requests of the ADAuthenticationContext objects, which do not have their own
+ correlationId set. The operations log their records with the id they send, see the correlationId property
+ of ADAuthenticationContext. */
 +(void) setCorrelationId: (NSUUID*) correlationId;
 
 /*! Gets correlation Id. */
@@ -103,22 +159,33 @@ typedef void (^LogCallback)(ADAL_LOG_LEVEL logLevel,
 
 @end
 
-//A simple macro for single-line logging:
+//The logging macros below are used by the library code. The level checks (AD_LOG_ENABLED and the
+//compile-time floor) are defined in ADLogger+Internal.h.
+
+//A simple macro for single-line logging. The arguments are evaluated only if the level is enabled:
 #define AD_LOG(level, msg, code, info) \
 { \
+    if (AD_LOG_ENABLED(level)) \
+    { \
             [ADLogger log: level \
                   message: msg \
                 errorCode: code \
     additionalInformation: info]; \
+    } \
 }
 
 #define FIRST_ARG(ARG,...) ARG
 
 //Allows formatting, e.g. AD_LOG_FORMAT(ADAL_LOG_LEVEL_INFO, "Something", "Check this: %@ and this: %@", this1, this2)
 //If we make this a method, we will lose the warning when the string formatting parameters do not match the actual parameters.
+//As with AD_LOG, neither the formatting, nor the arguments are evaluated if the level is not enabled.
 #define AD_LOG_FORMAT(level, msg, code, info...) \
 { \
-    if (FIRST_ARG(info))/*Avoid crash in logging*/ \
+    if (!AD_LOG_ENABLED(level)) \
+    { \
+        /*Nothing to do*/ \
+    } \
+    else if (FIRST_ARG(info))/*Avoid crash in logging*/ \
     { \
         NSString* logInfo = [NSString stringWithFormat:info]; \
         [ADLogger log: level \
@@ -18,26 +18,109 @@
 
 #import "ADALiOS.h"
 #import "ADOAuth2Constants.h"
+#import "ADRequestContext.h"
 #include <sys/types.h>
 #include <sys/sysctl.h>
 #include <mach/machine.h>
 #include <CommonCrypto/CommonDigest.h>
+#include <stdatomic.h>
 
-ADAL_LOG_LEVEL sLogLevel = ADAL_LOG_LEVEL_ERROR;
+ADAL_LOG_LEVEL ADLoggerCurrentLevel = ADAL_LOG_LEVEL_ERROR;
 LogCallback sLogCallback;
+ADLogRecordCallback sLogRecordCallback;
 BOOL sNSLogging = YES;
 NSUUID* requestCorrelationId;
 
+//The records are passed from the logging threads to the drain queue through a bounded ring
+//buffer (multiple producers, single consumer). Each slot carries a sequence number, which tells
+//whether the slot is free for the position being written or holds the record for the position
+//being read, so neither side takes a lock. The records are retained by the buffer while queued.
+#define LOG_BUFFER_CAPACITY 1024 //Should be a power of 2
+
+typedef struct
+{
+    atomic_size_t sequence;
+    void* record;
+} ADLogSlot;
+
+static ADLogSlot sLogBuffer[LOG_BUFFER_CAPACITY];
+static atomic_size_t sLogWritePosition;
+static size_t sLogReadPosition;//Only accessed on the drain queue
+static atomic_size_t sDroppedRecords;
+static atomic_flag sDrainScheduled = ATOMIC_FLAG_INIT;
+static dispatch_queue_t sDrainQueue;
+
+@interface ADLogRecord ()
+
+-(id) initWithLevel: (ADAL_LOG_LEVEL) level
+                tag: (NSString*) tag
+additionalInformation: (NSString*) additionalInformation
+             fields: (NSDictionary*) fields
+          errorCode: (NSInteger) errorCode
+      correlationId: (NSUUID*) correlationId;
+
+@end
+
+@implementation ADLogRecord
+
+-(id) init
+{
+    [super doesNotRecognizeSelector:_cmd];
+    return nil;
+}
+
+-(id) initWithLevel: (ADAL_LOG_LEVEL) level
+                tag: (NSString*) tag
+additionalInformation: (NSString*) additionalInformation
+             fields: (NSDictionary*) fields
+          errorCode: (NSInteger) errorCode
+      correlationId: (NSUUID*) correlationId
+{
+    self = [super init];
+    if (self)
+    {
+        _level                  = level;
+        _tag                    = tag;
+        _additionalInformation  = additionalInformation;
+        _fields                 = fields;
+        _errorCode              = errorCode;
+        _correlationId          = correlationId;
+        _timestamp              = [NSDate date];
+    }
+    return self;
+}
+
+@end
+
 @implementation ADLogger
 
++(void) initialize
+{
+    if (self != [ADLogger class])
+    {
+        return;
+    }
+    
+    for(size_t i = 0; i < LOG_BUFFER_CAPACITY; ++i)
+    {
+        atomic_init(&sLogBuffer[i].sequence, i);
+        sLogBuffer[i].record = NULL;
+    }
+    atomic_init(&sLogWritePosition, 0);
+    atomic_init(&sDroppedRecords, 0);
+    sLogReadPosition = 0;
+    sDrainQueue = dispatch_queue_create("com.microsoft.adal.logger", DISPATCH_QUEUE_SERIAL);
+    dispatch_set_target_queue(sDrainQueue, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0));
+}
+
 +(void) setLevel: (ADAL_LOG_LEVEL)logLevel
 {
-    sLogLevel = logLevel;
+    ADLoggerCurrentLevel = logLevel;
 }
 
 +(ADAL_LOG_LEVEL) getLevel
 {
-    return sLogLevel;
+    return ADLoggerCurrentLevel;
 }
 
 +(void) setLogCallBack: (LogCallback) callback
@@ -50,7 +133,26 @@ NSUUID* requestCorrelationId;
 
 +(LogCallback) getLogCallBack
 {
-    return sLogCallback;
+    @synchronized(self)
+    {
+        return sLogCallback;
+    }
+}
+
++(void) setLogRecordCallback: (ADLogRecordCallback) callback
+{
+    @synchronized(self)
+    {
+        sLogRecordCallback = [callback copy];
+    }
+}
+
++(ADLogRecordCallback) getLogRecordCallback
+{
+    @synchronized(self)
+    {
+        return sLogRecordCallback;
+    }
 }
 
 
@@ -95,10 +197,139 @@ NSUUID* requestCorrelationId;
 }
 
 
+//Adds the record to the buffer. Returns NO if the buffer is full.
++(BOOL) enqueueRecord: (ADLogRecord*) record
+{
+    size_t position = atomic_load_explicit(&sLogWritePosition, memory_order_relaxed);
+    for(;;)
+    {
+        ADLogSlot* slot = &sLogBuffer[position & (LOG_BUFFER_CAPACITY - 1)];
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+        if (0 == difference)
+        {
+            //The slot is free; claim the position:
+            if (atomic_compare_exchange_weak_explicit(&sLogWritePosition, &position, position + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+            {
+                slot->record = (void*)CFBridgingRetain(record);
+                atomic_store_explicit(&slot->sequence, position + 1, memory_order_release);
+                return YES;
+            }
+            //Another thread claimed it, "position" is reloaded by the failed exchange.
+        }
+        else if (difference < 0)
+        {
+            //The slot still holds a record from the previous round, i.e. the buffer is full:
+            return NO;
+        }
+        else
+        {
+            position = atomic_load_explicit(&sLogWritePosition, memory_order_relaxed);
+        }
+    }
+}
+
+//Removes the oldest record from the buffer, or returns nil if there are none.
+//Only called on the drain queue.
++(ADLogRecord*) dequeueRecord
+{
+    ADLogSlot* slot = &sLogBuffer[sLogReadPosition & (LOG_BUFFER_CAPACITY - 1)];
+    size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+    if (sequence != sLogReadPosition + 1)
+    {
+        return nil;
+    }
+    ADLogRecord* record = CFBridgingRelease(slot->record);
+    slot->record = NULL;
+    //Frees the slot for the writer of the next round:
+    atomic_store_explicit(&slot->sequence, sLogReadPosition + LOG_BUFFER_CAPACITY, memory_order_release);
+    ++sLogReadPosition;
+    return record;
+}
+
+//Delivers the record to NSLog and to the callbacks. Only called on the drain queue.
++(void) deliverRecord: (ADLogRecord*) record
+           dateFormat: (NSDateFormatter*) dateFormatter
+{
+    NSString* timestamp = [dateFormatter stringFromDate:record.timestamp];
+    NSString* correlationId = [record.correlationId UUIDString];
+    NSString* information = record.additionalInformation;
+    if (record.fields.count)
+    {
+        NSMutableString* withFields = [NSMutableString stringWithString:(information) ? information : @""];
+        [record.fields enumerateKeysAndObjectsUsingBlock:^(id key, id value, BOOL *stop)
+         {
+             [withFields appendFormat:(withFields.length) ? @"; %@=%@" : @"%@=%@", key, value];
+         }];
+        information = withFields;
+    }
+    
+    if (sNSLogging)
+    {
+        NSLog([self formatStringPerLevel:record.level], timestamp, correlationId, record.tag, information, record.errorCode);
+    }
+    
+    //The callbacks are read once; they are not called under a lock, so they may log themselves:
+    LogCallback callback = [self getLogCallBack];
+    if (callback)
+    {
+        callback(record.level, [NSString stringWithFormat:@"ADALiOS " ADAL_VERSION_STRING " [%@ - %@] %@", timestamp, correlationId, record.tag], information, record.errorCode);
+    }
+    ADLogRecordCallback recordCallback = [self getLogRecordCallback];
+    if (recordCallback)
+    {
+        recordCallback(record);
+    }
+}
+
+//Delivers all of the queued records. Only called on the drain queue.
++(void) drain
+{
+    //The formatter is only used on the drain queue, hence it is created once:
+    static NSDateFormatter* dateFormatter;
+    if (!dateFormatter)
+    {
+        dateFormatter = [NSDateFormatter new];
+        [dateFormatter setTimeZone:[NSTimeZone timeZoneWithName:@"UTC"]];
+        [dateFormatter setDateFormat:@"yyyy-MM-dd HH:mm:ss"];
+    }
+    
+    ADLogRecord* record;
+    while ((record = [self dequeueRecord]))
+    {
+        @autoreleasepool
+        {
+            [self deliverRecord:record dateFormat:dateFormatter];
+            
+            size_t dropped = atomic_exchange(&sDroppedRecords, 0);
+            if (dropped)
+            {
+                ADLogRecord* droppedRecord = [[ADLogRecord alloc] initWithLevel:ADAL_LOG_LEVEL_WARN
+                                                                            tag:@"Logging"
+                                                          additionalInformation:[NSString stringWithFormat:@"%lu log records were dropped, as the log buffer was full.", (unsigned long)dropped]
+                                                                         fields:nil
+                                                                      errorCode:0
+                                                                  correlationId:nil];
+                [self deliverRecord:droppedRecord dateFormat:dateFormatter];
+            }
+        }
+    }
+}
+
++(void) log: (ADAL_LOG_LEVEL)logLevel
+    message: (NSString*) message
+  errorCode: (NSInteger) errorCode
+additionalInformation: (NSString*) additionalInformation
+{
+    [self log:logLevel message:message errorCode:errorCode additionalInformation:additionalInformation fields:nil];
+}
+
 +(void) log: (ADAL_LOG_LEVEL)logLevel
     message: (NSString*) message
   errorCode: (NSInteger) errorCode
 additionalInformation: (NSString*) additionalInformation
+     fields: (NSDictionary*) fields
 {
     //Note that the logging should not throw, as logging is heavily used in error conditions.
     //Hence, the checks below would rather swallow the error instead of throwing and changing the
@@ -107,26 +338,45 @@ additionalInformation: (NSString*) additionalInformation
         return;
     if (!message)
         return;
+    if (logLevel > ADLoggerCurrentLevel)
+        return;
     
-    if (logLevel <= sLogLevel)
+    //The records of an operation carry its own correlation id. The global one, which needs the class
+    //lock, is only used for the logging outside of the operations:
+    NSUUID* correlationId = [ADRequestContext currentContext].correlationId;
+    if (!correlationId)
     {
-        NSDateFormatter *dateFormatter=[[NSDateFormatter alloc] init];
-        [dateFormatter setTimeZone:[NSTimeZone timeZoneWithName:@"UTC"]];
-        [dateFormatter setDateFormat:@"yyyy-MM-dd HH:mm:ss"];
-        if (sNSLogging)
-        {
-            //NSLog is documented as thread-safe:
-            NSLog([self formatStringPerLevel:logLevel], [dateFormatter stringFromDate:[NSDate date]], [[ADLogger getCorrelationId] UUIDString], message, additionalInformation, errorCode);
-        }
-        
-        @synchronized(self)//Guard against thread-unsafe callback and modification of sLogCallback after the check
-        {
-            if (sLogCallback)
-            {
-                sLogCallback(logLevel, [NSString stringWithFormat:@"ADALiOS " ADAL_VERSION_STRING " [%@ - %@] %@", [dateFormatter stringFromDate:[NSDate date]], [[ADLogger getCorrelationId] UUIDString], message], additionalInformation, errorCode);
-            }
-        }
+        correlationId = [ADLogger getCorrelationId];
+    }
+    
+    ADLogRecord* record = [[ADLogRecord alloc] initWithLevel:logLevel
+                                                         tag:message
+                                       additionalInformation:additionalInformation
+                                                      fields:[fields copy]
+                                                   errorCode:errorCode
+                                               correlationId:correlationId];
+    if (![self enqueueRecord:record])
+    {
+        atomic_fetch_add(&sDroppedRecords, 1);
+        return;
     }
+    
+    //A single drain is scheduled at a time; it clears the flag before draining, so the records
+    //added during the draining schedule the next one:
+    if (!atomic_flag_test_and_set(&sDrainScheduled))
+    {
+        dispatch_async(sDrainQueue, ^{
+            atomic_flag_clear(&sDrainScheduled);
+            [self drain];
+        });
+    }
+}
+
++(void) flush
+{
+    dispatch_sync(sDrainQueue, ^{
+        [self drain];
+    });
 }
 
 //Extracts the CPU information according to the constants defined in
@@ -212,7 +462,17 @@ additionalInformation: (NSString*) additionalInformation
        expiresOn: (NSDate*) expiresOn
    correlationId: (NSUUID*) correlationId
 {
-    AD_LOG_VERBOSE_F(@"Token returned", @"Obtained %@ with hash %@, expiring on %@ and correlationId: %@", tokenType, [self getHash:token], expiresOn, [correlationId UUIDString]);
+    if (!AD_LOG_ENABLED(ADAL_LOG_LEVEL_VERBOSE))
+    {
+        return;//Do not calculate the hash for nothing
+    }
+    
+    NSMutableDictionary* fields = [NSMutableDictionary dictionaryWithCapacity:4];
+    [fields setValue:tokenType forKey:@"tokenType"];
+    [fields setValue:[self getHash:token] forKey:@"hash"];
+    [fields setValue:expiresOn forKey:@"expiresOn"];
+    [fields setValue:[correlationId UUIDString] forKey:@"correlationId"];
+    [self log:ADAL_LOG_LEVEL_VERBOSE message:@"Token returned" errorCode:AD_ERROR_SUCCEEDED additionalInformation:nil fields:fields];
 }
 
 @end
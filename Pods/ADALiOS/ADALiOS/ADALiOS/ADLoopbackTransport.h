@@ -0,0 +1,66 @@
+// Copyright © Microsoft Open Technologies, Inc.
+//
+// All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS
+// OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION
+// ANY IMPLIED WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A
+// PARTICULAR PURPOSE, MERCHANTABILITY OR NON-INFRINGEMENT.
+//
+// See the Apache License, Version 2.0 for the specific language
+// governing permissions and limitations under the License.
+
+#import "ADHTTPTransport.h"
+
+/*! An in-process HTTP transport, which replays canned responses instead of going to the network. Useful for
+ load testing of the acquireToken flows and for measuring the library overhead without a live tenant:
+ 
+    ADLoopbackTransport* transport = [ADLoopbackTransport new];
+    transport.latency = 0.05;
+    [transport addDiscoveryResponse];
+    [transport addTokenResponseForAuthority:authority resource:resource];
+    [ADAuthenticationSettings sharedInstance].httpTransport = transport;
+ 
+ The responses are matched by URL prefix; the most recently added match wins. Requests, which do not
+ match any response, are answered with HTTP 404. The class is thread-safe. */
+@interface ADLoopbackTransport : NSObject<ADHTTPTransport>
+
+/*! The delay (in seconds) before each response is delivered. Default is 0. */
+@property NSTimeInterval latency;
+
+/*! The number of the requests received so far. */
+@property (readonly) NSUInteger requestCount;
+
+/*! Adds a canned response.
+ @param urlPrefix: The response is returned for all requests, whose URL starts with this string.
+ @param statusCode: The HTTP status code of the response.
+ @param headers: The HTTP headers of the response. May be nil.
+ @param body: The body of the response. May be nil. */
+-(void) addResponseForURLPrefix: (NSString*) urlPrefix
+                     statusCode: (NSInteger) statusCode
+                        headers: (NSDictionary*) headers
+                           body: (NSData*) body;
+
+/*! Adds a successful token endpoint response for the authority, with access and refresh tokens for the
+ resource, which expire in an hour. */
+-(void) addTokenResponseForAuthority: (NSString*) authority
+                            resource: (NSString*) resource;
+
+/*! Adds a successful authority validation response. */
+-(void) addDiscoveryResponse;
+
+/*! Adds a 401 challenge response for the resource, pointing to the authority, as used by
+ ADAuthenticationParameters' parametersFromResourceUrl. */
+-(void) addChallengeResponseForResourceUrl: (NSString*) resourceUrl
+                                 authority: (NSString*) authority;
+
+/*! Removes all of the canned responses. */
+-(void) removeAllResponses;
+
+@end
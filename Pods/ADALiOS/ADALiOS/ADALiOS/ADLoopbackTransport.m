@@ -0,0 +1,188 @@
+// Copyright © Microsoft Open Technologies, Inc.
+//
+// All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS
+// OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION
+// ANY IMPLIED WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A
+// PARTICULAR PURPOSE, MERCHANTABILITY OR NON-INFRINGEMENT.
+//
+// See the Apache License, Version 2.0 for the specific language
+// governing permissions and limitations under the License.
+
+#import "ADALiOS.h"
+#import "ADLoopbackTransport.h"
+#import "ADOAuth2Constants.h"
+
+extern NSString* const sTrustedAuthority;
+extern NSString* const sTenantDiscoveryEndpoint;
+
+//A canned response:
+@interface ADLoopbackResponse : NSObject
+
+@property NSString* urlPrefix;
+@property NSInteger statusCode;
+@property NSDictionary* headers;
+@property NSData* body;
+
+@end
+
+@implementation ADLoopbackResponse
+@end
+
+//Identifies a request in flight, as returned by sendRequest:
+@interface ADLoopbackRequest : NSObject
+
+@property BOOL cancelled;
+
+@end
+
+@implementation ADLoopbackRequest
+@end
+
+@implementation ADLoopbackTransport
+{
+    NSMutableArray* mResponses;
+}
+
+-(id) init
+{
+    self = [super init];
+    if (self)
+    {
+        mResponses = [NSMutableArray new];
+    }
+    return self;
+}
+
+-(void) addResponseForURLPrefix: (NSString*) urlPrefix
+                     statusCode: (NSInteger) statusCode
+                        headers: (NSDictionary*) headers
+                           body: (NSData*) body
+{
+    THROW_ON_NIL_EMPTY_ARGUMENT(urlPrefix);
+    
+    ADLoopbackResponse* response = [ADLoopbackResponse new];
+    response.urlPrefix = urlPrefix.lowercaseString;
+    response.statusCode = statusCode;
+    response.headers = headers;
+    response.body = body;
+    @synchronized(self)
+    {
+        [mResponses addObject:response];
+    }
+}
+
+-(void) addJSONResponseForURLPrefix: (NSString*) urlPrefix
+                         statusCode: (NSInteger) statusCode
+                           contents: (NSDictionary*) contents
+{
+    [self addResponseForURLPrefix:urlPrefix
+                       statusCode:statusCode
+                          headers:@{ @"Content-Type":@"application/json" }
+                             body:[NSJSONSerialization dataWithJSONObject:contents options:0 error:nil]];
+}
+
+-(void) addTokenResponseForAuthority: (NSString*) authority
+                            resource: (NSString*) resource
+{
+    THROW_ON_NIL_EMPTY_ARGUMENT(authority);
+    
+    NSMutableDictionary* contents = [NSMutableDictionary dictionaryWithDictionary:
+                                     @{
+                                       OAUTH2_ACCESS_TOKEN:[[NSUUID UUID] UUIDString],
+                                       OAUTH2_REFRESH_TOKEN:[[NSUUID UUID] UUIDString],
+                                       OAUTH2_TOKEN_TYPE:@"Bearer",
+                                       OAUTH2_EXPIRES_IN:@"3600",
+                                       }];
+    if (resource)
+    {
+        [contents setObject:resource forKey:OAUTH2_RESOURCE];
+    }
+    [self addJSONResponseForURLPrefix:[authority stringByAppendingString:OAUTH2_TOKEN_SUFFIX]
+                           statusCode:200
+                             contents:contents];
+}
+
+-(void) addDiscoveryResponse
+{
+    [self addJSONResponseForURLPrefix:[NSString stringWithFormat:@"%@/%@", sTrustedAuthority, OAUTH2_INSTANCE_DISCOVERY_SUFFIX]
+                           statusCode:200
+                             contents:@{ sTenantDiscoveryEndpoint:[sTrustedAuthority stringByAppendingString:@"/common/.well-known/openid-configuration"] }];
+}
+
+-(void) addChallengeResponseForResourceUrl: (NSString*) resourceUrl
+                                 authority: (NSString*) authority
+{
+    THROW_ON_NIL_EMPTY_ARGUMENT(authority);
+    
+    NSString* challenge = [NSString stringWithFormat:@"Bearer authorization_uri=\"%@\"", authority];
+    [self addResponseForURLPrefix:resourceUrl
+                       statusCode:401
+                          headers:@{ @"WWW-Authenticate":challenge }
+                             body:nil];
+}
+
+-(void) removeAllResponses
+{
+    @synchronized(self)
+    {
+        [mResponses removeAllObjects];
+    }
+}
+
+-(id) sendRequest: (NSURLRequest*) request
+completionHandler: (ADHTTPTransportCallback) completionHandler
+{
+    THROW_ON_NIL_ARGUMENT(completionHandler);
+    
+    NSString* url = request.URL.absoluteString.lowercaseString;
+    ADLoopbackResponse* canned = nil;
+    NSTimeInterval latency;
+    @synchronized(self)
+    {
+        ++_requestCount;
+        latency = self.latency;
+        for(ADLoopbackResponse* response in mResponses.reverseObjectEnumerator)
+        {
+            if ([url hasPrefix:response.urlPrefix])
+            {
+                canned = response;
+                break;
+            }
+        }
+    }
+    
+    NSInteger statusCode = (canned) ? canned.statusCode : 404;
+    NSHTTPURLResponse* response = [[NSHTTPURLResponse alloc] initWithURL:request.URL
+                                                              statusCode:statusCode
+                                                             HTTPVersion:@"HTTP/1.1"
+                                                            headerFields:canned.headers];
+    NSData* body = (canned.body) ? canned.body : [NSData data];
+    
+    ADLoopbackRequest* handle = [ADLoopbackRequest new];
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(latency * NSEC_PER_SEC)),
+                   dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^
+                   {
+                       if (handle.cancelled)
+                       {
+                           completionHandler([NSError errorWithDomain:NSURLErrorDomain code:NSURLErrorCancelled userInfo:nil], nil, nil);
+                           return;
+                       }
+                       completionHandler(nil, response, body);
+                   });
+    return handle;
+}
+
+-(void) cancelRequest: (id) request
+{
+    ((ADLoopbackRequest*)request).cancelled = YES;
+}
+
+@end
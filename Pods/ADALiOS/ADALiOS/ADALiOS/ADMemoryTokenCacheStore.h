@@ -0,0 +1,41 @@
+// Copyright © Microsoft Open Technologies, Inc.
+//
+// All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS
+// OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION
+// ANY IMPLIED WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A
+// PARTICULAR PURPOSE, MERCHANTABILITY OR NON-INFRINGEMENT.
+//
+// See the Apache License, Version 2.0 for the specific language
+// governing permissions and limitations under the License.
+
+#import "ADTokenCacheStoring.h"
+
+@class ADKeychainTokenCacheStore;
+
+/*! A write-through, in-memory token cache store, layered on top of the keychain cache store.
+ Reads are served from memory after the first keychain lookup for a given key; all modifications
+ are written to the keychain first and then reflected in memory. The in-memory copy is dropped
+ whenever the keychain store reports modifications that did not go through this object (see
+ ADKeychainTokenCacheStore's "generation" property). The class is thread-safe; the keychain I/O is
+ done outside of its lock, so the memory hits are not blocked by the keychain access of other threads. */
+@interface ADMemoryTokenCacheStore : NSObject<ADTokenCacheStoring>
+
+/*! Initializes the store on top of the passed keychain store.
+ @param store: Required. The persistent store which holds the actual cache items. */
+-(id) initWithStore: (ADKeychainTokenCacheStore*) store;
+
+/*! The persistent store, wrapped by this object. */
+@property (readonly) ADKeychainTokenCacheStore* store;
+
+/*! Drops all of the items cached in memory. The persisted items are not affected. */
+-(void) flush;
+
+@end
@@ -0,0 +1,373 @@
+// Copyright © Microsoft Open Technologies, Inc.
+//
+// All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS
+// OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION
+// ANY IMPLIED WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A
+// PARTICULAR PURPOSE, MERCHANTABILITY OR NON-INFRINGEMENT.
+//
+// See the Apache License, Version 2.0 for the specific language
+// governing permissions and limitations under the License.
+
+#import "ADALiOS.h"
+#import "ADMemoryTokenCacheStore.h"
+#import "ADKeychainTokenCacheStore.h"
+#import "ADTokenCacheStoreItem.h"
+#import "ADTokenCacheStoreKey.h"
+#import "ADUserInformation.h"
+
+extern NSString* const sMultiUserError;
+
+NSString* const sMemoryCacheLog = @"Memory token cache store";
+
+//The user key of the items that do not have user information. Normalized user ids cannot be empty:
+static NSString* const sNoUserKey = @"";
+
+@implementation ADMemoryTokenCacheStore
+{
+    //Maps ADTokenCacheStoreKey objects to dictionaries of user key -> ADTokenCacheStoreItem.
+    //An entry always contains all of the persisted items for its key, so that the lookups
+    //without userId can be served from memory too.
+    NSMutableDictionary* mEntries;
+
+    //The generation of the keychain store, which the entries correspond to. The lock of the object
+    //guards only the in-memory state: the keychain reads and writes are done outside of it, and
+    //their results are installed only if the generation has not moved in the meantime.
+    uint64_t mGeneration;
+}
+
+//Shouldn't be called.
+-(id) init
+{
+    [super doesNotRecognizeSelector:_cmd];
+    return nil;
+}
+
+-(id) initWithStore: (ADKeychainTokenCacheStore*) store
+{
+    THROW_ON_NIL_ARGUMENT(store);
+
+    self = [super init];
+    if (self)
+    {
+        _store = store;
+        mEntries = [NSMutableDictionary new];
+        mGeneration = store.generation;
+    }
+    return self;
+}
+
++(NSString*) userKeyFromItem: (ADTokenCacheStoreItem*) item
+{
+    NSString* userId = item.userInformation.userId;
+    return userId ? userId : sNoUserKey;
+}
+
+//Drops all entries if the keychain store was modified without going through this object.
+//The method is not thread-safe.
+-(void) checkGeneration
+{
+    uint64_t generation = _store.generation;
+    if (generation != mGeneration)
+    {
+        AD_LOG_VERBOSE(sMemoryCacheLog, @"The keychain store has been modified. Dropping the cached items.");
+        [mEntries removeAllObjects];
+        mGeneration = generation;
+    }
+}
+
+//Returns a snapshot of the cached items for the key, reading them from the keychain if needed.
+//Returns nil in case of error. The keychain is read outside of the lock; the items read are
+//cached only if nothing was written since the read started, otherwise the next read retries.
+-(NSDictionary*) entryWithKey: (ADTokenCacheStoreKey*) key
+                        error: (ADAuthenticationError* __autoreleasing*) error
+{
+    uint64_t generation;
+    @synchronized(self)
+    {
+        [self checkGeneration];
+        NSDictionary* entry = [mEntries objectForKey:key];
+        if (entry)
+        {
+            return [entry copy];
+        }
+        generation = mGeneration;
+    }
+
+    NSArray* items = [_store getItemsWithKey:key error:error];
+    if (!items)
+    {
+        return nil;
+    }
+
+    NSMutableDictionary* entry = [[NSMutableDictionary alloc] initWithCapacity:items.count];
+    for(ADTokenCacheStoreItem* item in items)
+    {
+        [entry setObject:item forKey:[self.class userKeyFromItem:item]];
+    }
+    @synchronized(self)
+    {
+        if (generation == mGeneration && generation == _store.generation && ![mEntries objectForKey:key])
+        {
+            [mEntries setObject:[entry mutableCopy] forKey:key];
+        }
+    }
+    return entry;
+}
+
+//From ADTokenCacheStoring protocol
+-(NSArray*) allItemsWithError:(ADAuthenticationError *__autoreleasing *)error
+{
+    //Full enumeration is rare, so it is not cached:
+    return [_store allItemsWithError:error];
+}
+
+//From ADTokenCacheStoring protocol
+-(ADTokenCacheStoreItem*) getItemWithKey: (ADTokenCacheStoreKey*)key
+                                  userId: (NSString*) userId
+                                   error: (ADAuthenticationError* __autoreleasing*) error
+{
+    API_ENTRY;
+    RETURN_NIL_ON_NIL_ARGUMENT(key);
+
+    userId = [ADUserInformation normalizeUserId:userId];
+    NSDictionary* entry = [self entryWithKey:key error:error];
+    if (!entry)
+    {
+        return nil;
+    }
+
+    ADTokenCacheStoreItem* item = nil;
+    if (userId)
+    {
+        item = [entry objectForKey:userId];
+    }
+    else if (entry.count > 1)
+    {
+        ADAuthenticationError* adError = [ADAuthenticationError errorFromAuthenticationError:AD_ERROR_MULTIPLE_USERS
+                                                                                protocolCode:nil
+                                                                                errorDetails:sMultiUserError];
+        if (error)
+        {
+            *error = adError;
+        }
+        return nil;
+    }
+    else
+    {
+        item = entry.allValues.firstObject;
+    }
+
+    //The callers are allowed to modify the returned items:
+    return [item copy];
+}
+
+//From ADTokenCacheStoring protocol
+-(NSArray*) getItemsWithKey: (ADTokenCacheStoreKey*)key
+                      error: (ADAuthenticationError* __autoreleasing*) error
+{
+    API_ENTRY;
+    RETURN_NIL_ON_NIL_ARGUMENT(key);
+
+    NSArray* items = [self entryWithKey:key error:error].allValues;
+    if (!items)
+    {
+        return nil;
+    }
+
+    NSMutableArray* toReturn = [[NSMutableArray alloc] initWithCapacity:items.count];
+    for(ADTokenCacheStoreItem* item in items)
+    {
+        [toReturn addObject:[item copy]];
+    }
+    return toReturn;
+}
+
+//From ADTokenCacheStoring protocol
+-(void) addOrUpdateItem: (ADTokenCacheStoreItem*) item
+                  error: (ADAuthenticationError* __autoreleasing*) error
+{
+    API_ENTRY;
+    ADTokenCacheStoreKey* key = [item extractKeyWithError:error];
+    if (!key)
+    {
+        return;
+    }
+
+    uint64_t generation;
+    @synchronized(self)
+    {
+        [self checkGeneration];
+        generation = mGeneration;
+    }
+
+    ADAuthenticationError* adError = nil;
+    [_store addOrUpdateItem:item error:&adError];
+
+    @synchronized(self)
+    {
+        NSMutableDictionary* entry = [mEntries objectForKey:key];
+        if (adError || generation != mGeneration || _store.generation != generation + 1)
+        {
+            //Either the write failed, or somebody else wrote in parallel. Let the next read
+            //drop everything and go to the keychain:
+            [mEntries removeObjectForKey:key];
+        }
+        else
+        {
+            //Only our own write happened, the rest of the entries are still valid:
+            mGeneration = generation + 1;
+            //The caller may modify the item after the call, so keep a copy:
+            [entry setObject:[item copy] forKey:[self.class userKeyFromItem:item]];
+        }
+    }
+
+    if (error && adError)
+    {
+        *error = adError;
+    }
+}
+
+//From ADTokenCacheStoring protocol
+-(BOOL) addOrUpdateItems: (NSArray*) items
+                failures: (NSDictionary* __autoreleasing*) failures
+                   error: (ADAuthenticationError* __autoreleasing*) error
+{
+    API_ENTRY;
+    uint64_t generation;
+    @synchronized(self)
+    {
+        [self checkGeneration];
+        generation = mGeneration;
+    }
+    
+    NSDictionary* itemFailures = nil;
+    BOOL succeeded = [_store addOrUpdateItems:items failures:&itemFailures error:error];
+    
+    @synchronized(self)
+    {
+        //The keychain store bumps the generation once per batch, if any of the items was written. Without
+        //a bump, nothing was written and the failed items are dropped below:
+        uint64_t current = _store.generation;
+        BOOL adopt = (generation == mGeneration && current == generation + 1);
+        if (adopt)
+        {
+            mGeneration = current;
+        }
+        for(NSUInteger i = 0; i < items.count; ++i)
+        {
+            ADTokenCacheStoreItem* item = [items objectAtIndex:i];
+            ADTokenCacheStoreKey* key = [item extractKeyWithError:nil];
+            if (!key)
+            {
+                continue;
+            }
+            if (adopt && ![itemFailures objectForKey:@(i)])
+            {
+                [[mEntries objectForKey:key] setObject:[item copy] forKey:[self.class userKeyFromItem:item]];
+            }
+            else
+            {
+                [mEntries removeObjectForKey:key];
+            }
+        }
+    }
+    
+    if (failures)
+    {
+        *failures = itemFailures;
+    }
+    return succeeded;
+}
+
+//From ADTokenCacheStoring protocol
+-(BOOL) removeItemsWithKeys: (NSArray*) keys
+                     userId: (NSString*) userId
+                   failures: (NSDictionary* __autoreleasing*) failures
+                      error: (ADAuthenticationError* __autoreleasing*) error
+{
+    API_ENTRY;
+    BOOL succeeded = [_store removeItemsWithKeys:keys userId:userId failures:failures error:error];
+    @synchronized(self)
+    {
+        [mEntries removeObjectsForKeys:keys];
+    }
+    return succeeded;
+}
+
+//From ADTokenCacheStoring protocol
+-(NSArray*) itemsWithUserId: (NSString*) userId
+                      error: (ADAuthenticationError* __autoreleasing*) error
+{
+    //The keychain store answers these from its own index:
+    return [_store itemsWithUserId:userId error:error];
+}
+
+//From ADTokenCacheStoring protocol
+-(NSArray*) itemsWithAuthority: (NSString*) authority
+                      clientId: (NSString*) clientId
+                         error: (ADAuthenticationError* __autoreleasing*) error
+{
+    return [_store itemsWithAuthority:authority clientId:clientId error:error];
+}
+
+//From ADTokenCacheStoring protocol
+-(void) removeItemsWithUserId: (NSString*) userId
+                        error: (ADAuthenticationError* __autoreleasing*) error
+{
+    API_ENTRY;
+    [_store removeItemsWithUserId:userId error:error];
+    @synchronized(self)
+    {
+        //The entries are per key and may contain other users too, so just reload on the next read:
+        [mEntries removeAllObjects];
+    }
+}
+
+//From ADTokenCacheStoring protocol
+-(void) removeItemWithKey: (ADTokenCacheStoreKey*) key
+                   userId: (NSString*) userId
+                    error: (ADAuthenticationError* __autoreleasing*) error
+{
+    API_ENTRY;
+    if (!key)
+    {
+        return;
+    }
+
+    [_store removeItemWithKey:key userId:userId error:error];
+    @synchronized(self)
+    {
+        //Removals are rare, so just reload the key on the next read. The generation
+        //is intentionally not updated here; the next check will drop the rest too:
+        [mEntries removeObjectForKey:key];
+    }
+}
+
+//From ADTokenCacheStoring protocol
+-(void) removeAllWithError: (ADAuthenticationError* __autoreleasing*) error
+{
+    API_ENTRY;
+    [_store removeAllWithError:error];
+    @synchronized(self)
+    {
+        [mEntries removeAllObjects];
+    }
+}
+
+-(void) flush
+{
+    @synchronized(self)
+    {
+        [mEntries removeAllObjects];
+    }
+}
+
+@end
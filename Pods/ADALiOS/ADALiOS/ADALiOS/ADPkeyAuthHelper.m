@@ -22,7 +22,7 @@
 #import "ADRegistrationInformation.h"
 #import "NSString+ADHelperMethods.h"
 #import "ADWorkPlaceJoin.h"
-#import "ADLogger.h"
+#import "ADLogger+Internal.h"
 #import "ADErrorCodes.h"
 
 @implementation ADPkeyAuthHelper
@@ -207,7 +207,7 @@
                                     signedHashBytes,
                                     &signedHashBytesSize);
     
-    [ADLogger log:ADAL_LOG_LEVEL_INFO message:@"Status returned from data signing - " errorCode:status additionalInformation:nil ];
+    AD_LOG(ADAL_LOG_LEVEL_INFO, @"Status returned from data signing - ", status, nil);
     signedHash = [NSData dataWithBytes:signedHashBytes
                                 length:(NSUInteger)signedHashBytesSize];
     
@@ -0,0 +1,55 @@
+// Copyright © Microsoft Open Technologies, Inc.
+//
+// All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS
+// OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION
+// ANY IMPLIED WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A
+// PARTICULAR PURPOSE, MERCHANTABILITY OR NON-INFRINGEMENT.
+//
+// See the Apache License, Version 2.0 for the specific language
+// governing permissions and limitations under the License.
+
+#import <Foundation/Foundation.h>
+
+@class ADTraceSpan;
+
+/*! The state of a single authentication operation, e.g. of one acquireToken call. The context is created
+ when the operation starts and is passed explicitly along its asynchronous chain, so that the concurrent
+ operations do not share any mutable state. The object is immutable. */
+@interface ADRequestContext : NSObject
+
+/*! The correlation id, sent with all of the requests of the operation. */
+@property (readonly) NSUUID* correlationId;
+
+/*! The span of the current stage of the operation. Nil if tracing is disabled. */
+@property (readonly) ADTraceSpan* span;
+
+/*! Creates the context of a new operation.
+ @param correlationId: The correlation id, provided by the developer. If nil, a new one is generated. */
++(ADRequestContext*) contextWithCorrelationId: (NSUUID*) correlationId;
+
+/*! Returns a context of the same operation, whose stages are recorded under the passed span. */
+-(ADRequestContext*) contextWithSpan: (ADTraceSpan*) span;
+
+/*! Returns the context, which is current on the calling thread (see AD_REQUEST_CONTEXT_SCOPE), or nil.
+ Used by the logging, so that the records carry the correlation id of their operation. */
++(ADRequestContext*) currentContext;
+
+@end
+
+//Helpers of AD_REQUEST_CONTEXT_SCOPE, should not be called directly:
+void* ADRequestContextEnter(ADRequestContext* context);
+void ADRequestContextLeave(void** previous);
+
+/*! Makes the context current on the calling thread until the end of the enclosing scope. Should be placed
+ at the start of the methods and the asynchronous blocks of the operation. The scopes can be nested;
+ the previous context is restored on all paths out of the scope, including the early returns. */
+#define AD_REQUEST_CONTEXT_SCOPE(CONTEXT) \
+__attribute__((cleanup(ADRequestContextLeave), unused)) void* _adPreviousContext = ADRequestContextEnter(CONTEXT)
@@ -0,0 +1,88 @@
+// Copyright © Microsoft Open Technologies, Inc.
+//
+// All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS
+// OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION
+// ANY IMPLIED WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A
+// PARTICULAR PURPOSE, MERCHANTABILITY OR NON-INFRINGEMENT.
+//
+// See the Apache License, Version 2.0 for the specific language
+// governing permissions and limitations under the License.
+
+#import "ADALiOS.h"
+#import "ADRequestContext.h"
+#include <pthread.h>
+
+//Holds the unretained pointer to the current context of the thread. The scopes do not outlive
+//the methods and blocks, which own the context, so it cannot be released while current:
+static pthread_key_t sCurrentContextKey;
+
+static pthread_key_t currentContextKey()
+{
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        pthread_key_create(&sCurrentContextKey, NULL);
+    });
+    return sCurrentContextKey;
+}
+
+void* ADRequestContextEnter(ADRequestContext* context)
+{
+    pthread_key_t key = currentContextKey();
+    void* previous = pthread_getspecific(key);
+    pthread_setspecific(key, (__bridge void*)context);
+    return previous;
+}
+
+void ADRequestContextLeave(void** previous)
+{
+    pthread_setspecific(currentContextKey(), *previous);
+}
+
+@implementation ADRequestContext
+
+-(id) init
+{
+    [super doesNotRecognizeSelector:_cmd];
+    return nil;
+}
+
+-(id) initWithCorrelationId: (NSUUID*) correlationId
+                       span: (ADTraceSpan*) span
+{
+    self = [super init];
+    if (self)
+    {
+        _correlationId = correlationId;
+        _span = span;
+    }
+    return self;
+}
+
++(ADRequestContext*) contextWithCorrelationId: (NSUUID*) correlationId
+{
+    return [[self alloc] initWithCorrelationId:(correlationId) ? correlationId : [NSUUID UUID] span:nil];
+}
+
+-(ADRequestContext*) contextWithSpan: (ADTraceSpan*) span
+{
+    if (span == _span)
+    {
+        return self;
+    }
+    return [[ADRequestContext alloc] initWithCorrelationId:_correlationId span:span];
+}
+
++(ADRequestContext*) currentContext
+{
+    return (__bridge ADRequestContext*)pthread_getspecific(currentContextKey());
+}
+
+@end
@@ -0,0 +1,42 @@
+// Copyright © Microsoft Open Technologies, Inc.
+//
+// All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS
+// OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION
+// ANY IMPLIED WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A
+// PARTICULAR PURPOSE, MERCHANTABILITY OR NON-INFRINGEMENT.
+//
+// See the Apache License, Version 2.0 for the specific language
+// governing permissions and limitations under the License.
+
+#import <Foundation/Foundation.h>
+
+@class ADTokenCacheStoreItem;
+@class ADAuthenticationError;
+
+/*! Converts token cache items to and from the compact binary format, used for persisting them.
+ The format is versioned: a short header is followed by length-prefixed fields, so the decoding
+ requires a single pass over the data without any intermediate objects. Unlike the NSKeyedArchiver
+ representation, the field names and class information are not stored. The class is thread-safe. */
+@interface ADTokenCacheItemSerializer : NSObject
+
+/*! Returns the binary representation of the item. */
++(NSData*) dataFromItem: (ADTokenCacheStoreItem*) item;
+
+/*! Restores the item from its binary representation, as returned by dataFromItem. Returns nil
+ and sets the error if the data is not in the expected format. */
++(ADTokenCacheStoreItem*) itemFromData: (NSData*) data
+                                 error: (ADAuthenticationError* __autoreleasing*) error;
+
+/*! Returns YES, if the data starts with the header of the binary format. Used to tell apart the
+ data written by the previous versions of the library. */
++(BOOL) isSerializedItem: (NSData*) data;
+
+@end
@@ -0,0 +1,275 @@
+// Copyright © Microsoft Open Technologies, Inc.
+//
+// All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS
+// OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION
+// ANY IMPLIED WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A
+// PARTICULAR PURPOSE, MERCHANTABILITY OR NON-INFRINGEMENT.
+//
+// See the Apache License, Version 2.0 for the specific language
+// governing permissions and limitations under the License.
+
+#import <libkern/OSByteOrder.h>
+#import "ADALiOS.h"
+#import "ADTokenCacheItemSerializer.h"
+#import "ADTokenCacheStoreItem.h"
+#import "ADUserInformation.h"
+#import "ADUserInformation+Internal.h"
+
+//The layout of the data (all integers are little endian):
+//  header:  4 bytes magic, 1 byte format version
+//  fields:  resource, authority, clientId, accessToken, accessTokenType, refreshToken (string each)
+//           expiresOn (1 byte presence flag + 8 bytes time interval since 1970, as IEEE double)
+//           user (1 byte presence flag + userId (string), 1 byte userIdDisplayable, rawIdToken (string),
+//           claims (JSON bytes; nil when rawIdToken is set, as they are decoded from it))
+//A string or bytes field is a 4 byte length, followed by the UTF-8 bytes; sNilLength marks nil.
+//Later versions may only append fields; the decoder ignores any trailing data.
+static const uint8_t sMagic[4] = { 'A', 'D', 'C', 'I' };
+static const uint8_t sFormatVersion = 1;
+static const uint32_t sNilLength = UINT32_MAX;
+
+NSString* const sSerializerLog = @"Token cache item serializer";
+
+//Reading position in the data being decoded:
+typedef struct
+{
+    const uint8_t* current;
+    const uint8_t* end;
+} ADReader;
+
+static inline void WriteUInt8(NSMutableData* data, uint8_t value)
+{
+    [data appendBytes:&value length:sizeof(value)];
+}
+
+static inline void WriteBytes(NSMutableData* data, const void* bytes, NSUInteger length)
+{
+    uint32_t prefix = OSSwapHostToLittleInt32((uint32_t)length);
+    [data appendBytes:&prefix length:sizeof(prefix)];
+    [data appendBytes:bytes length:length];
+}
+
+static inline void WriteString(NSMutableData* data, NSString* string)
+{
+    if (!string)
+    {
+        uint32_t prefix = OSSwapHostToLittleInt32(sNilLength);
+        [data appendBytes:&prefix length:sizeof(prefix)];
+        return;
+    }
+    const char* utf8 = string.UTF8String;
+    WriteBytes(data, utf8, strlen(utf8));
+}
+
+static inline BOOL ReadUInt8(ADReader* reader, uint8_t* value)
+{
+    if (reader->end - reader->current < (ptrdiff_t)sizeof(*value))
+    {
+        return NO;
+    }
+    *value = *reader->current++;
+    return YES;
+}
+
+//Reads the length prefix and returns the pointer to the bytes that follow. Sets "bytes" to NULL for nil fields.
+static inline BOOL ReadBytes(ADReader* reader, const uint8_t** bytes, uint32_t* length)
+{
+    uint32_t prefix;
+    if (reader->end - reader->current < (ptrdiff_t)sizeof(prefix))
+    {
+        return NO;
+    }
+    memcpy(&prefix, reader->current, sizeof(prefix));
+    reader->current += sizeof(prefix);
+    prefix = OSSwapLittleToHostInt32(prefix);
+    if (sNilLength == prefix)
+    {
+        *bytes = NULL;
+        *length = 0;
+        return YES;
+    }
+    if (reader->end - reader->current < (ptrdiff_t)prefix)
+    {
+        return NO;
+    }
+    *bytes = reader->current;
+    *length = prefix;
+    reader->current += prefix;
+    return YES;
+}
+
+static inline BOOL ReadString(ADReader* reader, NSString* __autoreleasing* string)
+{
+    const uint8_t* bytes;
+    uint32_t length;
+    if (!ReadBytes(reader, &bytes, &length))
+    {
+        return NO;
+    }
+    if (!bytes)
+    {
+        *string = nil;
+        return YES;
+    }
+    *string = [[NSString alloc] initWithBytes:bytes length:length encoding:NSUTF8StringEncoding];
+    return (nil != *string);
+}
+
+@implementation ADTokenCacheItemSerializer
+
++(BOOL) isSerializedItem: (NSData*) data
+{
+    return data.length > sizeof(sMagic) && !memcmp(data.bytes, sMagic, sizeof(sMagic));
+}
+
++(NSData*) dataFromItem: (ADTokenCacheStoreItem*) item
+{
+    RETURN_NIL_ON_NIL_ARGUMENT(item);
+    
+    //The tokens dominate the size, so reserve enough for them upfront:
+    NSMutableData* data = [[NSMutableData alloc] initWithCapacity:64 + item.accessToken.length + item.refreshToken.length
+                                                                    + item.userInformation.rawIdToken.length * 2];
+    [data appendBytes:sMagic length:sizeof(sMagic)];
+    WriteUInt8(data, sFormatVersion);
+    
+    WriteString(data, item.resource);
+    WriteString(data, item.authority);
+    WriteString(data, item.clientId);
+    WriteString(data, item.accessToken);
+    WriteString(data, item.accessTokenType);
+    WriteString(data, item.refreshToken);
+    
+    WriteUInt8(data, item.expiresOn ? 1 : 0);
+    if (item.expiresOn)
+    {
+        Float64 interval = [item.expiresOn timeIntervalSince1970];
+        uint64_t bits;
+        memcpy(&bits, &interval, sizeof(bits));
+        bits = OSSwapHostToLittleInt64(bits);
+        [data appendBytes:&bits length:sizeof(bits)];
+    }
+    
+    ADUserInformation* user = item.userInformation;
+    WriteUInt8(data, user ? 1 : 0);
+    if (user)
+    {
+        WriteString(data, user.userId);
+        WriteUInt8(data, user.userIdDisplayable ? 1 : 0);
+        WriteString(data, user.rawIdToken);
+        //The claims are derived from the id_token on demand, so they are stored only without one:
+        NSDictionary* allClaims = (user.rawIdToken) ? nil : user.allClaims;
+        NSData* claims = (allClaims) ? [NSJSONSerialization dataWithJSONObject:allClaims options:0 error:nil] : nil;
+        if (claims)
+        {
+            WriteBytes(data, claims.bytes, claims.length);
+        }
+        else
+        {
+            WriteString(data, nil);
+        }
+    }
+    
+    return data;
+}
+
++(ADTokenCacheStoreItem*) itemFromData: (NSData*) data
+                                 error: (ADAuthenticationError* __autoreleasing*) error
+{
+    RETURN_NIL_ON_NIL_ARGUMENT(data);
+    
+    ADReader reader = { data.bytes, (const uint8_t*)data.bytes + data.length };
+    ADTokenCacheStoreItem* item = [ADTokenCacheStoreItem new];
+    NSString* resource, *authority, *clientId, *accessToken, *accessTokenType, *refreshToken;
+    uint8_t version = 0;
+    uint8_t hasExpiration = 0;
+    uint8_t hasUser = 0;
+    
+    BOOL valid = [self isSerializedItem:data];
+    if (valid)
+    {
+        reader.current += sizeof(sMagic);
+        valid = ReadUInt8(&reader, &version) && version >= sFormatVersion
+            && ReadString(&reader, &resource)
+            && ReadString(&reader, &authority)
+            && ReadString(&reader, &clientId)
+            && ReadString(&reader, &accessToken)
+            && ReadString(&reader, &accessTokenType)
+            && ReadString(&reader, &refreshToken)
+            && ReadUInt8(&reader, &hasExpiration);
+    }
+    
+    if (valid && hasExpiration)
+    {
+        uint64_t bits;
+        valid = (reader.end - reader.current >= (ptrdiff_t)sizeof(bits));
+        if (valid)
+        {
+            memcpy(&bits, reader.current, sizeof(bits));
+            reader.current += sizeof(bits);
+            bits = OSSwapLittleToHostInt64(bits);
+            Float64 interval;
+            memcpy(&interval, &bits, sizeof(interval));
+            item.expiresOn = [NSDate dateWithTimeIntervalSince1970:interval];
+        }
+    }
+    
+    valid = valid && ReadUInt8(&reader, &hasUser);
+    if (valid && hasUser)
+    {
+        NSString* userId, *rawIdToken;
+        uint8_t displayable = 0;
+        const uint8_t* claimBytes;
+        uint32_t claimLength;
+        valid = ReadString(&reader, &userId) && userId.length
+            && ReadUInt8(&reader, &displayable)
+            && ReadString(&reader, &rawIdToken)
+            && ReadBytes(&reader, &claimBytes, &claimLength);
+        if (valid)
+        {
+            NSDictionary* claims = nil;
+            if (claimBytes)
+            {
+                NSData* claimData = [NSData dataWithBytesNoCopy:(void*)claimBytes length:claimLength freeWhenDone:NO];
+                claims = [NSJSONSerialization JSONObjectWithData:claimData options:0 error:nil];
+                valid = [claims isKindOfClass:[NSDictionary class]];
+            }
+            if (valid)
+            {
+                item.userInformation = [[ADUserInformation alloc] initWithUserId:userId
+                                                               userIdDisplayable:displayable != 0
+                                                                      rawIdToken:rawIdToken
+                                                                       allClaims:claims];
+            }
+        }
+    }
+    
+    if (!valid)
+    {
+        ADAuthenticationError* adError = [ADAuthenticationError errorFromAuthenticationError:AD_ERROR_BAD_CACHE_FORMAT
+                                                                               protocolCode:nil
+                                                                               errorDetails:@"The cache item data is not in the expected format."];
+        AD_LOG_WARN_F(sSerializerLog, @"Cannot decode the cache item. Format version: %d; data length: %lu", version, (unsigned long)data.length);
+        if (error)
+        {
+            *error = adError;
+        }
+        return nil;
+    }
+    
+    item.resource = resource;
+    item.authority = authority;
+    item.clientId = clientId;
+    item.accessToken = accessToken;
+    item.accessTokenType = accessTokenType;
+    item.refreshToken = refreshToken;
+    return item;
+}
+
+@end
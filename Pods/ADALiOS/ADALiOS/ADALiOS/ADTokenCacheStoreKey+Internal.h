@@ -0,0 +1,35 @@
+// Copyright © Microsoft Open Technologies, Inc.
+//
+// All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS
+// OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION
+// ANY IMPLIED WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A
+// PARTICULAR PURPOSE, MERCHANTABILITY OR NON-INFRINGEMENT.
+//
+// See the Apache License, Version 2.0 for the specific language
+// governing permissions and limitations under the License.
+
+#import "ADTokenCacheStoreKey.h"
+
+/* Internally accessible methods.*/
+@interface ADTokenCacheStoreKey (Internal)
+
+/*! Returns the keychain service key, previously memoized for this cache key with the same prefix,
+ or nil if it has not been memoized yet. See setKeychainKey:prefix: */
+-(NSString*) keychainKeyWithPrefix: (NSString*) prefix;
+
+/*! Memoizes the keychain service key of this cache key. As the cache key is immutable, the keychain
+ store computes the service key once and reuses it for all of the lookups and writes.
+ @param keychainKey: The service key, built by the keychain store.
+ @param prefix: The library string the service key was built with. */
+-(void) setKeychainKey: (NSString*) keychainKey
+                prefix: (NSString*) prefix;
+
+@end
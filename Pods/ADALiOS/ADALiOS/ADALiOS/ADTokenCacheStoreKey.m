@@ -21,10 +21,33 @@
 #import "ADAuthenticationContext.h"
 #import "ADInstanceDiscovery.h"
 #import "ADTokenCacheStoreKey.h"
+#import "ADTokenCacheStoreKey+Internal.h"
 #import "NSString+ADHelperMethods.h"
 
+//The keys for the same (authority, resource, clientId) are interned, so that the values memoized
+//on them are reused across the calls. The pool is a bounded LRU, as the applications use a few such
+//triples: the least recently used key is dropped when the pool is full, so the hot keys stay interned.
+static NSMutableOrderedSet* sKeyPool = nil;
+static const NSUInteger sKeyPoolLimit = 64;
+
+@interface ADTokenCacheStoreKey ()
+
+//The memoized keychain keys, by the prefix they were built with. The dictionary is immutable and
+//replaced as a whole, so a single atomic load returns a consistent prefix and key:
+@property (atomic) NSDictionary* keychainKeys;
+
+@end
+
 @implementation ADTokenCacheStoreKey
 
++(void) initialize
+{
+    if (self == [ADTokenCacheStoreKey class])
+    {
+        sKeyPool = [NSMutableOrderedSet new];
+    }
+}
+
 -(id) init
 {
     //Use the custom init instead. This one will throw.
@@ -39,9 +62,9 @@
     self = [super init];
     if (self)
     {
-        //As the object is immutable we precalculate the hash:
-        hash = [[NSString stringWithFormat:@"##%@##%@##%@##", authority, resource, clientId]
-                    hash];
+        //As the object is immutable we precalculate the hash. The component hashes are combined
+        //directly, rather than hashing a formatted string:
+        hash = (authority.hash * 31 + resource.hash) * 31 + clientId.hash;
         _authority = authority;
         _resource = resource;
         _clientId = clientId;
@@ -65,8 +88,25 @@
     RETURN_NIL_ON_NIL_ARGUMENT(authority);//Canonicalization will return nil on empty or bad URL.
     RETURN_NIL_ON_NIL_EMPTY_ARGUMENT(clientId);
     
-    ADTokenCacheStoreKey* key = [ADTokenCacheStoreKey alloc];
-    return [key initWithAuthority:authority resource:resource clientId:clientId];
+    ADTokenCacheStoreKey* key = [[ADTokenCacheStoreKey alloc] initWithAuthority:authority resource:resource clientId:clientId];
+    @synchronized(sKeyPool)
+    {
+        NSUInteger index = [sKeyPool indexOfObject:key];
+        if (NSNotFound != index)
+        {
+            //Moves the key to the most recently used end:
+            ADTokenCacheStoreKey* interned = [sKeyPool objectAtIndex:index];
+            [sKeyPool removeObjectAtIndex:index];
+            [sKeyPool addObject:interned];
+            return interned;
+        }
+        if (sKeyPool.count >= sKeyPoolLimit)
+        {
+            [sKeyPool removeObjectAtIndex:0];
+        }
+        [sKeyPool addObject:key];
+    }
+    return key;
 }
 
 -(NSUInteger) hash
@@ -93,9 +133,24 @@
 
 -(id) copyWithZone:(NSZone*) zone
 {
-    return [[self.class allocWithZone:zone] initWithAuthority:[self.authority copyWithZone:zone]
-                                                     resource:[self.resource copyWithZone:zone]
-                                                     clientId:[self.clientId copyWithZone:zone]];
+    //The object is immutable, so the copies (e.g. the dictionary keys) share it and its memoized values:
+    return self;
+}
+
+@end
+
+@implementation ADTokenCacheStoreKey (Internal)
+
+-(NSString*) keychainKeyWithPrefix: (NSString*) prefix
+{
+    return [self.keychainKeys objectForKey:prefix];
+}
+
+-(void) setKeychainKey: (NSString*) keychainKey
+                prefix: (NSString*) prefix
+{
+    //The racing callers build the same key for the same prefix, so the last store wins harmlessly:
+    self.keychainKeys = @{ prefix:keychainKey };
 }
 
 @end
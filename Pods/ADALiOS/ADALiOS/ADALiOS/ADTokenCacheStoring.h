@@ -69,4 +69,54 @@
 /*! Clears the whole cache store. The method does not raise an error if there are no items in the cache. */
 -(void) removeAllWithError: (ADAuthenticationError* __autoreleasing*) error;
 
+@optional
+
+/*! Batch version of addOrUpdateItem. Stores all of the passed items as a single operation, which is
+ significantly cheaper than storing them one by one. If the array contains several items with the same
+ key and user, the last one is stored.
+ @param items: The ADTokenCacheStoreItem objects to store.
+ @param failures: Optional. Set to a dictionary, which maps the indices (NSNumber) of the items that could
+ not be stored to the corresponding ADAuthenticationError objects. Set to nil if all items were stored.
+ @param error: Optional. Set to the error of the first failed item, or to the error that prevented
+ the whole batch from being stored.
+ Returns YES if all of the items were stored. */
+-(BOOL) addOrUpdateItems: (NSArray*) items
+                failures: (NSDictionary* __autoreleasing*) failures
+                   error: (ADAuthenticationError* __autoreleasing*) error;
+
+/*! Batch version of removeItemWithKey. Removes the items for all of the passed keys as a single operation.
+ @param keys: The ADTokenCacheStoreKey objects of the items to remove.
+ @param userId: The user for which the items will be removed. Can be nil, in which case items for all users
+ with the specified keys will be removed.
+ @param failures: Optional. Set to a dictionary, which maps the indices (NSNumber) of the keys whose items
+ could not be removed to the corresponding ADAuthenticationError objects. Set to nil if there were no failures.
+ @param error: Optional. Set to the error of the first failed key, or to the error that prevented
+ the whole batch from being processed.
+ The method does not raise an error, if the items are not found. Returns YES if there were no failures. */
+-(BOOL) removeItemsWithKeys: (NSArray*) keys
+                     userId: (NSString*) userId
+                   failures: (NSDictionary* __autoreleasing*) failures
+                      error: (ADAuthenticationError* __autoreleasing*) error;
+
+/*! Returns all of the items of the specified user, across all authorities, resources and clients. The stores
+ are expected to answer the query without reading the rest of the items. Returns an empty array if no items
+ are found. Returns nil (and sets the error parameter) in case of error.
+ @param userId: The user whose items are needed. If nil, the items without user information are returned. */
+-(NSArray*) itemsWithUserId: (NSString*) userId
+                      error: (ADAuthenticationError* __autoreleasing*) error;
+
+/*! Returns all of the items, issued by the specified authority, for all users and resources. Returns an empty
+ array if no items are found. Returns nil (and sets the error parameter) in case of error.
+ @param authority: Required. The authority that issued the tokens.
+ @param clientId: Optional. If specified, only the items for this client are returned. */
+-(NSArray*) itemsWithAuthority: (NSString*) authority
+                      clientId: (NSString*) clientId
+                         error: (ADAuthenticationError* __autoreleasing*) error;
+
+/*! Removes all of the items of the specified user, e.g. on sign out. The method does not raise an error,
+ if no items are found.
+ @param userId: The user whose items should be removed. If nil, the items without user information are removed. */
+-(void) removeItemsWithUserId: (NSString*) userId
+                        error: (ADAuthenticationError* __autoreleasing*) error;
+
 @end
@@ -0,0 +1,38 @@
+// Copyright © Microsoft Open Technologies, Inc.
+//
+// All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS
+// OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION
+// ANY IMPLIED WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A
+// PARTICULAR PURPOSE, MERCHANTABILITY OR NON-INFRINGEMENT.
+//
+// See the Apache License, Version 2.0 for the specific language
+// governing permissions and limitations under the License.
+
+#import <Foundation/Foundation.h>
+
+/*! Decodes the JSON bodies of the token endpoint responses. The decoding is a single pass over the
+ response bytes: only the fields, which the library understands (the tokens, their type and expiration,
+ the resource, the id_token, the correlation id and the OAuth2 error fields) are converted to objects.
+ The values of the rest of the fields are skipped without being materialized. The id_token is kept as
+ the raw string; its claims are decoded by ADUserInformation. The class is thread-safe. */
+@interface ADTokenResponseDecoder : NSObject
+
+/*! Decodes the response body and adds the fields to the passed dictionary, replacing the existing
+ values with the same keys. The known fields are added with their values: strings as NSString
+ objects, "expires_in" as NSNumber (whether the server sent it as a number or as a string). The
+ keys of the unknown fields are mapped to NSNull, so that they still show up in the diagnostics.
+ Returns NO and sets the error (NSCocoaErrorDomain) if the body is not a valid JSON object. In this
+ case the dictionary may contain the fields decoded before the error. */
++(BOOL) decodeData: (NSData*) data
+    intoDictionary: (NSMutableDictionary*) response
+             error: (NSError* __autoreleasing*) error;
+
+@end
@@ -0,0 +1,654 @@
+// Copyright © Microsoft Open Technologies, Inc.
+//
+// All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS
+// OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION
+// ANY IMPLIED WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A
+// PARTICULAR PURPOSE, MERCHANTABILITY OR NON-INFRINGEMENT.
+//
+// See the Apache License, Version 2.0 for the specific language
+// governing permissions and limitations under the License.
+
+#import "ADALiOS.h"
+#import "ADTokenResponseDecoder.h"
+#import "ADOAuth2Constants.h"
+
+//Reading position in the response being decoded:
+typedef struct
+{
+    const uint8_t* start;
+    const uint8_t* current;
+    const uint8_t* end;
+} ADJSONReader;
+
+//The raw bytes of a JSON string, between the quotes:
+typedef struct
+{
+    const uint8_t* bytes;
+    size_t length;
+    BOOL escaped;
+} ADJSONString;
+
+//A field, which is converted to an object. The keys are the OAuth2 constants, which live as long as the process:
+typedef struct
+{
+    __unsafe_unretained NSString* key;
+    const char* utf8;
+    size_t length;
+} ADKnownField;
+
+static ADKnownField sKnownFields[9];
+
+//Longer digit sequences are kept as strings and left to the caller:
+static const size_t sMaxIntegerDigits = 18;
+
+//The maximum nesting of the skipped objects and arrays. Deeper values are rejected, so that a malicious
+//response cannot exhaust the stack:
+static const NSUInteger sMaxNestingDepth = 64;
+
+static inline BOOL IsWhitespace(uint8_t c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static inline void SkipWhitespace(ADJSONReader* reader)
+{
+    while (reader->current < reader->end && IsWhitespace(*reader->current))
+    {
+        ++reader->current;
+    }
+}
+
+//Skips the whitespace and consumes the character, if it is the expected one:
+static inline BOOL Consume(ADJSONReader* reader, uint8_t expected)
+{
+    SkipWhitespace(reader);
+    if (reader->current < reader->end && *reader->current == expected)
+    {
+        ++reader->current;
+        return YES;
+    }
+    return NO;
+}
+
+//Scans a string, whose opening quote has already been consumed. The escape sequences are
+//only skipped here; they are validated when (and if) the string is decoded.
+static BOOL ScanString(ADJSONReader* reader, ADJSONString* string)
+{
+    const uint8_t* begin = reader->current;
+    BOOL escaped = NO;
+    while (reader->current < reader->end)
+    {
+        uint8_t c = *reader->current;
+        if ('"' == c)
+        {
+            string->bytes = begin;
+            string->length = reader->current - begin;
+            string->escaped = escaped;
+            ++reader->current;
+            return YES;
+        }
+        if ('\\' == c)
+        {
+            if (reader->end - reader->current < 2)
+            {
+                return NO;
+            }
+            escaped = YES;
+            reader->current += 2;
+            continue;
+        }
+        if (c < 0x20)
+        {
+            //Control characters must be escaped:
+            return NO;
+        }
+        ++reader->current;
+    }
+    return NO;
+}
+
+static BOOL ReadHex4(const uint8_t* bytes, const uint8_t* end, uint32_t* value)
+{
+    if (end - bytes < 4)
+    {
+        return NO;
+    }
+    uint32_t result = 0;
+    for(int i = 0; i < 4; ++i)
+    {
+        uint8_t c = bytes[i];
+        uint32_t digit;
+        if (c >= '0' && c <= '9')
+        {
+            digit = c - '0';
+        }
+        else if (c >= 'a' && c <= 'f')
+        {
+            digit = c - 'a' + 10;
+        }
+        else if (c >= 'A' && c <= 'F')
+        {
+            digit = c - 'A' + 10;
+        }
+        else
+        {
+            return NO;
+        }
+        result = (result << 4) | digit;
+    }
+    *value = result;
+    return YES;
+}
+
+static size_t WriteUTF8(uint32_t code, uint8_t* out)
+{
+    if (code < 0x80)
+    {
+        out[0] = (uint8_t)code;
+        return 1;
+    }
+    if (code < 0x800)
+    {
+        out[0] = (uint8_t)(0xC0 | (code >> 6));
+        out[1] = (uint8_t)(0x80 | (code & 0x3F));
+        return 2;
+    }
+    if (code < 0x10000)
+    {
+        out[0] = (uint8_t)(0xE0 | (code >> 12));
+        out[1] = (uint8_t)(0x80 | ((code >> 6) & 0x3F));
+        out[2] = (uint8_t)(0x80 | (code & 0x3F));
+        return 3;
+    }
+    out[0] = (uint8_t)(0xF0 | (code >> 18));
+    out[1] = (uint8_t)(0x80 | ((code >> 12) & 0x3F));
+    out[2] = (uint8_t)(0x80 | ((code >> 6) & 0x3F));
+    out[3] = (uint8_t)(0x80 | (code & 0x3F));
+    return 4;
+}
+
+//Decodes the escape sequences. Returns nil if the string is not valid.
+static NSString* DecodeEscapedString(const ADJSONString* string)
+{
+    //The decoded string is never longer than the escaped one: a \uXXXX sequence takes 6 bytes
+    //and results in at most 3 UTF-8 bytes; a surrogate pair takes 12 and results in 4.
+    uint8_t* out = malloc(string->length ? string->length : 1);
+    if (!out)
+    {
+        return nil;
+    }
+    size_t outLength = 0;
+    const uint8_t* current = string->bytes;
+    const uint8_t* end = string->bytes + string->length;
+    while (current < end)
+    {
+        if ('\\' != *current)
+        {
+            out[outLength++] = *current++;
+            continue;
+        }
+        if (end - current < 2)
+        {
+            free(out);
+            return nil;
+        }
+        uint8_t c = current[1];
+        current += 2;
+        switch (c)
+        {
+            case '"':
+            case '\\':
+            case '/':
+                out[outLength++] = c;
+                break;
+            case 'b':
+                out[outLength++] = '\b';
+                break;
+            case 'f':
+                out[outLength++] = '\f';
+                break;
+            case 'n':
+                out[outLength++] = '\n';
+                break;
+            case 'r':
+                out[outLength++] = '\r';
+                break;
+            case 't':
+                out[outLength++] = '\t';
+                break;
+            case 'u':
+            {
+                uint32_t code;
+                if (!ReadHex4(current, end, &code))
+                {
+                    free(out);
+                    return nil;
+                }
+                current += 4;
+                if (code >= 0xD800 && code <= 0xDBFF)
+                {
+                    //High surrogate, has to be followed by an escaped low one:
+                    uint32_t low;
+                    if (end - current < 6 || '\\' != current[0] || 'u' != current[1]
+                        || !ReadHex4(current + 2, end, &low) || low < 0xDC00 || low > 0xDFFF)
+                    {
+                        free(out);
+                        return nil;
+                    }
+                    current += 6;
+                    code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                }
+                else if (code >= 0xDC00 && code <= 0xDFFF)
+                {
+                    free(out);
+                    return nil;
+                }
+                outLength += WriteUTF8(code, out + outLength);
+                break;
+            }
+            default:
+                free(out);
+                return nil;
+        }
+    }
+    NSString* decoded = [[NSString alloc] initWithBytesNoCopy:out length:outLength encoding:NSUTF8StringEncoding freeWhenDone:YES];
+    if (!decoded)
+    {
+        free(out);
+    }
+    return decoded;
+}
+
+//Returns the string object. Returns nil if the string is not valid.
+static NSString* StringFromJSONString(const ADJSONString* string)
+{
+    if (string->escaped)
+    {
+        return DecodeEscapedString(string);
+    }
+    return [[NSString alloc] initWithBytes:string->bytes length:string->length encoding:NSUTF8StringEncoding];
+}
+
+//Returns the number, if the string contains only decimal digits; nil otherwise:
+static NSNumber* IntegerFromJSONString(const ADJSONString* string)
+{
+    if (string->escaped || !string->length || string->length > sMaxIntegerDigits)
+    {
+        return nil;
+    }
+    long long value = 0;
+    for(size_t i = 0; i < string->length; ++i)
+    {
+        uint8_t c = string->bytes[i];
+        if (c < '0' || c > '9')
+        {
+            return nil;
+        }
+        value = value * 10 + (c - '0');
+    }
+    return [NSNumber numberWithLongLong:value];
+}
+
+//Returns the known field, which matches the key, or NULL for the unknown keys:
+static const ADKnownField* KnownFieldFromJSONString(const ADJSONString* string)
+{
+    size_t count = sizeof(sKnownFields) / sizeof(sKnownFields[0]);
+    if (string->escaped)
+    {
+        //Never the case with the real servers, but still a valid JSON:
+        NSString* key = DecodeEscapedString(string);
+        for(size_t i = 0; key && i < count; ++i)
+        {
+            if ([key isEqualToString:sKnownFields[i].key])
+            {
+                return &sKnownFields[i];
+            }
+        }
+        return NULL;
+    }
+    for(size_t i = 0; i < count; ++i)
+    {
+        if (sKnownFields[i].length == string->length && !memcmp(sKnownFields[i].utf8, string->bytes, string->length))
+        {
+            return &sKnownFields[i];
+        }
+    }
+    return NULL;
+}
+
+static BOOL ConsumeLiteral(ADJSONReader* reader, const char* literal, size_t length)
+{
+    if ((size_t)(reader->end - reader->current) < length || memcmp(reader->current, literal, length))
+    {
+        return NO;
+    }
+    reader->current += length;
+    return YES;
+}
+
+static inline BOOL IsDigit(uint8_t c)
+{
+    return c >= '0' && c <= '9';
+}
+
+//Consumes one or more decimal digits:
+static inline BOOL ScanDigits(ADJSONReader* reader)
+{
+    const uint8_t* begin = reader->current;
+    while (reader->current < reader->end && IsDigit(*reader->current))
+    {
+        ++reader->current;
+    }
+    return reader->current > begin;
+}
+
+//Scans a number, as defined by the JSON grammar. Sets "integer" to NO if the number has a fraction or an exponent.
+static BOOL ScanNumber(ADJSONReader* reader, BOOL* integer)
+{
+    *integer = YES;
+    if (reader->current < reader->end && '-' == *reader->current)
+    {
+        ++reader->current;
+    }
+    if (reader->current < reader->end && '0' == *reader->current)
+    {
+        ++reader->current;//No leading zeroes
+    }
+    else if (!ScanDigits(reader))
+    {
+        return NO;
+    }
+    if (reader->current < reader->end && '.' == *reader->current)
+    {
+        ++reader->current;
+        *integer = NO;
+        if (!ScanDigits(reader))
+        {
+            return NO;
+        }
+    }
+    if (reader->current < reader->end && ('e' == *reader->current || 'E' == *reader->current))
+    {
+        ++reader->current;
+        *integer = NO;
+        if (reader->current < reader->end && ('+' == *reader->current || '-' == *reader->current))
+        {
+            ++reader->current;
+        }
+        if (!ScanDigits(reader))
+        {
+            return NO;
+        }
+    }
+    return YES;
+}
+
+static BOOL SkipValueAtDepth(ADJSONReader* reader, NSUInteger depth);
+
+//Skips the members of an object, whose opening brace has already been consumed:
+static BOOL SkipObjectMembers(ADJSONReader* reader, NSUInteger depth)
+{
+    if (Consume(reader, '}'))
+    {
+        return YES;
+    }
+    ADJSONString name;
+    do
+    {
+        if (!Consume(reader, '"') || !ScanString(reader, &name) || !Consume(reader, ':')
+            || !SkipValueAtDepth(reader, depth))
+        {
+            return NO;
+        }
+    } while (Consume(reader, ','));
+    return Consume(reader, '}');
+}
+
+//Skips the elements of an array, whose opening bracket has already been consumed:
+static BOOL SkipArrayElements(ADJSONReader* reader, NSUInteger depth)
+{
+    if (Consume(reader, ']'))
+    {
+        return YES;
+    }
+    do
+    {
+        if (!SkipValueAtDepth(reader, depth))
+        {
+            return NO;
+        }
+    } while (Consume(reader, ','));
+    return Consume(reader, ']');
+}
+
+static BOOL SkipValueAtDepth(ADJSONReader* reader, NSUInteger depth)
+{
+    SkipWhitespace(reader);
+    if (reader->current >= reader->end)
+    {
+        return NO;
+    }
+    
+    ADJSONString string;
+    BOOL integer;
+    switch (*reader->current)
+    {
+        case '"':
+            ++reader->current;
+            return ScanString(reader, &string);
+        case '{':
+            ++reader->current;
+            return depth < sMaxNestingDepth && SkipObjectMembers(reader, depth + 1);
+        case '[':
+            ++reader->current;
+            return depth < sMaxNestingDepth && SkipArrayElements(reader, depth + 1);
+        case 't':
+            return ConsumeLiteral(reader, "true", 4);
+        case 'f':
+            return ConsumeLiteral(reader, "false", 5);
+        case 'n':
+            return ConsumeLiteral(reader, "null", 4);
+        default:
+            return ScanNumber(reader, &integer);
+    }
+}
+
+//Skips a value of any type without creating objects. The nested objects and arrays are fully
+//validated, but their contents are never converted, as they are not used.
+static inline BOOL SkipValue(ADJSONReader* reader)
+{
+    return SkipValueAtDepth(reader, 0);
+}
+
+static NSNumber* ReadNumber(ADJSONReader* reader)
+{
+    const uint8_t* begin = reader->current;
+    BOOL integer;
+    if (!ScanNumber(reader, &integer))
+    {
+        return nil;
+    }
+    
+    //strtod/strtoll need a terminated string. The numbers in the token responses are short, so
+    //the heap is used only for the unusually long ones:
+    size_t length = reader->current - begin;
+    char stackBuffer[32];
+    char* buffer = (length < sizeof(stackBuffer)) ? stackBuffer : malloc(length + 1);
+    if (!buffer)
+    {
+        return nil;
+    }
+    memcpy(buffer, begin, length);
+    buffer[length] = 0;
+    //The integers, which may not fit in long long, are read as doubles:
+    NSNumber* number = (integer && length <= sMaxIntegerDigits) ? [NSNumber numberWithLongLong:strtoll(buffer, NULL, 10)]
+                                                                : [NSNumber numberWithDouble:strtod(buffer, NULL)];
+    if (buffer != stackBuffer)
+    {
+        free(buffer);
+    }
+    return number;
+}
+
+//Reads the value of a known field. Sets the value to nil for null and for nested objects or arrays,
+//which are not expected in the known fields.
+static BOOL ReadKnownValue(ADJSONReader* reader, const ADKnownField* field, id __autoreleasing* value)
+{
+    SkipWhitespace(reader);
+    if (reader->current >= reader->end)
+    {
+        return NO;
+    }
+    
+    *value = nil;
+    switch (*reader->current)
+    {
+        case '"':
+        {
+            ++reader->current;
+            ADJSONString string;
+            if (!ScanString(reader, &string))
+            {
+                return NO;
+            }
+            //The server usually sends the expiration as a string:
+            if (field->key == OAUTH2_EXPIRES_IN)
+            {
+                *value = IntegerFromJSONString(&string);
+            }
+            if (!*value)
+            {
+                *value = StringFromJSONString(&string);
+            }
+            return (nil != *value);
+        }
+        case 't':
+            *value = @YES;
+            return ConsumeLiteral(reader, "true", 4);
+        case 'f':
+            *value = @NO;
+            return ConsumeLiteral(reader, "false", 5);
+        case 'n':
+            return ConsumeLiteral(reader, "null", 4);
+        case '{':
+        case '[':
+            return SkipValue(reader);
+        default:
+            *value = ReadNumber(reader);
+            return (nil != *value);
+    }
+}
+
+static BOOL Fail(ADJSONReader* reader, NSString* message, NSError* __autoreleasing* error)
+{
+    if (error)
+    {
+        NSString* details = [NSString stringWithFormat:@"%@ Offset: %ld.", message, (long)(reader->current - reader->start)];
+        *error = [NSError errorWithDomain:NSCocoaErrorDomain
+                                     code:NSPropertyListReadCorruptError
+                                 userInfo:@{ NSLocalizedDescriptionKey:details }];
+    }
+    return NO;
+}
+
+@implementation ADTokenResponseDecoder
+
++(void) initialize
+{
+    if (self != [ADTokenResponseDecoder class])
+    {
+        return;
+    }
+    
+    NSArray* keys = @[OAUTH2_ACCESS_TOKEN, OAUTH2_REFRESH_TOKEN, OAUTH2_TOKEN_TYPE, OAUTH2_EXPIRES_IN, OAUTH2_RESOURCE,
+                      OAUTH2_ID_TOKEN, OAUTH2_CORRELATION_ID_RESPONSE, OAUTH2_ERROR, OAUTH2_ERROR_DESCRIPTION];
+    NSAssert(keys.count == sizeof(sKnownFields) / sizeof(sKnownFields[0]), @"Update the size of sKnownFields");
+    for(NSUInteger i = 0; i < keys.count; ++i)
+    {
+        NSString* key = [keys objectAtIndex:i];
+        sKnownFields[i].key = key;
+        sKnownFields[i].utf8 = strdup(key.UTF8String);
+        sKnownFields[i].length = strlen(sKnownFields[i].utf8);
+    }
+}
+
++(BOOL) decodeData: (NSData*) data
+    intoDictionary: (NSMutableDictionary*) response
+             error: (NSError* __autoreleasing*) error
+{
+    THROW_ON_NIL_ARGUMENT(response);
+    
+    const uint8_t* bytes = data.bytes;
+    ADJSONReader reader = { bytes, bytes, bytes + data.length };
+    //Tolerate the UTF-8 byte order mark:
+    ConsumeLiteral(&reader, "\xEF\xBB\xBF", 3);
+    
+    if (!Consume(&reader, '{'))
+    {
+        return Fail(&reader, @"The response is not a JSON object.", error);
+    }
+    if (!Consume(&reader, '}'))
+    {
+        do
+        {
+            ADJSONString name;
+            if (!Consume(&reader, '"') || !ScanString(&reader, &name))
+            {
+                return Fail(&reader, @"Invalid field name.", error);
+            }
+            if (!Consume(&reader, ':'))
+            {
+                return Fail(&reader, @"Missing ':' after the field name.", error);
+            }
+            
+            const ADKnownField* field = KnownFieldFromJSONString(&name);
+            if (field)
+            {
+                id value;
+                if (!ReadKnownValue(&reader, field, &value))
+                {
+                    return Fail(&reader, [NSString stringWithFormat:@"Invalid value of the '%@' field.", field->key], error);
+                }
+                if (value)
+                {
+                    [response setObject:value forKey:field->key];
+                }
+            }
+            else
+            {
+                if (!SkipValue(&reader))
+                {
+                    return Fail(&reader, @"Invalid field value.", error);
+                }
+                //Only the name is kept, and it does not override the values added by the caller:
+                NSString* key = StringFromJSONString(&name);
+                if (key && ![response objectForKey:key])
+                {
+                    [response setObject:[NSNull null] forKey:key];
+                }
+            }
+        } while (Consume(&reader, ','));
+        
+        if (!Consume(&reader, '}'))
+        {
+            return Fail(&reader, @"Missing '}' at the end of the JSON object.", error);
+        }
+    }
+    
+    SkipWhitespace(&reader);
+    if (reader.current != reader.end)
+    {
+        return Fail(&reader, @"Unexpected data after the JSON object.", error);
+    }
+    return YES;
+}
+
+@end
@@ -0,0 +1,87 @@
+// Copyright © Microsoft Open Technologies, Inc.
+//
+// All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS
+// OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION
+// ANY IMPLIED WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A
+// PARTICULAR PURPOSE, MERCHANTABILITY OR NON-INFRINGEMENT.
+//
+// See the Apache License, Version 2.0 for the specific language
+// governing permissions and limitations under the License.
+
+#import <Foundation/Foundation.h>
+
+@class ADAuthenticationError;
+@class ADTraceSpan;
+
+/*! The block, which receives the completed spans. */
+typedef void (^ADTraceCallback)(ADTraceSpan* span);
+
+/*! A timed stage of an authentication operation, e.g. the authority validation, the cache lookup or
+ a token request. The spans of one operation form a tree: the stages create the spans of their own
+ sub-stages as children, following the asynchronous chain of the operation.
+ The spans are created only while a trace callback is set (see setTraceCallback); otherwise the
+ creation methods return nil, so that tracing costs nothing when not in use. Each span is delivered
+ to the callback once, when it ends, on a background serial queue. A child always ends, and
+ hence is delivered, before its parent. */
+@interface ADTraceSpan : NSObject
+
+/*! The name of the stage, e.g. "tokenRequest". */
+@property (readonly) NSString* name;
+
+/*! Identifies the span among all spans, created by the process. */
+@property (readonly) uint64_t spanId;
+
+/*! The spanId of the parent span. 0 for the root spans. */
+@property (readonly) uint64_t parentSpanId;
+
+/*! The spanId of the root span of the operation, used to group the spans of one operation. */
+@property (readonly) uint64_t traceId;
+
+/*! The correlation id of the operation. May be nil. */
+@property (readonly) NSUUID* correlationId;
+
+/*! The time, when the stage started. */
+@property (readonly) NSDate* startTime;
+
+/*! The duration of the stage in seconds. Measured with a monotonic clock, valid once the span has ended. */
+@property (readonly) NSTimeInterval duration;
+
+/*! The error, with which the stage has ended. Nil if the stage succeeded. */
+@property (readonly) ADAuthenticationError* error;
+
+/*! Named values, attached by the stage, e.g. the HTTP status code. */
+@property (readonly) NSDictionary* attributes;
+
+/*! Sets the block, which receives the completed spans. Pass nil to disable tracing. */
++(void) setTraceCallback: (ADTraceCallback) callback;
+
+/*! Returns the current trace callback. */
++(ADTraceCallback) getTraceCallback;
+
+/*! Starts the root span of an operation. Returns nil if tracing is disabled. */
++(ADTraceSpan*) rootSpanWithName: (NSString*) name
+                   correlationId: (NSUUID*) correlationId;
+
+/*! Starts a sub-stage of this span. As the spans are nil when tracing is disabled, the stages can
+ create and end their spans without checking whether tracing is on. */
+-(ADTraceSpan*) childWithName: (NSString*) name;
+
+/*! Attaches a named value to the span. Has no effect after the span has ended. */
+-(void) setAttribute: (id) value
+              forKey: (NSString*) key;
+
+/*! Ends the span and delivers it to the trace callback. The subsequent calls are ignored. */
+-(void) end;
+
+/*! Same as end, but records the error, with which the stage has failed. */
+-(void) endWithError: (ADAuthenticationError*) error;
+
+@end
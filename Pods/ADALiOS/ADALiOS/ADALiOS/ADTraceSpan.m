@@ -0,0 +1,159 @@
+// Copyright © Microsoft Open Technologies, Inc.
+//
+// All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS
+// OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION
+// ANY IMPLIED WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A
+// PARTICULAR PURPOSE, MERCHANTABILITY OR NON-INFRINGEMENT.
+//
+// See the Apache License, Version 2.0 for the specific language
+// governing permissions and limitations under the License.
+
+#import "ADALiOS.h"
+#import "ADTraceSpan.h"
+#include <stdatomic.h>
+
+static ADTraceCallback sTraceCallback = nil;
+static atomic_uint_fast64_t sNextSpanId = 1;
+static dispatch_queue_t sTraceQueue;
+
+@implementation ADTraceSpan
+{
+    //Monotonic time of the start, the wall clock can be changed during the operation:
+    NSTimeInterval mStartUptime;
+    NSMutableDictionary* mAttributes;
+    BOOL mEnded;
+}
+
++(void) initialize
+{
+    if (self != [ADTraceSpan class])
+    {
+        return;
+    }
+    
+    sTraceQueue = dispatch_queue_create("com.microsoft.adal.trace", DISPATCH_QUEUE_SERIAL);
+    dispatch_set_target_queue(sTraceQueue, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0));
+}
+
+-(id) init
+{
+    [super doesNotRecognizeSelector:_cmd];
+    return nil;
+}
+
+-(id) initWithName: (NSString*) name
+            parent: (ADTraceSpan*) parent
+     correlationId: (NSUUID*) correlationId
+{
+    self = [super init];
+    if (self)
+    {
+        _name = name;
+        _spanId = atomic_fetch_add_explicit(&sNextSpanId, 1, memory_order_relaxed);
+        _parentSpanId = parent.spanId;
+        _traceId = parent ? parent.traceId : _spanId;
+        _correlationId = correlationId;
+        _startTime = [NSDate date];
+        mStartUptime = [NSProcessInfo processInfo].systemUptime;
+    }
+    return self;
+}
+
++(void) setTraceCallback: (ADTraceCallback) callback
+{
+    @synchronized(self)
+    {
+        sTraceCallback = [callback copy];
+    }
+}
+
++(ADTraceCallback) getTraceCallback
+{
+    @synchronized(self)
+    {
+        return sTraceCallback;
+    }
+}
+
++(ADTraceSpan*) rootSpanWithName: (NSString*) name
+                   correlationId: (NSUUID*) correlationId
+{
+    if (![self getTraceCallback])
+    {
+        return nil;
+    }
+    return [[self alloc] initWithName:name parent:nil correlationId:correlationId];
+}
+
+-(ADTraceSpan*) childWithName: (NSString*) name
+{
+    //The callback is not checked again, so that the trees are not cut in the middle:
+    return [[ADTraceSpan alloc] initWithName:name parent:self correlationId:_correlationId];
+}
+
+-(NSDictionary*) attributes
+{
+    @synchronized(self)
+    {
+        return [mAttributes copy];
+    }
+}
+
+-(void) setAttribute: (id) value
+              forKey: (NSString*) key
+{
+    if (!value || !key)
+    {
+        return;
+    }
+    
+    @synchronized(self)
+    {
+        if (mEnded)
+        {
+            return;
+        }
+        if (!mAttributes)
+        {
+            mAttributes = [NSMutableDictionary new];
+        }
+        [mAttributes setObject:value forKey:key];
+    }
+}
+
+-(void) end
+{
+    [self endWithError:nil];
+}
+
+-(void) endWithError: (ADAuthenticationError*) error
+{
+    @synchronized(self)
+    {
+        if (mEnded)
+        {
+            return;
+        }
+        mEnded = YES;
+        _duration = [NSProcessInfo processInfo].systemUptime - mStartUptime;
+        _error = error;
+    }
+    
+    ADTraceCallback callback = [ADTraceSpan getTraceCallback];
+    if (callback)
+    {
+        dispatch_async(sTraceQueue, ^{
+            callback(self);
+        });
+    }
+}
+
+@end
@@ -0,0 +1,26 @@
+// Copyright © Microsoft Open Technologies, Inc.
+//
+// All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS
+// OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION
+// ANY IMPLIED WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A
+// PARTICULAR PURPOSE, MERCHANTABILITY OR NON-INFRINGEMENT.
+//
+// See the Apache License, Version 2.0 for the specific language
+// governing permissions and limitations under the License.
+
+#import "ADHTTPTransport.h"
+
+/*! The default HTTP transport. All of the requests are sent through a single, long-lived NSURLSession, so that
+ the connections (and the TLS sessions) to the same hosts are kept alive and reused. HTTP/2 is negotiated by
+ the session where available. The responses are never cached. */
+@interface ADURLSessionTransport : NSObject<ADHTTPTransport>
+
+@end
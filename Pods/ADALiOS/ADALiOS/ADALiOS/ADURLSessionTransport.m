@@ -0,0 +1,70 @@
+// Copyright © Microsoft Open Technologies, Inc.
+//
+// All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS
+// OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION
+// ANY IMPLIED WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A
+// PARTICULAR PURPOSE, MERCHANTABILITY OR NON-INFRINGEMENT.
+//
+// See the Apache License, Version 2.0 for the specific language
+// governing permissions and limitations under the License.
+
+#import "ADURLSessionTransport.h"
+
+@implementation ADURLSessionTransport
+{
+    //The completion handlers of the tasks are executed on this queue. It is concurrent, so that a slow
+    //response processing does not delay the completion of the other requests:
+    NSOperationQueue* mQueue;
+    NSURLSession* mSession;
+}
+
+-(id) init
+{
+    self = [super init];
+    if (self)
+    {
+        mQueue = [NSOperationQueue new];
+        
+        NSURLSessionConfiguration* configuration = [NSURLSessionConfiguration defaultSessionConfiguration];
+        //The token responses should never be cached:
+        configuration.URLCache              = nil;
+        configuration.requestCachePolicy    = NSURLRequestReloadIgnoringLocalCacheData;
+        configuration.HTTPShouldSetCookies  = NO;
+        mSession = [NSURLSession sessionWithConfiguration:configuration delegate:nil delegateQueue:mQueue];
+    }
+    return self;
+}
+
+-(id) sendRequest: (NSURLRequest*) request
+completionHandler: (ADHTTPTransportCallback) completionHandler
+{
+    NSURLSessionDataTask* task = [mSession dataTaskWithRequest:request
+                                             completionHandler:^(NSData* data, NSURLResponse* response, NSError* error)
+                                  {
+                                      if (error)
+                                      {
+                                          completionHandler(error, nil, nil);
+                                          return;
+                                      }
+                                      
+                                      NSAssert([response isKindOfClass:[NSHTTPURLResponse class]], @"No HTTP Response available");
+                                      completionHandler(nil, (NSHTTPURLResponse*)response, data);
+                                  }];
+    [task resume];
+    return task;
+}
+
+-(void) cancelRequest: (id) request
+{
+    [(NSURLSessionTask*)request cancel];
+}
+
+@end
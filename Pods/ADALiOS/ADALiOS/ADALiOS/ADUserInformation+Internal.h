@@ -0,0 +1,34 @@
+// Copyright © Microsoft Open Technologies, Inc.
+//
+// All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS
+// OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION
+// ANY IMPLIED WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A
+// PARTICULAR PURPOSE, MERCHANTABILITY OR NON-INFRINGEMENT.
+//
+// See the Apache License, Version 2.0 for the specific language
+// governing permissions and limitations under the License.
+
+#import "ADUserInformation.h"
+
+/* Internally accessible methods.*/
+@interface ADUserInformation (Internal)
+
+/*! Restores the object from previously persisted values, without parsing the id_token again.
+ @param userId: Required. The already normalized user id.
+ @param rawIdToken: The id_token, the user information was extracted from. May be nil.
+ @param allClaims: The claims of the id_token. May be nil, in which case they are decoded from
+ rawIdToken on first access. */
+-(id) initWithUserId: (NSString*) userId
+   userIdDisplayable: (BOOL) userIdDisplayable
+          rawIdToken: (NSString*) rawIdToken
+           allClaims: (NSDictionary*) allClaims;
+
+@end
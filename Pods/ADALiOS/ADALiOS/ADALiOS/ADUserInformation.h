@@ -71,7 +71,8 @@
 /*! The raw id_token claim string. */
 @property (readonly) NSString* rawIdToken;
 
-/*! Contains all claims that had been read from the id_token. May be null, if the object was not created from a real id_token. */
+/*! Contains all claims from the payload of the id_token. May be null, if the object was not created from a real id_token.
+ The objects restored from the cache decode the claims from rawIdToken on first access of this or any of the claim properties. */
 @property (readonly) NSDictionary* allClaims;
 
 /* A helper method to normalize userId, e.g. remove white spaces, lowercase. 
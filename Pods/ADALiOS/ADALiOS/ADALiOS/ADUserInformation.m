@@ -17,6 +17,7 @@
 // governing permissions and limitations under the License.
 
 #import "ADUserInformation.h"
+#import "ADUserInformation+Internal.h"
 #import "ADALiOS.h"
 #import "ADOAuth2Constants.h"
 #import "NSString+ADHelperMethods.h"
@@ -35,6 +36,10 @@ NSString* const ID_TOKEN_OBJECT_ID = @"oid";
 NSString* const ID_TOKEN_GUEST_ID = @"altsecid";
 
 @implementation ADUserInformation
+{
+    //Set once the claims have been decoded from _rawIdToken (or found to be not decodable):
+    BOOL mClaimsDecoded;
+}
 
 -(id) init
 {
@@ -83,6 +88,50 @@ NSString* const ID_TOKEN_GUEST_ID = @"altsecid";
     return [ADAuthenticationError errorFromAuthenticationError:AD_ERROR_AUTHENTICATION protocolCode:nil errorDetails:[NSString stringWithFormat: @"The id_token contents cannot be parsed: %@", idTokenText]];
 }
 
+//Returns the claims from the payload (the second segment) of the id_token. The header and the
+//signature segments are not decoded, as nothing is read from them.
+-(NSDictionary*) claimsFromIdToken: (NSString*) idToken
+                             error: (ADAuthenticationError* __autoreleasing*) error
+{
+    NSRange payload = NSMakeRange(0, idToken.length);
+    NSRange separator = [idToken rangeOfString:@"."];
+    if (separator.location != NSNotFound)
+    {
+        payload.location = separator.location + 1;
+        payload.length = idToken.length - payload.location;
+        separator = [idToken rangeOfString:@"." options:0 range:payload];
+        if (separator.location != NSNotFound)
+        {
+            payload.length = separator.location - payload.location;
+        }
+    }
+    
+    //Base64 decoded straight into the bytes for the JSON parser:
+    NSData* decoded = [NSString Base64DecodeData:[idToken substringWithRange:payload]];
+    if (!decoded.length)
+    {
+        if (error)
+        {
+            *error = [self errorFromIdToken:idToken];
+        }
+        return nil;
+    }
+    
+    NSError* jsonError  = nil;
+    id jsonObject = [NSJSONSerialization JSONObjectWithData:decoded options:0 error:&jsonError];
+    if (![jsonObject isKindOfClass:[NSDictionary class]])
+    {
+        if (error)
+        {
+            *error = (jsonError) ? [ADAuthenticationError errorFromNSError:jsonError
+                                                              errorDetails:[NSString stringWithFormat:@"Failed to deserialize the id_token contents: %@", idToken]]
+                                 : [self errorFromIdToken:idToken];
+        }
+        return nil;
+    }
+    return jsonObject;
+}
+
 -(id) initWithIdToken: (NSString*) idToken
                 error: (ADAuthenticationError* __autoreleasing*) error
 {
@@ -99,67 +148,15 @@ NSString* const ID_TOKEN_GUEST_ID = @"altsecid";
     }
     
     _rawIdToken = idToken;
-    NSMutableDictionary* allClaims = [NSMutableDictionary new];
-    
-    NSArray* parts = [idToken componentsSeparatedByCharactersInSet:[NSCharacterSet characterSetWithCharactersInString:@"."]];
-    if (parts.count < 1)
-    {
-        RETURN_ID_TOKEN_ERROR(idToken);
-    }
-    
-    NSString* type = nil;
-    for (NSString* part in parts)
+    //The user id is the cache key, so the payload has to be decoded here. The claims are kept, so
+    //that they are not decoded again on access. The objects restored from the cache decode them lazily.
+    _allClaims = [self claimsFromIdToken:idToken error:error];
+    mClaimsDecoded = YES;
+    if (!_allClaims)
     {
-        AD_LOG_VERBOSE(@"Id_token part", part);
-        NSString* decoded = [part adBase64UrlDecode];
-        if (![NSString adIsStringNilOrBlank:decoded])
-        {
-            NSError* jsonError  = nil;
-            id jsonObject = [NSJSONSerialization JSONObjectWithData:[decoded dataUsingEncoding:NSUTF8StringEncoding]
-                                                            options:0
-                                                              error:&jsonError];
-                if (jsonError)
-                {
-                    ADAuthenticationError* adError = [ADAuthenticationError errorFromNSError:jsonError
-                                                                                errorDetails:[NSString stringWithFormat:@"Failed to deserialize the id_token contents: %@", part]];
-                    if (error)
-                    {
-                        *error = adError;
-                    }
-                    return nil;
-                }
-            
-            if (![jsonObject isKindOfClass:[NSDictionary class]])
-            {
-                RETURN_ID_TOKEN_ERROR(part);
-            }
-            
-            NSDictionary* contents = (NSDictionary*)jsonObject;
-            if (!type)
-            {
-                type = [contents objectForKey:ID_TOKEN_TYPE];
-                if (type)
-                {
-                    //Type argument is passed, check if it is the expected one
-                    if (![ID_TOKEN_JWT_TYPE isEqualToString:type])
-                    {
-                        //Log it, but still try to use it as if it was a JWT token
-                        AD_LOG_WARN(@"Incompatible id_token type.", type);
-                    }
-                }
-            }
-
-            [allClaims addEntriesFromDictionary:contents];
-        }
-    }
-    if (!type)
-    {
-        AD_LOG_WARN(@"The id_token type is missing.", @"Assuming JWT type.");
+        return nil;
     }
     
-    //Create a read-only dictionary object. Note that the properties checked below are calculated off this dictionary:
-    _allClaims = [NSDictionary dictionaryWithDictionary:allClaims];
-    
     //Now attempt to extract an unique user id:
     if (![NSString adIsStringNilOrBlank:self.upn])
     {
@@ -197,6 +194,28 @@ NSString* const ID_TOKEN_GUEST_ID = @"altsecid";
     return self;
 }
 
+//Decodes the claims from the id_token on first access:
+-(NSDictionary*) allClaims
+{
+    @synchronized(self)
+    {
+        if (!mClaimsDecoded)
+        {
+            mClaimsDecoded = YES;
+            if (!_allClaims && _rawIdToken)
+            {
+                ADAuthenticationError* error = nil;
+                _allClaims = [self claimsFromIdToken:_rawIdToken error:&error];
+                if (error)
+                {
+                    AD_LOG_WARN(@"Cannot decode the id_token claims.", error.errorDetails);
+                }
+            }
+        }
+        return _allClaims;
+    }
+}
+
 //Declares a propperty getter, which extracts the property from the claims dictionary
 #define ID_TOKEN_PROPERTY_GETTER(property, claimName) \
 -(NSString*) get##property \
@@ -237,7 +256,12 @@ ID_TOKEN_PROPERTY_GETTER(GuestId, ID_TOKEN_GUEST_ID);
     ADUserInformation* info = [[ADUserInformation allocWithZone:zone] initWithUserId:self.userId];
     info->_userIdDisplayable  = self.userIdDisplayable;
     info->_rawIdToken       = [self.rawIdToken copyWithZone:zone];
-    info->_allClaims        = [self.allClaims copyWithZone:zone];
+    //The claims are not decoded just for copying:
+    @synchronized(self)
+    {
+        info->_allClaims        = [_allClaims copyWithZone:zone];
+        info->mClaimsDecoded    = mClaimsDecoded;
+    }
     
     return info;
 }
@@ -272,10 +296,35 @@ ID_TOKEN_PROPERTY_GETTER(GuestId, ID_TOKEN_GUEST_ID);
     {
         _userIdDisplayable  = [aDecoder decodeBoolForKey:@"userIdDisplayable"];
         _rawIdToken             = [aDecoder decodeObjectOfClass:[NSString class] forKey:@"rawIdToken"];
-        _allClaims              = [aDecoder decodeObjectOfClass:[NSDictionary class] forKey:@"allClaims"];
+        if (!_rawIdToken)
+        {
+            _allClaims          = [aDecoder decodeObjectOfClass:[NSDictionary class] forKey:@"allClaims"];
+        }
+        //Else the claims are decoded from the id_token on first access.
     }
     
     return self;
 }
 
 @end
+
+@implementation ADUserInformation (Internal)
+
+-(id) initWithUserId: (NSString*) userId
+   userIdDisplayable: (BOOL) userIdDisplayable
+          rawIdToken: (NSString*) rawIdToken
+           allClaims: (NSDictionary*) allClaims
+{
+    self = [self initWithUserId:userId];
+    if (self)
+    {
+        _userIdDisplayable  = userIdDisplayable;
+        _rawIdToken         = rawIdToken;
+        _allClaims          = allClaims;
+        //Without the claims, they are decoded from the id_token on first access:
+        mClaimsDecoded      = (nil != allClaims);
+    }
+    return self;
+}
+
+@end
@@ -22,7 +22,9 @@
 extern NSString *const HTTPGet;
 extern NSString *const HTTPPost;
 
-@interface ADWebRequest : NSObject <NSURLConnectionDelegate>
+/*! A single HTTP request. The requests are sent through the transport, configured in
+ ADAuthenticationSettings' httpTransport property. */
+@interface ADWebRequest : NSObject
 
 @property (strong, readonly, nonatomic) NSURL               *URL;
 @property (strong)                      NSString            *method;
@@ -35,5 +37,11 @@ extern NSString *const HTTPPost;
 
 - (void)send:( void (^)( NSError *, ADWebResponse *) )completionHandler;
 
+/*! Cancels the request, if it is in flight. The completion handler is called with NSURLErrorCancelled. */
+- (void)cancel;
+
+/*! Cancels all of the requests in flight. */
++ (void)cancelAllRequests;
+
 @end
 
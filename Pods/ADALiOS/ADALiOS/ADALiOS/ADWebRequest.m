@@ -18,19 +18,20 @@
 
 #import "ADALiOS.h"
 #import "ADOAuth2Constants.h"
-#import "NSURL+ADExtensions.h"
 #import "ADErrorCodes.h"
 #import "NSString+ADHelperMethods.h"
 #import "ADWebRequest.h"
 #import "ADWebResponse.h"
 #import "ADAuthenticationSettings.h"
+#import "ADHTTPTransport.h"
 
 NSString *const HTTPGet  = @"GET";
 NSString *const HTTPPost = @"POST";
 
-static NSOperationQueue *s_queue;
+//The requests in flight. Keeps the requests alive until their completion:
+static NSMutableSet *s_activeRequests;
 
-@interface ADWebRequest () <NSURLConnectionDelegate>
+@interface ADWebRequest ()
 
 - (void)completeWithError:(NSError *)error andResponse:(ADWebResponse *)response;
 - (void)send;
@@ -40,12 +41,13 @@ static NSOperationQueue *s_queue;
 
 @implementation ADWebRequest
 {
-    NSURLConnection     *_connection;
+    id<ADHTTPTransport>  _transport;
+    //The transport's handle of the request in flight. Guarded by @synchronized(self):
+    id                   _handle;
+    BOOL                 _completed;
     
     NSData              *_requestData;
     
-    NSHTTPURLResponse   *_response;
-    NSMutableData       *_responseData;
     NSUUID              *_correlationId;
     
     void (^_completionHandler)( NSError *, ADWebResponse *);
@@ -53,8 +55,26 @@ static NSOperationQueue *s_queue;
 
 + (void)initialize
 {
-    s_queue = [[NSOperationQueue alloc] init];
+    if (self != [ADWebRequest class])
+    {
+        return;
+    }
     
+    s_activeRequests = [[NSMutableSet alloc] init];
+}
+
++ (void)cancelAllRequests
+{
+    NSArray *requests;
+    @synchronized(s_activeRequests)
+    {
+        requests = s_activeRequests.allObjects;
+    }
+    
+    for (ADWebRequest *request in requests)
+    {
+        [request cancel];
+    }
 }
 
 #pragma mark - Properties
@@ -93,16 +113,14 @@ static NSOperationQueue *s_queue;
     
     if ( nil != self )
     {
-        _connection     = nil;
+        _transport         = nil;
+        _handle            = nil;
         
         _requestURL        = [requestURL copy];
         _requestMethod     = HTTPGet;
         _requestHeaders    = [[NSMutableDictionary alloc] init];
         _requestData       = nil;
         
-        _response          = nil;
-        _responseData      = nil;
-        
         // Default timeout for ADWebRequest is 30 seconds
         _timeout           = [[ADAuthenticationSettings sharedInstance] requestTimeOut];
         
@@ -116,16 +134,22 @@ static NSOperationQueue *s_queue;
 // Cleans up and then calls the completion handler
 - (void)completeWithError:(NSError *)error andResponse:(ADWebResponse *)response
 {
+    @synchronized(s_activeRequests)
+    {
+        [s_activeRequests removeObject:self];
+    }
+    
     // Cleanup
     _requestURL     = nil;
     _requestMethod  = nil;
     _requestHeaders = nil;
     _requestData    = nil;
     
-    _response       = nil;
-    _responseData   = nil;
-    
-    _connection     = nil;
+    @synchronized(self)
+    {
+        _completed = YES;
+        _handle    = nil;
+    }
     
     if ( _completionHandler != nil )
     {
@@ -137,16 +161,11 @@ static NSOperationQueue *s_queue;
 {
     _completionHandler = [completionHandler copy];
     
-    _response          = nil;
-    _responseData      = [[NSMutableData alloc] init];
-    
     [self send];
 }
 
 - (void)send
 {
-    // Add default HTTP Headers to the request: Host
-    [_requestHeaders setValue:[_requestURL adAuthority] forKey:@"Host"];
     [_requestHeaders addEntriesFromDictionary:[ADLogger adalId]];
     //Correlation id:
     if (_correlationId)
@@ -157,11 +176,7 @@ static NSOperationQueue *s_queue;
            OAUTH2_CORRELATION_ID_REQUEST_VALUE:[_correlationId UUIDString]
            }];
     }
-    // If there is request data, then set the Content-Length header
-    if ( _requestData != nil )
-    {
-        [_requestHeaders setValue:[NSString stringWithFormat:@"%ld", (unsigned long)_requestData.length] forKey:@"Content-Length"];
-    }
+    //Note that the Host and Content-Length headers are set by the transport.
     
     NSMutableURLRequest *request = [[NSMutableURLRequest alloc] initWithURL:_requestURL
                                                                 cachePolicy:NSURLRequestReloadIgnoringCacheData
@@ -170,9 +185,50 @@ static NSOperationQueue *s_queue;
     request.allHTTPHeaderFields = _requestHeaders;
     request.HTTPBody            = _requestData;
     
-    _connection = [[NSURLConnection alloc] initWithRequest:request delegate:self startImmediately:NO];
-    [_connection setDelegateQueue:s_queue];
-    [_connection start];
+    //The transport is captured once, so that changing it in the settings does not affect
+    //the requests in flight:
+    _transport = [ADAuthenticationSettings sharedInstance].httpTransport;
+    @synchronized(s_activeRequests)
+    {
+        [s_activeRequests addObject:self];
+    }
+    
+    //The transport may complete the request on another thread before sendRequest returns. The lock makes
+    //the completion wait until the handle is stored, so that a completed request never keeps a stale handle:
+    @synchronized(self)
+    {
+        id handle = [_transport sendRequest:request
+                          completionHandler:^(NSError *error, NSHTTPURLResponse *response, NSData *data)
+                     {
+                         if ( error != nil )
+                         {
+                             [self completeWithError:error andResponse:nil];
+                             return;
+                         }
+                         
+                         NSAssert( response != nil, @"No HTTP Response available" );
+                         [self completeWithError:nil andResponse:[[ADWebResponse alloc] initWithResponse:response
+                                                                                                    data:data]];
+                     }];
+        if (!_completed)
+        {
+            _handle = handle;
+        }
+    }
+}
+
+- (void)cancel
+{
+    // The completion handler is called with NSURLErrorCancelled:
+    id handle;
+    @synchronized(self)
+    {
+        handle = _handle;
+    }
+    if (handle)
+    {
+        [_transport cancelRequest:handle];
+    }
 }
 
 - (BOOL)verifyRequestURL:(NSURL *)requestURL
@@ -186,83 +242,4 @@ static NSOperationQueue *s_queue;
     return YES;
 }
 
-#pragma mark - NSURLConnectionDelegate
-
-// Connection Authentication
-
-// Discussion
-// This method allows the delegate to make an informed decision about connection authentication at once.
-// If the delegate implements this method, it has no need to implement connection:canAuthenticateAgainstProtectionSpace:, connection:didReceiveAuthenticationChallenge:, connectionShouldUseCredentialStorage:.
-// In fact, these other methods are not invoked.
-- (void)connection:(NSURLConnection *)connection willSendRequestForAuthenticationChallenge:(NSURLAuthenticationChallenge *)challenge
-{
-#pragma unused(connection)
-    // Do default handling
-    [challenge.sender performDefaultHandlingForAuthenticationChallenge:challenge];
-}
-
-// Connection Completion
-
-- (void)connection:(NSURLConnection *)connection didFailWithError:(NSError *)error
-{
-#pragma unused(connection)
-    
-    [self completeWithError:error andResponse:nil];
-}
-
-// Method Group
-- (NSCachedURLResponse *)connection:(NSURLConnection *)connection willCacheResponse:(NSCachedURLResponse *)cachedResponse
-{
-#pragma unused(connection)
-#pragma unused(cachedResponse)
-    
-    return nil;
-}
-
-- (void)connection:(NSURLConnection *)connection didReceiveResponse:(NSURLResponse *)response
-{
-#pragma unused(connection)
-    
-    _response = (NSHTTPURLResponse *)response;
-}
-
-- (void)connection:(NSURLConnection *)connection didReceiveData:(NSData *)data
-{
-#pragma unused(connection)
-    
-    [_responseData appendData:data];
-}
-
-- (NSURLRequest *)connection:(NSURLConnection *)connection willSendRequest:(NSURLRequest *)request redirectResponse:(NSURLResponse *)redirectResponse
-{
-#pragma unused(connection)
-#pragma unused(redirectResponse)
-    
-    // Allow redirects
-    return request;
-}
-
-- (void)connectionDidFinishLoading:(NSURLConnection *)connection
-{
-#pragma unused(connection)
-    
-    //
-    // NOTE: There is a race condition between this method and the challenge handling methods
-    //       dependent on the the challenge processing that the application performs.
-    //
-    NSAssert( _response != nil, @"No HTTP Response available" );
-    
-    [self completeWithError:nil andResponse:[[ADWebResponse alloc] initWithResponse:_response data:_responseData]];
-}
-
-//required method Available in OS X v10.6 through OS X v10.7, then deprecated
--(void)connection:(NSURLConnection *)connection didSendBodyData:(NSInteger)bytesWritten totalBytesWritten:(NSInteger)totalBytesWritten totalBytesExpectedToWrite:(NSInteger)totalBytesExpectedToWrite
-{
-#pragma unused(connection)
-#pragma unused(bytesWritten)
-#pragma unused(totalBytesWritten)
-#pragma unused(totalBytesExpectedToWrite)
-    
-}
-
 @end
@@ -77,6 +77,12 @@
 
 + (NSData *) Base64DecodeData:(NSString *)encodedString;
 
+/*! Same as Base64EncodeData, but without the SIMD kernels. Used to verify the kernels against the scalar code. */
++ (NSString *) Base64EncodeDataScalar:(NSData *)data;
+
+/*! Same as Base64DecodeData, but without the SIMD kernels. Used to verify the kernels against the scalar code. */
++ (NSData *) Base64DecodeDataScalar:(NSString *)encodedString;
+
 - (NSDictionary*)authHeaderParams;
 
 @end
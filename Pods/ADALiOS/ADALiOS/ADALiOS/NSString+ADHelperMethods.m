@@ -17,6 +17,16 @@
 // governing permissions and limitations under the License.
 #import "ADALiOS.h"
 
+//The base64url kernels process 48 bytes (NEON, arm64 devices) or 12 bytes (SSSE3, simulator)
+//per iteration; the rest and the other architectures use the scalar code.
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#import <arm_neon.h>
+#define AD_BASE64_NEON 1
+#elif defined(__SSSE3__)
+#import <tmmintrin.h>
+#define AD_BASE64_SSSE3 1
+#endif
+
 typedef unsigned char byte;
 
 static char base64UrlEncodeTable[64] =
@@ -40,128 +50,225 @@ static byte rgbDecodeTable[128] = {                         // character code
     41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, NA, NA, NA, NA, NA,  // 112-127
 };
 
-//Checks that all bytes inside the format are valid base64 characters:
-BOOL validBase64Characters(const byte* data, const int size)    
+//Decodes the characters four at a time. The NA entries have the high bit set, so the validation
+//is a single check of the OR-ed values, rather than a separate pass over the input.
+static inline BOOL Decode4bytesTo3bytes(const byte* input, byte* output)
+{
+    byte b0 = (input[0] < 128) ? rgbDecodeTable[input[0]] : NA;
+    byte b1 = (input[1] < 128) ? rgbDecodeTable[input[1]] : NA;
+    byte b2 = (input[2] < 128) ? rgbDecodeTable[input[2]] : NA;
+    byte b3 = (input[3] < 128) ? rgbDecodeTable[input[3]] : NA;
+    if ((b0 | b1 | b2 | b3) & 0x80)
+    {
+        return NO;
+    }
+    output[0] = (byte)((b0 << 2) | (b1 >> 4));
+    output[1] = (byte)((b1 << 4) | (b2 >> 2));
+    output[2] = (byte)((b2 << 6) | b3);
+    return YES;
+}
+
+#if AD_BASE64_NEON
+
+//Encodes 48 bytes into 64 characters per iteration. Returns the number of the bytes consumed.
+static size_t Base64UrlEncodeSIMD(const byte* input, size_t length, char* output)
 {
-    for (int i = 0; i < size; ++i)
+    uint8x16x4_t table = vld1q_u8_x4((const uint8_t*)base64UrlEncodeTable);
+    uint8x16_t mask = vdupq_n_u8(0x3F);
+    size_t consumed = 0;
+    for(; length - consumed >= 48; consumed += 48, output += 64)
     {
-        if (data[i] >= sizeof(rgbDecodeTable) || rgbDecodeTable[data[i]] == NA)
+        uint8x16x3_t in = vld3q_u8(input + consumed);
+        uint8x16x4_t out;
+        out.val[0] = vshrq_n_u8(in.val[0], 2);
+        out.val[1] = vandq_u8(vorrq_u8(vshlq_n_u8(in.val[0], 4), vshrq_n_u8(in.val[1], 4)), mask);
+        out.val[2] = vandq_u8(vorrq_u8(vshlq_n_u8(in.val[1], 2), vshrq_n_u8(in.val[2], 6)), mask);
+        out.val[3] = vandq_u8(in.val[2], mask);
+        out.val[0] = vqtbl4q_u8(table, out.val[0]);
+        out.val[1] = vqtbl4q_u8(table, out.val[1]);
+        out.val[2] = vqtbl4q_u8(table, out.val[2]);
+        out.val[3] = vqtbl4q_u8(table, out.val[3]);
+        vst4q_u8((uint8_t*)output, out);
+    }
+    return consumed;
+}
+
+static inline uint8x16_t DecodeLookupNEON(uint8x16x4_t low, uint8x16x4_t high, uint8x16_t c)
+{
+    //Characters 0-63 come from the first table, 64-127 from the second one; the rest are
+    //left as 0 by both lookups and are caught by the high bit check of the caller.
+    uint8x16_t value = vqtbl4q_u8(low, c);
+    return vqtbx4q_u8(value, high, vsubq_u8(c, vdupq_n_u8(64)));
+}
+
+//Decodes 64 characters into 48 bytes per iteration. Returns the number of the characters consumed;
+//stops at the first block with invalid characters and leaves it to the scalar code to report.
+static size_t Base64UrlDecodeSIMD(const byte* input, size_t length, byte* output)
+{
+    uint8x16x4_t low = vld1q_u8_x4(rgbDecodeTable);
+    uint8x16x4_t high = vld1q_u8_x4(rgbDecodeTable + 64);
+    size_t consumed = 0;
+    for(; length - consumed >= 64; consumed += 64, output += 48)
+    {
+        uint8x16x4_t in = vld4q_u8(input + consumed);
+        uint8x16_t v0 = DecodeLookupNEON(low, high, in.val[0]);
+        uint8x16_t v1 = DecodeLookupNEON(low, high, in.val[1]);
+        uint8x16_t v2 = DecodeLookupNEON(low, high, in.val[2]);
+        uint8x16_t v3 = DecodeLookupNEON(low, high, in.val[3]);
+        uint8x16_t invalid = vorrq_u8(vorrq_u8(vorrq_u8(v0, v1), vorrq_u8(v2, v3)),
+                                      vorrq_u8(vorrq_u8(in.val[0], in.val[1]), vorrq_u8(in.val[2], in.val[3])));
+        if (vmaxvq_u8(invalid) & 0x80)
         {
-            return false;
+            break;
         }
+        uint8x16x3_t out;
+        out.val[0] = vorrq_u8(vshlq_n_u8(v0, 2), vshrq_n_u8(v1, 4));
+        out.val[1] = vorrq_u8(vshlq_n_u8(v1, 4), vshrq_n_u8(v2, 2));
+        out.val[2] = vorrq_u8(vshlq_n_u8(v2, 6), v3);
+        vst3q_u8(output, out);
     }
-    return true;
+    return consumed;
 }
 
-@implementation NSString (ADHelperMethods)
+#elif AD_BASE64_SSSE3
 
-/// <summary>
-/// Base64 URL decode a set of bytes.
-/// </summary>
-/// <remarks>
-/// See RFC 4648, Section 5 plus switch characters 62 and 63 and no padding.
-/// For a good overview of Base64 encoding, see http://en.wikipedia.org/wiki/Base64
-/// </remarks>
-+ (NSData *) Base64DecodeData:(NSString *)encodedString
+//Encodes 12 bytes into 16 characters per iteration. The loads are 16 bytes wide, hence the loop
+//stops while at least 16 bytes are left. Returns the number of the bytes consumed.
+static size_t Base64UrlEncodeSIMD(const byte* input, size_t length, char* output)
 {
-    if ( nil == encodedString )
+    const __m128i shuffle = _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+    size_t consumed = 0;
+    for(; length - consumed >= 16; consumed += 12, output += 16)
     {
-        return nil;
+        __m128i in = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(input + consumed)), shuffle);
+        //Splits each 3 bytes into four 6-bit indices, one per byte:
+        __m128i t0 = _mm_mulhi_epu16(_mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00)), _mm_set1_epi32(0x04000040));
+        __m128i t1 = _mm_mullo_epi16(_mm_and_si128(in, _mm_set1_epi32(0x003f03f0)), _mm_set1_epi32(0x01000010));
+        __m128i indices = _mm_or_si128(t0, t1);
+        //Maps the indices to the alphabet: 0-25 -> 'A'-'Z', 26-51 -> 'a'-'z', 52-61 -> '0'-'9', 62 -> '-', 63 -> '_'
+        __m128i offset = _mm_set1_epi8(65);
+        offset = _mm_add_epi8(offset, _mm_and_si128(_mm_cmpgt_epi8(indices, _mm_set1_epi8(25)), _mm_set1_epi8(6)));
+        offset = _mm_add_epi8(offset, _mm_and_si128(_mm_cmpgt_epi8(indices, _mm_set1_epi8(51)), _mm_set1_epi8(-75)));
+        offset = _mm_add_epi8(offset, _mm_and_si128(_mm_cmpeq_epi8(indices, _mm_set1_epi8(62)), _mm_set1_epi8(-13)));
+        offset = _mm_add_epi8(offset, _mm_and_si128(_mm_cmpeq_epi8(indices, _mm_set1_epi8(63)), _mm_set1_epi8(36)));
+        _mm_storeu_si128((__m128i*)output, _mm_add_epi8(indices, offset));
     }
-    
-    NSData      *encodedBytes = [encodedString dataUsingEncoding:NSUTF8StringEncoding];
-    const byte  *pbEncoded    = [encodedBytes bytes];
-    const int    cbEncoded    = (int)[encodedBytes length];
-    if (!validBase64Characters(pbEncoded, cbEncoded))
+    return consumed;
+}
+
+//Returns the mask of the characters within [first, last]. The comparison is signed, so the
+//non-ASCII characters never match.
+static inline __m128i InRangeSSSE3(__m128i c, char first, char last)
+{
+    return _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8(first - 1)), _mm_cmpgt_epi8(_mm_set1_epi8(last + 1), c));
+}
+
+//Decodes 16 characters into 12 bytes per iteration. The stores are 16 bytes wide, hence the loop
+//stops while at least 24 characters (18 bytes) are left. Returns the number of the characters consumed;
+//stops at the first block with invalid characters and leaves it to the scalar code to report.
+static size_t Base64UrlDecodeSIMD(const byte* input, size_t length, byte* output)
+{
+    const __m128i shuffle = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    size_t consumed = 0;
+    for(; length - consumed >= 24; consumed += 16, output += 12)
     {
-        return nil;
+        __m128i c = _mm_loadu_si128((const __m128i*)(input + consumed));
+        __m128i upper = InRangeSSSE3(c, 'A', 'Z');
+        __m128i lower = InRangeSSSE3(c, 'a', 'z');
+        __m128i digit = InRangeSSSE3(c, '0', '9');
+        __m128i dash = _mm_cmpeq_epi8(c, _mm_set1_epi8('-'));
+        __m128i underscore = _mm_cmpeq_epi8(c, _mm_set1_epi8('_'));
+        __m128i padding = _mm_cmpeq_epi8(c, _mm_set1_epi8('='));//Decoded as 0, as in rgbDecodeTable
+        __m128i valid = _mm_or_si128(_mm_or_si128(_mm_or_si128(upper, lower), _mm_or_si128(digit, dash)),
+                                     _mm_or_si128(underscore, padding));
+        if (_mm_movemask_epi8(valid) != 0xFFFF)
+        {
+            break;
+        }
+        __m128i offset = _mm_and_si128(upper, _mm_set1_epi8(-65));
+        offset = _mm_or_si128(offset, _mm_and_si128(lower, _mm_set1_epi8(-71)));
+        offset = _mm_or_si128(offset, _mm_and_si128(digit, _mm_set1_epi8(4)));
+        offset = _mm_or_si128(offset, _mm_and_si128(dash, _mm_set1_epi8(17)));
+        offset = _mm_or_si128(offset, _mm_and_si128(underscore, _mm_set1_epi8(-32)));
+        offset = _mm_or_si128(offset, _mm_and_si128(padding, _mm_set1_epi8(-61)));
+        __m128i values = _mm_add_epi8(c, offset);
+        //Merges the 6-bit values: pairs into 12 bits, then the pairs of pairs into 24 bits per 32-bit lane:
+        __m128i merged = _mm_madd_epi16(_mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140)), _mm_set1_epi32(0x00011000));
+        _mm_storeu_si128((__m128i*)output, _mm_shuffle_epi8(merged, shuffle));
     }
-    
-    int   cbDecodedSize;
-    int   ich;
-    int   ib;
-    byte  b0, b1, b2, b3;
-    
-    // The input string lacks the usual '=' padding at the end, so the valid end sequences
-    // are:
-    //      ........XX           (cbEncodedSize % 4) == 2    (2 chars of virtual padding)
-    //      ........XXX          (cbEncodedSize % 4) == 3    (1 char of virtual padding)
-    //      ........XXXX         (cbEncodedSize % 4) == 0    (no virtual padding)
-    // Invalid sequences are:
-    //      ........X            (cbEncodedSize % 4) == 1
-    
-    // Input string is not sized correctly to be base64 URL encoded.
-    if ( ( 0 == cbEncoded ) || ( 1 == ( cbEncoded % 4 ) ) )
+    return consumed;
+}
+
+#else
+
+static inline size_t Base64UrlEncodeSIMD(const byte* input, size_t length, char* output)
+{
+    return 0;
+}
+
+static inline size_t Base64UrlDecodeSIMD(const byte* input, size_t length, byte* output)
+{
+    return 0;
+}
+
+#endif
+
+//Returns the size of the decoded data, or SIZE_MAX if the length is not valid for base64url.
+//The valid end sequences are:
+//      ........XX           (length % 4) == 2    (2 chars of virtual padding)
+//      ........XXX          (length % 4) == 3    (1 char of virtual padding)
+//      ........XXXX         (length % 4) == 0    (no virtual padding)
+static inline size_t Base64UrlDecodedLength(size_t length)
+{
+    if (0 == length || 1 == (length % 4))
     {
-        return nil;
+        return SIZE_MAX;
     }
-    
-    // 'virtual padding' is how many trailing '=' characters we would have
-    // had under 'normal' base-64 encoding
-    int virtualPadding = ( ( cbEncoded % 4 ) == 2 ) ? 2 : ( ( cbEncoded % 4 ) == 3 ) ? 1 : 0;
-    
-    // Calculate decoded buffer size.
-    cbDecodedSize = (cbEncoded + virtualPadding + 3) / 4 * 3;
-    cbDecodedSize -= virtualPadding;
-    
-    byte *pbDecoded = (byte *)calloc( cbDecodedSize, sizeof(byte) );
-    
-    if(!pbDecoded) {
-        return nil;
-    }
-    
-    // Decode each four-byte cluster into the corresponding three data bytes,
-    // allowing for the fact that the last cluster may be less than four bytes
-    // (virtual padding).
-    ich = ib = 0;
-    
-    int end4 = (cbEncoded/4)*4;
-    //Quick loop, no boundary checks:
-    for(; ich < end4; )
+    return length / 4 * 3 + ((length % 4) ? (length % 4) - 1 : 0);
+}
+
+//Decodes the characters without the SIMD kernels. The output should have room for Base64UrlDecodedLength bytes.
+//Returns NO, if the input contains invalid characters.
+static BOOL Base64UrlDecodeScalar(const byte* input, size_t length, byte* output)
+{
+    size_t consumed = 0;
+    for(; length - consumed >= 4; consumed += 4, output += 3)
     {
-        b0 = rgbDecodeTable[pbEncoded[ich++]];
-        b1 = rgbDecodeTable[pbEncoded[ich++]];
-        b2 = rgbDecodeTable[pbEncoded[ich++]];
-        b3 = rgbDecodeTable[pbEncoded[ich++]];
-        
-        pbDecoded[ib++] = (b0 << 2) | (b1 >> 4);
-        pbDecoded[ib++] = (b1 << 4) | (b2 >> 2);
-        pbDecoded[ib++] = (b2 << 6) | b3;
+        if (!Decode4bytesTo3bytes(input + consumed, output))
+        {
+            return NO;
+        }
     }
     
-    //Beyond the padding to 4. Requires boundary checks,
-    //but the inner side shouldn't be executed more than 3 times:
-    while ( ich < cbEncoded )
+    //The last cluster may be less than 4 characters (virtual padding):
+    if (consumed < length)
     {
-        b0 = rgbDecodeTable[pbEncoded[ich++]];
-        b1 = (ich < cbEncoded) ? rgbDecodeTable[pbEncoded[ich++]] : 0;
-        b2 = (ich < cbEncoded) ? rgbDecodeTable[pbEncoded[ich++]] : 0;
-        b3 = (ich < cbEncoded) ? rgbDecodeTable[pbEncoded[ich++]] : 0;
-        
-        pbDecoded[ib++] = (b0 << 2) | (b1 >> 4);
-        
-        if (ib < cbDecodedSize) {
-            pbDecoded[ib++] = (b1 << 4) | (b2 >> 2);
-            
-            if (ib < cbDecodedSize) {
-                pbDecoded[ib++] = (b2 << 6) | b3;
-            }
+        byte last[4] = { 'A', 'A', 'A', 'A' };
+        byte decoded[3];
+        size_t left = length - consumed;
+        memcpy(last, input + consumed, left);
+        if (!Decode4bytesTo3bytes(last, decoded))
+        {
+            return NO;
         }
+        memcpy(output, decoded, left - 1);
     }
-    
-    // Place the result in a NSData object and then free it.
-    NSData *result = [NSData dataWithBytes:pbDecoded length:cbDecodedSize];
-    
-    free( pbDecoded );
-    
-    return result;
+    return YES;
 }
 
-- (NSString *) adBase64UrlDecode
+//Decodes the characters into the output, which should have room for Base64UrlDecodedLength bytes.
+//The SIMD kernels decode the bulk of the input; the rest goes through the scalar code.
+//Returns NO, if the input contains invalid characters.
+static BOOL Base64UrlDecode(const byte* input, size_t length, byte* output)
 {
-    NSData *decodedData = [self.class Base64DecodeData:self];
-    
-    return [[NSString alloc] initWithData:decodedData encoding:NSUTF8StringEncoding];
+    size_t consumed = Base64UrlDecodeSIMD(input, length, output);
+    return Base64UrlDecodeScalar(input + consumed, length - consumed, output + consumed / 4 * 3);
+}
+
+//Returns the number of the characters needed to encode "length" bytes (without padding):
+static inline size_t Base64UrlEncodedLength(size_t length)
+{
+    return length / 3 * 4 + ((length % 3) ? (length % 3) + 1 : 0);
 }
 
 //Helper method to encode 3 bytes into a sequence of 4 bytes:
@@ -174,94 +281,191 @@ static inline void Encode3bytesTo4bytes(char* output, int b0, int b1, int b2)
     output[3] = base64UrlEncodeTable[b2 & 0x3f];
 }
 
+//Encodes the bytes without the SIMD kernels. The output should have room for Base64UrlEncodedLength characters.
+static void Base64UrlEncodeScalar(const byte* input, size_t length, char* output)
+{
+    size_t consumed = 0;
+    for(; length - consumed >= 3; consumed += 3, output += 4)
+    {
+        Encode3bytesTo4bytes(output, input[consumed], input[consumed + 1], input[consumed + 2]);
+    }
+    
+    //Where we would have padded it, we instead truncate the output:
+    if (consumed < length)
+    {
+        char last[4];
+        size_t left = length - consumed;
+        Encode3bytesTo4bytes(last, input[consumed], (left > 1) ? input[consumed + 1] : 0, 0);
+        memcpy(output, last, left + 1);
+    }
+}
+
+//Encodes the bytes into the output, which should have room for Base64UrlEncodedLength characters.
+//The SIMD kernels encode the bulk of the input; the rest goes through the scalar code.
+static void Base64UrlEncode(const byte* input, size_t length, char* output)
+{
+    size_t consumed = Base64UrlEncodeSIMD(input, length, output);
+    Base64UrlEncodeScalar(input + consumed, length - consumed, output + consumed / 3 * 4);
+}
+
+//Returns the UTF-8 bytes of the string, without copying them where possible. The length comes from the
+//string rather than strlen, as the string may contain embedded NUL characters. When the bytes need
+//a conversion, "storage" keeps them alive for the caller.
+static const byte* UTF8BytesOfString(NSString* string, size_t* length, NSData* __autoreleasing* storage)
+{
+    const char* utf8 = CFStringGetCStringPtr((__bridge CFStringRef)string, kCFStringEncodingUTF8);
+    if (utf8)
+    {
+        *length = [string lengthOfBytesUsingEncoding:NSUTF8StringEncoding];
+        return (const byte*)utf8;
+    }
+    NSData* data = [string dataUsingEncoding:NSUTF8StringEncoding];
+    *storage = data;
+    *length = data.length;
+    return (const byte*)data.bytes;
+}
+
+//Decodes the string into a new buffer, which is owned by the caller. Returns NULL if the string is not valid base64url.
+//"scalar" bypasses the SIMD kernels.
+static byte* Base64UrlDecodeString(NSString* encodedString, size_t* length, BOOL scalar)
+{
+    size_t cbEncoded;
+    NSData* storage = nil;
+    const byte* pbEncoded = UTF8BytesOfString(encodedString, &cbEncoded, &storage);
+    size_t cbDecoded = Base64UrlDecodedLength(cbEncoded);
+    if (SIZE_MAX == cbDecoded)
+    {
+        return NULL;
+    }
+    
+    byte* pbDecoded = (byte*)malloc(cbDecoded);
+    if (!pbDecoded)
+    {
+        return NULL;
+    }
+    BOOL decoded = (scalar) ? Base64UrlDecodeScalar(pbEncoded, cbEncoded, pbDecoded)
+                            : Base64UrlDecode(pbEncoded, cbEncoded, pbDecoded);
+    if (!decoded)
+    {
+        free(pbDecoded);
+        return NULL;
+    }
+    *length = cbDecoded;
+    return pbDecoded;
+}
+
+//Encodes the bytes directly into the buffer of the returned string. "scalar" bypasses the SIMD kernels.
+static NSString* Base64UrlEncodeBytes(const byte* bytes, size_t length, BOOL scalar)
+{
+    size_t cbEncoded = Base64UrlEncodedLength(length);
+    if (!cbEncoded)
+    {
+        return @"";
+    }
+    
+    char* pbEncoded = (char*)malloc(cbEncoded);
+    if (!pbEncoded)
+    {
+        return nil;
+    }
+    if (scalar)
+    {
+        Base64UrlEncodeScalar(bytes, length, pbEncoded);
+    }
+    else
+    {
+        Base64UrlEncode(bytes, length, pbEncoded);
+    }
+    NSString* result = [[NSString alloc] initWithBytesNoCopy:pbEncoded length:cbEncoded encoding:NSASCIIStringEncoding freeWhenDone:YES];
+    if (!result)
+    {
+        free(pbEncoded);
+    }
+    return result;
+}
+
+@implementation NSString (ADHelperMethods)
+
 /// <summary>
-/// Base64 URL encode a set of bytes.
+/// Base64 URL decode a set of bytes.
 /// </summary>
 /// <remarks>
 /// See RFC 4648, Section 5 plus switch characters 62 and 63 and no padding.
 /// For a good overview of Base64 encoding, see http://en.wikipedia.org/wiki/Base64
 /// </remarks>
-+ (NSString *) Base64EncodeData:(NSData *)data
++ (NSData *) Base64DecodeData:(NSString *)encodedString
 {
-    if ( nil == data )
-        return nil;
-    
-    const byte *pbBytes = [data bytes];
-    int         cbBytes = (int)[data length];
-    
-    // Calculate encoded string size including padding. This may be more than is actually
-    // required since we will not pad and instead will terminate with null. The computation
-    // is the number of byte triples times 4 radix64 characters plus 1 for null termination.
-    int   encodedSize = 1 + ( cbBytes + 2 ) / 3 * 4;
-    char *pbEncoded = (char *)calloc( encodedSize, sizeof(char) );
-    
-    if(!pbEncoded){
+    if ( nil == encodedString )
+    {
         return nil;
     }
     
-    // Encode data byte triplets into four-byte clusters.
-    int   iBytes;      // raw byte index
-    int   iEncoded;    // encoded byte index
-    byte  b0, b1, b2;  // individual bytes for triplet
-    
-    iBytes = iEncoded = 0;
-    
-    int end3 = (cbBytes/3)*3;
-    //Fast loop, no bounderies check:
-    for ( ; iBytes < end3; )
+    size_t length;
+    byte* decoded = Base64UrlDecodeString(encodedString, &length, NO);
+    //The buffer is handed over to the returned object, without a copy:
+    return (decoded) ? [NSData dataWithBytesNoCopy:decoded length:length freeWhenDone:YES] : nil;
+}
+
+- (NSString *) adBase64UrlDecode
+{
+    size_t length;
+    byte* decoded = Base64UrlDecodeString(self, &length, NO);
+    if (!decoded)
     {
-        b0 = pbBytes[iBytes++];
-        b1 = pbBytes[iBytes++];
-        b2 = pbBytes[iBytes++];
-        
-        Encode3bytesTo4bytes(pbEncoded + iEncoded, b0, b1, b2);
-        iEncoded += 4;
+        return nil;
     }
     
-    //Slower loop should execute no more than 3 times:
-    while ( iBytes < cbBytes )
+    NSString* result = [[NSString alloc] initWithBytesNoCopy:decoded length:length encoding:NSUTF8StringEncoding freeWhenDone:YES];
+    if (!result)
     {
-        b0 = pbBytes[iBytes++];
-        b1 = (iBytes < cbBytes) ? pbBytes[iBytes++] : 0;                                        // Add extra zero byte if needed
-        b2 = (iBytes < cbBytes) ? pbBytes[iBytes++] : 0;                                        // Add extra zero byte if needed
-        
-        Encode3bytesTo4bytes(pbEncoded + iEncoded, b0, b1, b2);
-        iEncoded += 4;
+        free(decoded);
     }
+    return result;
+}
+
+/// <summary>
+/// Base64 URL encode a set of bytes.
+/// </summary>
+/// <remarks>
+/// See RFC 4648, Section 5 plus switch characters 62 and 63 and no padding.
+/// For a good overview of Base64 encoding, see http://en.wikipedia.org/wiki/Base64
+/// </remarks>
++ (NSString *) Base64EncodeData:(NSData *)data
+{
+    if ( nil == data )
+        return nil;
     
-    // Where we would have padded it, we instead truncate the string
-    switch ( cbBytes % 3 )
+    return Base64UrlEncodeBytes([data bytes], [data length], NO);
+}
+
++ (NSString *) Base64EncodeDataScalar:(NSData *)data
+{
+    if ( nil == data )
+        return nil;
+    
+    return Base64UrlEncodeBytes([data bytes], [data length], YES);
+}
+
++ (NSData *) Base64DecodeDataScalar:(NSString *)encodedString
+{
+    if ( nil == encodedString )
     {
-        case 0:
-            // No left overs, nothing to pad
-            break;
-            
-        case 1:
-            // One left over, normally pad 2
-            pbEncoded[iEncoded - 2] = '\0';
-            // fall through
-            
-        case 2:
-            pbEncoded[iEncoded - 1] = '\0';
-            break;
+        return nil;
     }
     
-    // Null terminate, convert to NSString and free the buffer
-    pbEncoded[iEncoded++] = '\0';
-    
-    NSString *result = [NSString stringWithCString:pbEncoded encoding:NSUTF8StringEncoding];
-    
-    free(pbEncoded);
-    
-    return result;
+    size_t length;
+    byte* decoded = Base64UrlDecodeString(encodedString, &length, YES);
+    return (decoded) ? [NSData dataWithBytesNoCopy:decoded length:length freeWhenDone:YES] : nil;
 }
 
 // Base64 URL encodes a string
 - (NSString *) adBase64UrlEncode
 {
-    NSData *decodedData = [self dataUsingEncoding:NSUTF8StringEncoding];
+    size_t length;
+    NSData* storage = nil;
+    const byte* bytes = UTF8BytesOfString(self, &length, &storage);
     
-    return [self.class Base64EncodeData:decodedData];
+    return Base64UrlEncodeBytes(bytes, length, NO);
 }
 
 /* Caches statically the non-white characterset */
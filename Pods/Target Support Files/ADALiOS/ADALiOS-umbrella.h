@@ -27,20 +27,30 @@
 #import "ADBrokerKeyHelper.h"
 #import "ADClientMetrics.h"
 #import "ADErrorCodes.h"
+#import "ADHTTPTransport.h"
 #import "ADHelpers.h"
 #import "ADInstanceDiscovery.h"
 #import "ADKeyChainHelper.h"
 #import "ADKeychainTokenCacheStore.h"
 #import "ADLogger.h"
+#import "ADLoopbackTransport.h"
+#import "ADMemoryTokenCacheStore.h"
 #import "ADNTLMHandler.h"
 #import "ADOAuth2Constants.h"
 #import "ADPkeyAuthHelper.h"
 #import "ADRegistrationInformation.h"
+#import "ADRequestContext.h"
+#import "ADTokenCacheItemSerializer.h"
 #import "ADTokenCacheStoreItem.h"
+#import "ADTokenCacheStoreKey+Internal.h"
 #import "ADTokenCacheStoreKey.h"
 #import "ADTokenCacheStoring.h"
 #import "ADTokenCacheValue.h"
+#import "ADTokenResponseDecoder.h"
+#import "ADTraceSpan.h"
 #import "ADURLProtocol.h"
+#import "ADURLSessionTransport.h"
+#import "ADUserInformation+Internal.h"
 #import "ADUserInformation.h"
 #import "ADWebRequest.h"
 #import "ADWebResponse.h"